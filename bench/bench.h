@@ -0,0 +1,34 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef __BENCH_H__
+#define __BENCH_H__ 1
+
+/* Seconds on the monotonic clock */
+static inline double bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, so every run sees the same corpus */
+static inline uint64_t bench_rand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+/* Keeps results alive so the compiler can't drop the work */
+static volatile double bench_sink;
+
+#endif /* __BENCH_H__ */
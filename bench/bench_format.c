@@ -0,0 +1,151 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Graphite payload formatting: a million metric lines through the
+ * lines_*() builder against utstring_printf() with %Lf and %f as the
+ * flush used to write them. The mix is a flush's: counters (a rate and
+ * a count), timers (mean, upper, lower, sum, std, count, upper_90) and
+ * gauges, with the values they typically carry.
+ *
+ * Usage: bench_format [lines]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/format.h"
+#include "../src/keys.h"
+#include "bench.h"
+
+#define KEYS 1000
+
+static statsd_key_t *keys[KEYS];
+static double values[KEYS][7];
+
+static void fill(uint64_t *rng) {
+  int i, j;
+  for (i = 0; i < KEYS; i++) {
+    char name[64];
+    uint64_t r = bench_rand(rng);
+    int len = sprintf(name, "api_svc%d_endpoint_%d_%s", (int) ( r % 40 ), (int) ( ( r >> 8 ) % 200 ),
+      i % 3 == 0 ? "requests" : i % 3 == 1 ? "latency" : "queue_depth");
+    keys[i] = key_intern(name, len, -1);
+    for (j = 0; j < 7; j++) {
+      r = bench_rand(rng);
+      values[i][j] = j == 5 || i % 3 != 1 ? (double) ( r % 100000 ) : ( r % 10000000 ) / 1000.0;
+    }
+  }
+}
+
+/* Returns the lines written */
+static long format_new(UT_string *out, long total) {
+  statsd_lines_t lines;
+  long n = 0;
+  int i = 0;
+
+  lines_init(&lines, out, "1700000000");
+  while (n < total) {
+    statsd_key_t *k = keys[i];
+    double *v = values[i];
+    switch (i % 3) {
+      case 0:
+        lines_stem(&lines, "stats.", k, "");
+        lines_add(&lines, "", v[0] / 10);
+        lines_stem(&lines, "stats_counts_", k, "");
+        lines_add(&lines, "", v[0]);
+        n += 2;
+        break;
+      case 1:
+        lines_stem(&lines, "stats.timers.", k, ".");
+        lines_add(&lines, "mean", v[0]);
+        lines_add(&lines, "upper", v[1]);
+        lines_add(&lines, "lower", v[2]);
+        lines_add(&lines, "sum", v[3]);
+        lines_add(&lines, "std", v[4]);
+        lines_add_long(&lines, "count", (long) v[5]);
+        lines_add(&lines, "upper_90", v[6]);
+        n += 7;
+        break;
+      default:
+        lines_stem(&lines, "stats.", k, "");
+        lines_add(&lines, "", v[0]);
+        lines_stem(&lines, "stats_gauges_", k, "");
+        lines_add(&lines, "", v[0]);
+        n += 2;
+        break;
+    }
+    i = ( i + 1 ) % KEYS;
+  }
+  return n;
+}
+
+static long format_old(UT_string *out, long total) {
+  long n = 0, ts = 1700000000;
+  int i = 0;
+
+  while (n < total) {
+    const char *name = keys[i]->name;
+    double *v = values[i];
+    switch (i % 3) {
+      case 0:
+        utstring_printf(out, "stats.%s %Lf %ld\nstats_counts_%s %Lf %ld\n", name, (long double) v[0] / 10, ts, name, (long double) v[0], ts);
+        n += 2;
+        break;
+      case 1:
+        utstring_printf(out, "stats.timers.%s.mean %f %ld\n"
+          "stats.timers.%s.upper %f %ld\n"
+          "stats.timers.%s.lower %f %ld\n"
+          "stats.timers.%s.sum %f %ld\n"
+          "stats.timers.%s.std %f %ld\n"
+          "stats.timers.%s.count %d %ld\n",
+          name, v[0], ts, name, v[1], ts, name, v[2], ts, name, v[3], ts, name, v[4], ts, name, (int) v[5], ts);
+        utstring_printf(out, "stats.timers.%s.upper_%s %f %ld\n", name, "90", v[6], ts);
+        n += 7;
+        break;
+      default:
+        utstring_printf(out, "stats.%s %Lf %ld\nstats_gauges_%s %Lf %ld\n", name, (long double) v[0], ts, name, (long double) v[0], ts);
+        n += 2;
+        break;
+    }
+    i = ( i + 1 ) % KEYS;
+  }
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  long total = argc > 1 ? atol(argv[1]) : 1000000, n_new, n_old;
+  uint64_t rng = 19;
+  double t, t_new, t_old;
+  UT_string *out;
+  size_t bytes_new, bytes_old;
+
+  keys_init();
+  fill(&rng);
+  utstring_new(out);
+
+  /* Each run starts from a buffer already grown, as a flusher's is */
+  format_new(out, total);
+  utstring_clear(out);
+  t = bench_now();
+  n_new = format_new(out, total);
+  t_new = bench_now() - t;
+  bytes_new = utstring_len(out);
+
+  utstring_clear(out);
+  t = bench_now();
+  n_old = format_old(out, total);
+  t_old = bench_now() - t;
+  bytes_old = utstring_len(out);
+
+  printf("lines_add:       %10.0f lines/s, %5.1f bytes a line\n", n_new / t_new, (double) bytes_new / n_new);
+  printf("utstring_printf: %10.0f lines/s, %5.1f bytes a line\n", n_old / t_old, (double) bytes_old / n_old);
+  printf("speedup:         %10.2fx\n", t_old / t_new);
+  utstring_free(out);
+  return 0;
+}
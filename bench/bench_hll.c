@@ -0,0 +1,109 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * HyperLogLog sets: insert rate (hashing the value and updating its
+ * register) and merge rate for each kernel at a few precisions, then
+ * the estimate's error over cardinalities from 10 to 10 million, mean
+ * and worst over several trials, against the standard error.
+ *
+ * Usage: bench_hll [inserts]
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/hll.h"
+#include "bench.h"
+
+#define TRIALS 8
+
+static void add_values(statsd_hll_t *h, long from, long n) {
+  char value[32];
+  long i;
+  for (i = from; i < from + n; i++) {
+    int len = sprintf(value, "user%ld", i);
+    hll_add(h, hll_hash(value, len));
+  }
+}
+
+static void bench_rates(long total) {
+  static const char *kernels[] = { "scalar", "sse2", "avx2" };
+  static const int precisions[] = { 10, 12, 14 };
+  unsigned p, k;
+
+  for (p = 0; p < sizeof(precisions) / sizeof(precisions[0]); p++) {
+    statsd_hll_t *a, *b;
+    char values[1024][16];
+    int lens[1024], i;
+    double t;
+    long n, merges;
+
+    hll_init(precisions[p]);
+    a = hll_new();
+    b = hll_new();
+    for (i = 0; i < 1024; i++) lens[i] = sprintf(values[i], "u%d", i * 7919);
+
+    t = bench_now();
+    for (n = 0; n < total; n++) {
+      hll_add(a, hll_hash(values[n & 1023], lens[n & 1023]));
+    }
+    t = bench_now() - t;
+    printf("p %2d: %6.1f M inserts/s", precisions[p], total / t / 1e6);
+
+    add_values(b, 0, 100000);
+    merges = total / ( 1 << precisions[p] ) * 16;
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+      if (!hll_select(kernels[k])) continue;
+      t = bench_now();
+      for (n = 0; n < merges; n++) {
+        b->registers[n & ( ( 1 << precisions[p] ) - 1 )]++;
+        hll_merge(a, b);
+      }
+      t = bench_now() - t;
+      printf(", %s %7.0f K merges/s", kernels[k], merges / t / 1e3);
+    }
+    printf("\n");
+    bench_sink = hll_count(a);
+    hll_free(a);
+    hll_free(b);
+  }
+}
+
+static void bench_error(int precision) {
+  double sigma = 1.04 / sqrt((double) ( 1 << precision ));
+  long n;
+
+  hll_init(precision);
+  printf("p %d, standard error %.4f:\n", precision, sigma);
+  for (n = 10; n <= 10000000; n *= 10) {
+    double sum = 0, worst = 0;
+    int trials = n >= 1000000 ? 2 : TRIALS, i;
+
+    for (i = 0; i < trials; i++) {
+      statsd_hll_t *h = hll_new();
+      double err;
+      add_values(h, ( i + 1 ) * 100000000L, n);
+      err = fabs(hll_count(h) - n) / n;
+      sum += err;
+      if (err > worst) worst = err;
+      hll_free(h);
+    }
+    printf("  %9ld values: mean error %.4f, worst %.4f over %d trials\n", n, sum / trials, worst, trials);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long total = argc > 1 ? atol(argv[1]) : 50000000;
+
+  bench_rates(total);
+  bench_error(12);
+  bench_error(14);
+  return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Ingest throughput, one metric per datagram against newline-batched
+ * datagrams of up to 1400 bytes, as batching clients send. Every
+ * datagram goes over loopback UDP, is received and is parsed into an
+ * aggregation map, all on one thread so nothing is dropped; what is
+ * timed is the per-packet cost (two syscalls and a parse) plus the
+ * per-metric one.
+ *
+ * Usage: bench_ingest [metrics]
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../src/aggregate.h"
+#include "../src/ingest.h"
+#include "../src/statsd.h"
+#include "../tests/tables.h"
+#include "bench.h"
+
+#define DATAGRAM_MAX 1400
+#define IN_FLIGHT 32
+
+static int tx, rx;
+static struct sockaddr_in addr;
+static statsd_agg_t agg;
+
+static void drain(int n) {
+  static char buf[BUFLEN + 1];
+  while (n-- > 0) {
+    ssize_t len = recv(rx, buf, BUFLEN, 0);
+    if (len > 0) {
+      buf[len] = '\0';
+      process_stats_packet(&agg, buf, len);
+    }
+  }
+}
+
+/* Send total metrics, at most per_packet to a datagram; returns datagrams sent */
+static long run(long total, int per_packet, uint64_t *rng) {
+  char buf[DATAGRAM_MAX + 128];
+  long sent = 0, packets = 0;
+  int len = 0, in_packet = 0, in_flight = 0;
+
+  while (sent < total) {
+    uint64_t r = bench_rand(rng);
+    char line[128];
+    int n = r & 1
+      ? sprintf(line, "api.svc%d.endpoint_%d.requests:1|c", (int) ( r >> 8 ) % 40, (int) ( r >> 16 ) % 200)
+      : sprintf(line, "api.svc%d.endpoint_%d.latency:%d|ms", (int) ( r >> 8 ) % 40, (int) ( r >> 16 ) % 200, (int) ( r >> 24 ) % 1000);
+
+    if (in_packet > 0 && ( in_packet == per_packet || len + 1 + n > DATAGRAM_MAX )) {
+      sendto(tx, buf, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+      packets++;
+      len = in_packet = 0;
+      if (++in_flight == IN_FLIGHT) {
+        drain(in_flight);
+        in_flight = 0;
+      }
+    }
+    if (in_packet > 0) buf[len++] = '\n';
+    memcpy(buf + len, line, n);
+    len += n;
+    in_packet++;
+    sent++;
+  }
+  sendto(tx, buf, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+  drain(in_flight + 1);
+  agg_merge(&agg);
+  return packets + 1;
+}
+
+int main(int argc, char *argv[]) {
+  long total = argc > 1 ? atol(argv[1]) : 1000000, packets;
+  socklen_t addrlen = sizeof(addr);
+  uint64_t rng = 7;
+  int sizes[] = { 1, 0 }, i;
+
+  tables_init();
+  agg_init(&agg);
+
+  rx = socket(AF_INET, SOCK_DGRAM, 0);
+  tx = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(rx, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || getsockname(rx, (struct sockaddr *) &addr, &addrlen) < 0) {
+    perror("bind");
+    return 1;
+  }
+
+  for (i = 0; i < 2; i++) {
+    double t = bench_now(), elapsed;
+    packets = run(total, sizes[i] ? sizes[i] : total, &rng);
+    elapsed = bench_now() - t;
+    printf("%-22s %9ld datagrams, %10.0f metrics/s, %9.0f datagrams/s\n",
+      sizes[i] ? "one metric a datagram:" : "batched to 1400 bytes:",
+      packets, total / elapsed, packets / elapsed);
+  }
+  close(rx);
+  close(tx);
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * statsd_parse_number() against strtod() on three corpora: integers,
+ * short decimals as timers send them, and exotic values (exponents,
+ * long mantissas) that take the strtod() slow path anyway. strtod()
+ * gets a NULL terminated copy, as the old parser made for it.
+ *
+ * Usage: bench_number [numbers]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/parser.h"
+#include "bench.h"
+
+#define CORPUS 65536
+#define NUMBER_MAX 32
+
+static char corpus[CORPUS][NUMBER_MAX];
+static int lens[CORPUS];
+
+static void fill(int kind, uint64_t *rng) {
+  int i;
+  for (i = 0; i < CORPUS; i++) {
+    uint64_t r = bench_rand(rng);
+    switch (kind) {
+      case 0:
+        lens[i] = sprintf(corpus[i], "%d", (int) ( r % 100000 ));
+        break;
+      case 1:
+        lens[i] = sprintf(corpus[i], "%d.%02d", (int) ( r % 10000 ), (int) ( r >> 32 ) % 100);
+        break;
+      default:
+        lens[i] = sprintf(corpus[i], r & 1 ? "%.17g" : "%.6e", (double) ( r >> 11 ) / 9007199254740992.0 * 1e6);
+        break;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const char *names[] = { "integers", "short decimals", "exotic" };
+  long total = argc > 1 ? atol(argv[1]) : 10000000, n;
+  uint64_t rng = 3;
+  int kind;
+
+  for (kind = 0; kind < 3; kind++) {
+    double t, t_ours, t_strtod, sum = 0, v;
+    char buf[NUMBER_MAX + 1];
+
+    fill(kind, &rng);
+    t = bench_now();
+    for (n = 0; n < total; n++) {
+      int i = n % CORPUS;
+      if (statsd_parse_number(corpus[i], lens[i], &v) == 0) sum += v;
+    }
+    t_ours = bench_now() - t;
+
+    t = bench_now();
+    for (n = 0; n < total; n++) {
+      int i = n % CORPUS;
+      memcpy(buf, corpus[i], lens[i] + 1);
+      sum -= strtod(buf, NULL);
+    }
+    t_strtod = bench_now() - t;
+    bench_sink = sum;
+
+    printf("%-15s statsd_parse_number %6.1f ns, strtod %6.1f ns, %5.2fx\n", names[kind],
+      t_ours * 1e9 / total, t_strtod * 1e9 / total, t_strtod / t_ours);
+  }
+  return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Parser microbenchmark: lines per second through statsd_parse_line(),
+ * against the strtok_r() tokenizer process_stats_packet() used before
+ * it, over the same corpus of counters, sampled counters, timers and
+ * gauges. Only parsing is timed, not aggregation. The old tokenizer is
+ * kept here as it was, less its syslog(LOG_DEBUG) calls, so it is, if
+ * anything, flattered.
+ *
+ * Usage: bench_parser [lines]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/parser.h"
+#include "../src/scan.h"
+#include "../src/strings.h"
+#include "bench.h"
+
+#define CORPUS_LINES 100000
+#define LINE_MAX 256
+
+static void old_sanitize_value(char *k) {
+  char *p = k;
+  int c = 0;
+  while (*p != '\0') {
+    if ( *p == '.' || *p == '-' || (*p >= '0' && *p <= '9') ) {
+      *(k + c) = *p;
+      c++;
+    }
+    p++;
+  }
+  *(k + c) = '\0';
+}
+
+static void old_sanitize_gaugevalue(char *k) {
+  char *p = k;
+  int c = 0;
+  while (*p != '\0') {
+    if ( *p == '.' || *p == '-' || *p == '+' || (*p >= '0' && *p <= '9') ) {
+      *(k + c) = *p;
+      c++;
+    }
+    p++;
+  }
+  *(k + c) = '\0';
+}
+
+/* The body of the old process_stats_packet(), feeding a sum instead of the tables */
+static double old_parse(char *buf_in) {
+  char *key_name = NULL, *charvalue = NULL;
+  char *save, *subsave, *token, *subtoken, *bits, *fields;
+  double value = 1.0, sum = 0;
+  int i;
+
+  if (strlen(buf_in) < 2) return 0;
+
+  for (i = 1, bits = &buf_in[0]; ; i++, bits = NULL) {
+    token = strtok_r(bits, ":", &save);
+    if (token == NULL) break;
+    if (i == 1) {
+      key_name = strdup(token);
+      sanitize_key(key_name);
+    } else {
+      char *s_sample_rate = NULL;
+      double sample_rate = 1.0;
+      int is_timer = 0, is_gauge = 0, j;
+
+      for (j = 1, fields = token; ; j++, fields = NULL) {
+        subtoken = strtok_r(fields, "|", &subsave);
+        if (subtoken == NULL) break;
+        switch (j) {
+          case 1:
+            old_sanitize_gaugevalue(subtoken);
+            charvalue = strdup(subtoken);
+            break;
+          case 2:
+            if (strlen(subtoken) < 2) {
+              is_gauge = *subtoken == 'g';
+            } else if (*subtoken == 'm' && *(subtoken + 1) == 's') {
+              is_timer = 1;
+            }
+            break;
+          case 3:
+            s_sample_rate = strdup(subtoken);
+            break;
+        }
+      }
+
+      if (is_gauge && ( *charvalue == '-' || *charvalue == '+' )) {
+        old_sanitize_value(charvalue + 1);
+        value = strtod(charvalue + 1, NULL);
+      } else {
+        old_sanitize_value(charvalue);
+        value = strtod(charvalue, NULL);
+      }
+      if (!is_timer && !is_gauge && s_sample_rate && *s_sample_rate == '@') {
+        sample_rate = strtod(s_sample_rate + 1, NULL);
+      }
+      sum += value / sample_rate;
+      free(charvalue);
+      if (s_sample_rate) free(s_sample_rate);
+    }
+  }
+  if (i <= 2) sum += value;
+  if (key_name) free(key_name);
+  return sum;
+}
+
+static double new_parse(char *line, int len) {
+  uint64_t delims[ SCAN_WORDS(LINE_MAX) ];
+  statsd_line_t out;
+  double sum = 0;
+  int i;
+
+  statsd_scan(line, len, delims);
+  if (statsd_parse_line(line, len, delims, 0, &out) < 0) return 0;
+  for (i = 0; i < out.num_values; i++) {
+    sum += out.values[i].value / ( out.values[i].sample_rate > 0 ? out.values[i].sample_rate : 1 );
+  }
+  return out.num_values ? sum : 1;
+}
+
+/* A mix like a web tier's traffic: mostly counters and timers */
+static int make_line(char *buf, uint64_t *rng) {
+  uint64_t r = bench_rand(rng);
+  int svc = r % 40, ep = ( r >> 8 ) % 200, v = ( r >> 20 ) % 100000;
+
+  switch (( r >> 40 ) % 10) {
+    case 0: case 1: case 2:
+      return sprintf(buf, "api.svc%d.endpoint_%d.requests:1|c", svc, ep);
+    case 3:
+      return sprintf(buf, "api.svc%d.endpoint_%d.errors:%d|c|@0.1", svc, ep, v % 5);
+    case 4: case 5: case 6: case 7:
+      return sprintf(buf, "api.svc%d.endpoint_%d.latency:%d.%02d|ms", svc, ep, v / 100, v % 100);
+    case 8:
+      return sprintf(buf, "host.web%d.mem.used:%d|g", svc, v * 1000);
+    default:
+      return sprintf(buf, "queue.svc%d.depth:%c%d|g", svc, v & 1 ? '+' : '-', v % 50);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long total = argc > 1 ? atol(argv[1]) : 2000000, n;
+  char *corpus = malloc((size_t) CORPUS_LINES * LINE_MAX);
+  int *lens = malloc(CORPUS_LINES * sizeof(int));
+  char line[LINE_MAX];
+  uint64_t rng = 42;
+  double t, t_new, t_old, sum_new = 0, sum_old = 0;
+  int i;
+
+  scan_init();
+  for (i = 0; i < CORPUS_LINES; i++) {
+    lens[i] = make_line(corpus + (size_t) i * LINE_MAX, &rng);
+  }
+
+  /* Both parsers rewrite the line, so each gets a fresh copy */
+  t = bench_now();
+  for (n = 0; n < total; n++) {
+    i = n % CORPUS_LINES;
+    memcpy(line, corpus + (size_t) i * LINE_MAX, lens[i] + 1);
+    sum_new += new_parse(line, lens[i]);
+  }
+  t_new = bench_now() - t;
+
+  t = bench_now();
+  for (n = 0; n < total; n++) {
+    i = n % CORPUS_LINES;
+    memcpy(line, corpus + (size_t) i * LINE_MAX, lens[i] + 1);
+    sum_old += old_parse(line);
+  }
+  t_old = bench_now() - t;
+  bench_sink = sum_new + sum_old;
+
+  printf("scan kernel: %s\n", scan_kernel_name());
+  printf("statsd_parse_line: %10.0f lines/s\n", total / t_new);
+  printf("strtok_r (old):    %10.0f lines/s\n", total / t_old);
+  printf("speedup:           %10.2fx\n", t_old / t_new);
+  if (sum_new != sum_old) {
+    printf("warning: the parsers disagree, %f != %f\n", sum_new, sum_old);
+  }
+  free(corpus);
+  free(lens);
+  return 0;
+}
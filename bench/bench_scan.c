@@ -0,0 +1,125 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Delimiter scanning, kernel by kernel, over two packet corpora: single
+ * metric datagrams as most clients send them, and datagrams batched to
+ * 1400 bytes. Reported as bytes per second and nanoseconds per datagram,
+ * along with the whole parse of the same datagrams for scale.
+ *
+ * Usage: bench_scan [datagrams]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/parser.h"
+#include "../src/scan.h"
+#include "bench.h"
+
+#define CORPUS 4096
+#define DATAGRAM_MAX 1400
+
+static char corpus[CORPUS][DATAGRAM_MAX + 1];
+static int lens[CORPUS];
+
+static int make_line(char *buf, uint64_t *rng) {
+  uint64_t r = bench_rand(rng);
+  int svc = (int) ( r % 40 ), ep = (int) ( ( r >> 8 ) % 200 ), v = (int) ( ( r >> 20 ) % 100000 );
+
+  switch (( r >> 40 ) % 4) {
+    case 0:
+      return sprintf(buf, "api.svc%d.endpoint_%d.requests:1|c", svc, ep);
+    case 1:
+      return sprintf(buf, "api.svc%d.endpoint_%d.errors:%d|c|@0.1", svc, ep, v % 5);
+    case 2:
+      return sprintf(buf, "api.svc%d.endpoint_%d.latency:%d.%02d|ms", svc, ep, v / 100, v % 100);
+    default:
+      return sprintf(buf, "host.web%d.mem.used:%d|g", svc, v * 1000);
+  }
+}
+
+static long fill(int batched, uint64_t *rng) {
+  long bytes = 0;
+  int d;
+
+  for (d = 0; d < CORPUS; d++) {
+    char line[128];
+    int len = 0, n;
+    while (( n = make_line(line, rng) ) + len + 1 <= DATAGRAM_MAX) {
+      if (len > 0) corpus[d][len++] = '\n';
+      memcpy(corpus[d] + len, line, n);
+      len += n;
+      if (!batched) break;
+    }
+    corpus[d][len] = '\0';
+    lens[d] = len;
+    bytes += len;
+  }
+  return bytes;
+}
+
+/* Every line of every datagram through the parser, as ingest does */
+static double parse_all(long total) {
+  uint64_t delims[ SCAN_WORDS(DATAGRAM_MAX) ];
+  char buf[DATAGRAM_MAX + 1];
+  statsd_line_t out;
+  double sum = 0;
+  long n;
+
+  for (n = 0; n < total; n++) {
+    int d = n % CORPUS, start = 0, end;
+    memcpy(buf, corpus[d], lens[d] + 1);
+    statsd_scan(buf, lens[d], delims);
+    while (start < lens[d]) {
+      for (end = scan_next(delims, start, lens[d]); end < lens[d] && buf[end] != '\n'; end = scan_next(delims, end + 1, lens[d])) { }
+      if (statsd_parse_line(buf + start, end - start, delims, start, &out) >= 0) sum += out.num_values;
+      start = end + 1;
+    }
+  }
+  return sum;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *kernels[] = { "scalar", "sse2", "avx2" };
+  static const char *names[] = { "single metric", "batched" };
+  long total = argc > 1 ? atol(argv[1]) : 2000000, n;
+  uint64_t delims[ SCAN_WORDS(DATAGRAM_MAX) ];
+  uint64_t rng = 13;
+  int batched;
+  unsigned k;
+
+  for (batched = 0; batched < 2; batched++) {
+    long bytes = fill(batched, &rng);
+    double per_datagram = (double) bytes / CORPUS;
+    long rounds = batched ? total / 20 : total;
+
+    printf("%s datagrams, %.0f bytes on average:\n", names[batched], per_datagram);
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+      double t, t_scan, t_parse, sum = 0;
+
+      if (!scan_select(kernels[k])) continue;
+      t = bench_now();
+      for (n = 0; n < rounds; n++) {
+        int d = n % CORPUS;
+        statsd_scan(corpus[d], lens[d], delims);
+        sum += delims[0];
+      }
+      t_scan = bench_now() - t;
+
+      t = bench_now();
+      sum += parse_all(rounds);
+      t_parse = bench_now() - t;
+      bench_sink = sum;
+
+      printf("  %-6s scan %6.2f GB/s, %7.1f ns/datagram; whole parse %7.1f ns/datagram\n", kernels[k],
+        rounds * per_datagram / t_scan / 1e9, t_scan * 1e9 / rounds, t_parse * 1e9 / rounds);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Timer sketches against keeping every sample and sorting, as the flush
+ * does without -K. For each alpha and distribution: the cost of adding a
+ * sample and answering the median, upper_90, upper_99 and upper_999, the
+ * worst relative error of those quantiles against the exact ones, and
+ * the widest store. The distributions are log-normal latencies, uniform
+ * values, and values spread over 1e-6..1e9 to stretch the stores.
+ *
+ * Usage: bench_sketch [samples]
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/sketch.h"
+#include "bench.h"
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define QUANTILES ( sizeof(quantiles) / sizeof(quantiles[0]) )
+
+static double uniform(uint64_t *rng) {
+  return ( bench_rand(rng) >> 11 ) / 9007199254740992.0;
+}
+
+static void fill(double *v, long n, int kind, uint64_t *rng) {
+  long i;
+  for (i = 0; i < n; i++) {
+    double u = uniform(rng) + 1e-300, w = uniform(rng);
+    switch (kind) {
+      case 0:
+        /* Box-Muller: median 20ms, a long tail */
+        v[i] = exp(log(20) + 0.8 * sqrt(-2 * log(u)) * cos(2 * M_PI * w));
+        break;
+      case 1:
+        v[i] = 1000 * u;
+        break;
+      default:
+        v[i] = pow(10, -6 + 15 * u);
+        break;
+    }
+  }
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* The same rank sketch_quantile() answers for */
+static double exact_quantile(const double *sorted, long n, double q) {
+  long rank = (long) ( q * n + 0.5 );
+  if (rank < 1) rank = 1;
+  return sorted[rank - 1];
+}
+
+int main(int argc, char *argv[]) {
+  static const char *names[] = { "log-normal", "uniform", "1e-6..1e9" };
+  static const double alphas[] = { 0.01, 0.001 };
+  long n = argc > 1 ? atol(argv[1]) : 1000000, i;
+  double *values = malloc(n * sizeof(double)), *sorted = malloc(n * sizeof(double));
+  uint64_t rng = 11;
+  unsigned a, q;
+  int kind;
+
+  for (kind = 0; kind < 3; kind++) {
+    double t, t_sort, sum = 0;
+    double exact[QUANTILES];
+
+    fill(values, n, kind, &rng);
+    t = bench_now();
+    memcpy(sorted, values, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_double);
+    for (q = 0; q < QUANTILES; q++) {
+      exact[q] = exact_quantile(sorted, n, quantiles[q]);
+      sum += exact[q];
+    }
+    t_sort = bench_now() - t;
+
+    for (a = 0; a < sizeof(alphas) / sizeof(alphas[0]); a++) {
+      statsd_sketch_t *s = sketch_new();
+      double t_sketch, worst = 0;
+
+      sketch_init(alphas[a]);
+      t = bench_now();
+      for (i = 0; i < n; i++) sketch_add(s, values[i]);
+      for (q = 0; q < QUANTILES; q++) {
+        double err = fabs(sketch_quantile(s, quantiles[q]) - exact[q]) / exact[q];
+        if (err > worst) worst = err;
+      }
+      t_sketch = bench_now() - t;
+      sum += worst;
+
+      printf("%-11s alpha %-5g sketch %6.1f ns/sample, sort %6.1f ns/sample, %5.2fx, worst error %.5f, %5d bins\n",
+        names[kind], alphas[a], t_sketch * 1e9 / n, t_sort * 1e9 / n, t_sort / t_sketch, worst, s->pos.len);
+      if (worst > alphas[a]) {
+        printf("warning: error %.5f is over alpha %g\n", worst, alphas[a]);
+      }
+      sketch_free(s);
+    }
+    bench_sink = sum;
+  }
+  free(values);
+  free(sorted);
+  return 0;
+}
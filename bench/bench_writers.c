@@ -0,0 +1,182 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Aggregation under contention, 1 to 16 writer threads parsing batched
+ * datagrams over one shared key space while a collector merges into the
+ * sharded tables every millisecond. Two layouts: each writer with its
+ * own pair of maps, as the workers have, and every writer updating one
+ * map behind one lock, which is how a single table lock behaves. The
+ * numbers only mean something with as many cores as writers.
+ *
+ * Usage: bench_writers [metrics per writer]
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/aggregate.h"
+#include "../src/ingest.h"
+#include "../src/statsd.h"
+#include "../tests/tables.h"
+#include "bench.h"
+
+#define WRITERS_MAX 16
+#define CORPUS 2048
+#define DATAGRAM_MAX 1400
+
+typedef struct {
+  int id;
+  pthread_t thread;
+  pthread_mutex_t *agg_lock;
+  statsd_agg_t *agg;        /* the pair this writer's lock guards */
+  statsd_agg_t **active;
+  long metrics;
+} writer_t;
+
+static char corpus[CORPUS][DATAGRAM_MAX + 1];
+static int lens[CORPUS], lines[CORPUS];
+static writer_t writers[WRITERS_MAX];
+static int num_writers;
+static long per_writer;
+static atomic_int running;
+
+static void fill(uint64_t *rng) {
+  int d;
+  for (d = 0; d < CORPUS; d++) {
+    char line[128];
+    int len = 0, n;
+    lines[d] = 0;
+    for (;;) {
+      uint64_t r = bench_rand(rng);
+      n = r & 1
+        ? sprintf(line, "api.svc%d.endpoint_%d.requests:1|c", (int) ( ( r >> 8 ) % 40 ), (int) ( ( r >> 16 ) % 200 ))
+        : sprintf(line, "api.svc%d.endpoint_%d.latency:%d|ms", (int) ( ( r >> 8 ) % 40 ), (int) ( ( r >> 16 ) % 200 ), (int) ( ( r >> 24 ) % 1000 ));
+      if (len + 1 + n > DATAGRAM_MAX) break;
+      if (len > 0) corpus[d][len++] = '\n';
+      memcpy(corpus[d] + len, line, n);
+      len += n;
+      lines[d]++;
+    }
+    lens[d] = len;
+  }
+}
+
+static void *writer_run(void *ptr) {
+  writer_t *w = (writer_t *) ptr;
+  char buf[DATAGRAM_MAX + 1];
+  int d = w->id * 97;
+
+  w->metrics = 0;
+  while (w->metrics < per_writer) {
+    d = ( d + 1 ) % CORPUS;
+    memcpy(buf, corpus[d], lens[d] + 1);
+    pthread_mutex_lock(w->agg_lock);
+    process_stats_packet(*w->active, buf, lens[d]);
+    pthread_mutex_unlock(w->agg_lock);
+    w->metrics += lines[d];
+  }
+  return NULL;
+}
+
+/* Writers sharing a lock share a map pair; each pair is swapped once */
+static void collect() {
+  int i;
+  for (i = 0; i < num_writers; i++) {
+    statsd_agg_t *retired;
+    if (i > 0 && writers[i].agg_lock == writers[0].agg_lock) break;
+    pthread_mutex_lock(writers[i].agg_lock);
+    retired = *writers[i].active;
+    *writers[i].active = retired == &writers[i].agg[0] ? &writers[i].agg[1] : &writers[i].agg[0];
+    pthread_mutex_unlock(writers[i].agg_lock);
+    agg_merge(retired);
+  }
+}
+
+static void *collector_run(void *ptr) {
+  static statsd_snapshot_t snap;
+  int n = 0;
+  (void) ptr;
+  while (atomic_load(&running)) {
+    usleep(1000);
+    collect();
+    /* Hand the timer samples over now and then, as a flush would */
+    if (++n % 100 == 0) {
+      snapshot_take(&snap);
+      snapshot_release(&snap);
+    }
+  }
+  return NULL;
+}
+
+static pthread_mutex_t locks[WRITERS_MAX];
+static statsd_agg_t maps[WRITERS_MAX][2];
+static statsd_agg_t *active[WRITERS_MAX];
+
+static double run(int shared) {
+  pthread_t collector;
+  double t;
+  long total = 0;
+  int i;
+
+  for (i = 0; i < num_writers; i++) {
+    int owner = shared ? 0 : i;
+    writers[i].id = i;
+    writers[i].agg_lock = &locks[owner];
+    writers[i].agg = maps[owner];
+    writers[i].active = &active[owner];
+  }
+  atomic_store(&running, 1);
+  pthread_create(&collector, NULL, collector_run, NULL);
+  t = bench_now();
+  for (i = 0; i < num_writers; i++) pthread_create(&writers[i].thread, NULL, writer_run, &writers[i]);
+  for (i = 0; i < num_writers; i++) {
+    pthread_join(writers[i].thread, NULL);
+    total += writers[i].metrics;
+  }
+  t = bench_now() - t;
+  atomic_store(&running, 0);
+  pthread_join(collector, NULL);
+  collect();
+  return total / t;
+}
+
+int main(int argc, char *argv[]) {
+  static const int counts[] = { 1, 2, 4, 8, 16 };
+  uint64_t rng = 21;
+  unsigned c;
+  int i;
+
+  per_writer = argc > 1 ? atol(argv[1]) : 2000000;
+  tables_init();
+  fill(&rng);
+  for (i = 0; i < WRITERS_MAX; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+    agg_init(&maps[i][0]);
+    agg_init(&maps[i][1]);
+    active[i] = &maps[i][0];
+  }
+
+  /* Intern the keys and fill the slabs before timing anything */
+  num_writers = 1;
+  run(0);
+
+  printf("%d cores online\n", (int) sysconf(_SC_NPROCESSORS_ONLN));
+  printf("writers  own maps metrics/s  one locked map metrics/s\n");
+  for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+    double own, one;
+    num_writers = counts[c];
+    own = run(0);
+    one = run(1);
+    printf("%7d  %18.0f  %24.0f\n", num_writers, own, one);
+  }
+  return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "aggregate.h"
+
+#define AGG_TOUCHED_INITIAL 1024
+
+/* Samples in a key's first and largest chunks of an interval */
+#define AGG_CHUNK_INITIAL 16
+#define AGG_CHUNK_MAX 1024
+
+statsd_arena_t timer_arenas[2];
+statsd_arena_t *timer_arena = &timer_arenas[0];
+statsd_slab_t agg_entries_slab;
+long flush_seq = 0;
+
+void agg_init( statsd_agg_t *agg ) {
+  memset(agg, 0, sizeof(statsd_agg_t));
+  agg->max_touched = AGG_TOUCHED_INITIAL;
+  agg->touched = malloc(agg->max_touched * sizeof(statsd_agg_entry_t *));
+  arena_init(&agg->arena);
+}
+
+void timer_arenas_init() {
+  arena_init(&timer_arenas[0]);
+  arena_init(&timer_arenas[1]);
+  timer_arena = &timer_arenas[0];
+}
+
+/**
+ * Make room for n more samples in a global timer, from the current
+ * timer arena: exactly n for the interval's first merge, doubling after
+ * that. The caller holds the timer's lock and merge_lock (or runs
+ * before any other thread). Returns 0 if there is no memory.
+ */
+static int timer_reserve( statsd_timer_t *t, int n ) {
+  int grown = t->max_values * 2;
+  double *v;
+
+  if (t->count + n <= t->max_values) return 1;
+  if (grown < t->count + n) grown = t->count + n;
+  v = arena_grow(timer_arena, t->values, (size_t) t->max_values * sizeof(double), (size_t) grown * sizeof(double));
+  if (v == NULL) {
+    syslog(LOG_ERR, "Dropping %d samples of timer %s", n, t->key->name);
+    return 0;
+  }
+  t->values = v;
+  t->max_values = grown;
+  return 1;
+}
+
+int timer_add_samples( statsd_timer_t *t, const double *values, int n ) {
+  if (!timer_reserve(t, n)) return 0;
+  memcpy(t->values + t->count, values, n * sizeof(double));
+  t->count += n;
+  return 1;
+}
+
+static uint64_t agg_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Entries are created once per key and worker, and reused after merges */
+static statsd_agg_entry_t *agg_entry( statsd_agg_t *agg, statsd_key_t *key ) {
+  statsd_agg_entry_t *e = idtable_get(&agg->entries, key->id);
+
+  if (e == NULL) {
+    e = slab_alloc(&agg_entries_slab);
+    e->key = key;
+    idtable_set(&agg->entries, key->id, e);
+  }
+  if (e->flags == 0) {
+    if (agg->num_touched == agg->max_touched) {
+      agg->max_touched *= 2;
+      agg->touched = realloc(agg->touched, agg->max_touched * sizeof(statsd_agg_entry_t *));
+    }
+    agg->touched[ agg->num_touched++ ] = e;
+  }
+  return e;
+}
+
+void agg_counter( statsd_agg_t *agg, statsd_key_t *key, double value, double sample_rate ) {
+  statsd_agg_entry_t *e = agg_entry(agg, key);
+
+  if (sample_rate == 0) {
+    e->counter += value;
+  } else {
+    e->counter += value * ( 1 / sample_rate );
+  }
+  e->flags |= AGG_COUNTER;
+}
+
+/**
+ * plusminus: 0 - value; 1 - subtract; 2 - add
+ */
+void agg_gauge( statsd_agg_t *agg, statsd_key_t *key, double value, int plusminus ) {
+  statsd_agg_entry_t *e = agg_entry(agg, key);
+
+  if (plusminus < 1) {
+    e->gauge = value;
+    e->gauge_stamp = agg_clock();
+    e->flags = ( e->flags & ~AGG_GAUGE_DELTA ) | AGG_GAUGE_SET;
+  } else if (plusminus < 3) {
+    e->gauge += plusminus < 2 ? -value : value;
+    if (!( e->flags & AGG_GAUGE_SET )) e->flags |= AGG_GAUGE_DELTA;
+  } else {
+    syslog(LOG_ERR, "Error updating gauge!");
+  }
+}
+
+void agg_timer( statsd_agg_t *agg, statsd_key_t *key, double value ) {
+  statsd_agg_entry_t *e = agg_entry(agg, key);
+
+  e->flags |= AGG_TIMER;
+  if (sketch_alpha > 0) {
+    /* Out of memory the sample is dropped; the sketch logs it */
+    if (e->timer_sketch == NULL && (e->timer_sketch = sketch_new()) == NULL) return;
+    sketch_add(e->timer_sketch, value);
+  } else {
+    statsd_samples_chunk_t *c = e->timer_last;
+    if (c == NULL || c->len == c->max) {
+      int max = c == NULL ? AGG_CHUNK_INITIAL : c->max < AGG_CHUNK_MAX ? c->max * 2 : AGG_CHUNK_MAX;
+      statsd_samples_chunk_t *fresh = arena_alloc(&agg->arena, sizeof(statsd_samples_chunk_t) + max * sizeof(double));
+      if (fresh == NULL) return;
+      fresh->next = NULL;
+      fresh->len = 0;
+      fresh->max = max;
+      if (c) {
+        c->next = fresh;
+      } else {
+        e->timer_first = fresh;
+      }
+      e->timer_last = c = fresh;
+    }
+    c->values[ c->len++ ] = value;
+    e->num_timer_values++;
+  }
+}
+
+void agg_set( statsd_agg_t *agg, statsd_key_t *key, const char *value, int len ) {
+  statsd_agg_entry_t *e = agg_entry(agg, key);
+
+  if (e->set == NULL && (e->set = hll_new()) == NULL) return;
+  hll_add(e->set, hll_hash(value, len));
+  e->flags |= AGG_SET;
+}
+
+static void merge_counter( statsd_key_t *key, long double value ) {
+  statsd_counter_t *c;
+  wait_for_counters_lock(key);
+  c = idtable_get( &counters, key->id );
+  if (c) {
+    c->value += value;
+  } else {
+    syslog(LOG_DEBUG, "Adding new counter entry");
+    c = slab_alloc(&counters_slab);
+    c->key = key;
+    c->value = value;
+    idtable_set( &counters, key->id, c );
+  }
+  c->seen = flush_seq;
+  remove_counters_lock(key);
+}
+
+/*
+ * The latest absolute set wins (by timestamp, across workers); deltas
+ * seen without a set in the same interval are added on top.
+ */
+static void merge_gauge( statsd_key_t *key, int flags, long double value, uint64_t stamp ) {
+  statsd_gauge_t *g;
+  wait_for_gauges_lock(key);
+  g = idtable_get( &gauges, key->id );
+  if (g == NULL) {
+    syslog(LOG_DEBUG, "Adding new gauge entry");
+    g = slab_alloc(&gauges_slab);
+    g->key = key;
+    idtable_set( &gauges, key->id, g );
+  }
+  g->seen = flush_seq;
+  if (flags & AGG_GAUGE_SET) {
+    if (stamp >= g->stamp) {
+      g->value = value;
+      g->stamp = stamp;
+    }
+  } else {
+    g->value += value;
+  }
+  remove_gauges_lock(key);
+}
+
+static void merge_timer( statsd_key_t *key, const statsd_samples_chunk_t *chunks, int num_values, statsd_sketch_t *sketch ) {
+  statsd_timer_t *t;
+  wait_for_timers_lock(key);
+  t = idtable_get( &timers, key->id );
+  if (t == NULL) {
+    syslog(LOG_DEBUG, "Adding new timer entry");
+    t = slab_alloc(&timers_slab);
+    t->key = key;
+    idtable_set( &timers, key->id, t );
+  }
+  t->seen = flush_seq;
+  if (sketch) {
+    /* Made here rather than with the entry, so a failed one is retried */
+    if (t->sketch == NULL) t->sketch = sketch_new();
+    if (t->sketch) {
+      uint64_t before = t->sketch->count;
+      sketch_merge(t->sketch, sketch);
+      t->count += t->sketch->count - before;
+    }
+  } else if (num_values > 0 && timer_reserve(t, num_values)) {
+    for (; chunks != NULL; chunks = chunks->next) {
+      memcpy(t->values + t->count, chunks->values, chunks->len * sizeof(double));
+      t->count += chunks->len;
+    }
+  }
+  remove_timers_lock(key);
+}
+
+static void merge_set( statsd_key_t *key, const statsd_hll_t *hll ) {
+  statsd_set_t *s;
+  wait_for_sets_lock(key);
+  s = idtable_get( &sets, key->id );
+  if (s == NULL) {
+    syslog(LOG_DEBUG, "Adding new set entry");
+    s = slab_alloc(&sets_slab);
+    s->key = key;
+    idtable_set( &sets, key->id, s );
+  }
+  s->seen = flush_seq;
+  if (s->hll == NULL) {
+    s->hll = hll_new();
+  }
+  if (s->hll) {
+    hll_merge(s->hll, hll);
+  }
+  remove_sets_lock(key);
+}
+
+/**
+ * Fold everything agg collected into the global counters, gauges,
+ * timers and sets tables and reset it. The caller keeps the owning worker from
+ * updating agg meanwhile.
+ */
+void agg_merge( statsd_agg_t *agg ) {
+  int i;
+
+  for (i = 0; i < agg->num_touched; i++) {
+    statsd_agg_entry_t *e = agg->touched[i];
+
+    if (e->flags & AGG_COUNTER) {
+      merge_counter(e->key, e->counter);
+      e->counter = 0;
+    }
+    if (e->flags & ( AGG_GAUGE_SET | AGG_GAUGE_DELTA )) {
+      merge_gauge(e->key, e->flags, e->gauge, e->gauge_stamp);
+      e->gauge = 0;
+    }
+    if (e->flags & AGG_TIMER) {
+      merge_timer(e->key, e->timer_first, e->num_timer_values, e->timer_sketch);
+      if (e->timer_sketch) {
+        sketch_clear(e->timer_sketch);
+      }
+      e->timer_first = e->timer_last = NULL;
+      e->num_timer_values = 0;
+    }
+    if (e->flags & AGG_SET) {
+      merge_set(e->key, e->set);
+      hll_clear(e->set);
+    }
+    e->flags = 0;
+  }
+  agg->num_touched = 0;
+  arena_reset(&agg->arena);
+}
+
+#define SNAPSHOT_RESERVE(arr, num, max) \
+  if ((num) == (max)) { \
+    (max) = (max) ? (max) * 2 : 1024; \
+    (arr) = realloc((arr), (max) * sizeof(*(arr))); \
+  }
+
+/**
+ * Copy the global tables into snap, resetting the per-interval state
+ * (counter values, timer samples and set registers) as each entry is
+ * copied. Each entry is only locked for as long as it takes to copy it.
+ * The caller holds merge_lock, so no merge lands in the timer arena being handed over.
+ */
+void snapshot_take( statsd_snapshot_t *snap ) {
+  statsd_counter_t *c;
+  statsd_gauge_t *g;
+  statsd_timer_t *t;
+  statsd_set_t *s;
+  uint32_t id;
+
+  snap->num_counters = snap->num_gauges = snap->num_timers = snap->num_sets = 0;
+  flush_seq++;
+
+  IDTABLE_ITER(&counters, id, c) {
+    SNAPSHOT_RESERVE(snap->counters, snap->num_counters, snap->max_counters)
+    wait_for_counters_lock(c->key);
+    snap->counters[ snap->num_counters++ ] = *c;
+    c->value = 0;
+    remove_counters_lock(c->key);
+  }
+
+  IDTABLE_ITER(&gauges, id, g) {
+    SNAPSHOT_RESERVE(snap->gauges, snap->num_gauges, snap->max_gauges)
+    wait_for_gauges_lock(g->key);
+    snap->gauges[ snap->num_gauges++ ] = *g;
+    remove_gauges_lock(g->key);
+  }
+
+  IDTABLE_ITER(&timers, id, t) {
+    statsd_timer_t *copy;
+    SNAPSHOT_RESERVE(snap->timers, snap->num_timers, snap->max_timers)
+    copy = &snap->timers[ snap->num_timers++ ];
+    wait_for_timers_lock(t->key);
+    *copy = *t;
+    if (t->count > 0) {
+      if (t->sketch) {
+        t->sketch = sketch_new();
+      }
+      t->count = 0;
+    } else {
+      copy->values = NULL;
+      copy->sketch = NULL;
+    }
+    t->values = NULL;
+    t->max_values = 0;
+    remove_timers_lock(t->key);
+  }
+
+  /* The interval's registers go with the snapshot */
+  IDTABLE_ITER(&sets, id, s) {
+    SNAPSHOT_RESERVE(snap->sets, snap->num_sets, snap->max_sets)
+    wait_for_sets_lock(s->key);
+    snap->sets[ snap->num_sets++ ] = *s;
+    s->hll = NULL;
+    remove_sets_lock(s->key);
+  }
+
+  snap->arena = timer_arena;
+  timer_arena = timer_arena == &timer_arenas[0] ? &timer_arenas[1] : &timer_arenas[0];
+}
+
+/**
+ * Free the timer samples, sketches and set registers a snapshot took
+ * over.
+ */
+void snapshot_release( statsd_snapshot_t *snap ) {
+  int i;
+  for (i = 0; i < snap->num_timers; i++) {
+    snap->timers[i].values = NULL;
+    if (snap->timers[i].sketch) {
+      sketch_free(snap->timers[i].sketch);
+      snap->timers[i].sketch = NULL;
+    }
+  }
+  snap->num_timers = 0;
+  for (i = 0; i < snap->num_sets; i++) {
+    if (snap->sets[i].hll) {
+      hll_free(snap->sets[i].hll);
+      snap->sets[i].hll = NULL;
+    }
+  }
+  snap->num_sets = 0;
+  if (snap->arena) {
+    arena_reset(snap->arena);
+    snap->arena = NULL;
+  }
+}
@@ -0,0 +1,109 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "counters.h"
+#include "gauges.h"
+#include "keys.h"
+#include "sets.h"
+#include "slab.h"
+#include "timers.h"
+
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__ 1
+
+/* What an entry has collected since it was last merged */
+#define AGG_COUNTER     1
+#define AGG_GAUGE_SET   2
+#define AGG_GAUGE_DELTA 4
+#define AGG_TIMER       8
+#define AGG_SET         16
+
+/*
+ * Run of timer samples in a worker's arena. A key's runs double in size
+ * up to AGG_CHUNK_MAX, so a busy key never has its samples copied.
+ */
+typedef struct statsd_samples_chunk {
+  struct statsd_samples_chunk *next;
+  int len;
+  int max;
+  double values[];
+} statsd_samples_chunk_t;
+
+/*
+ * Per-key record in a worker's local aggregation map. A key normally
+ * carries a single metric type, but nothing stops a client from using
+ * one name for several, so all of them have a slot.
+ */
+typedef struct {
+  statsd_key_t *key;
+  uint64_t gauge_stamp;     /* CLOCK_MONOTONIC ns of the last absolute set */
+  long double counter;
+  long double gauge;        /* value after the last set, or the net delta */
+  statsd_samples_chunk_t *timer_first, *timer_last;   /* in the map's arena */
+  statsd_sketch_t *timer_sketch;
+  statsd_hll_t *set;        /* cleared, not freed, after a merge */
+  int num_timer_values;
+  int flags;
+} statsd_agg_entry_t;
+
+/*
+ * Aggregation map owned by one worker. Only that worker updates it, so
+ * updates take no lock and touch no shared cache lines; merging into the
+ * global tables happens from the flush and management threads. Timer
+ * samples are bumped out of arena, which a merge resets.
+ */
+typedef struct {
+  statsd_idtable_t entries;
+  statsd_agg_entry_t **touched;
+  int num_touched;
+  int max_touched;
+  statsd_arena_t arena;
+} statsd_agg_t;
+
+/*
+ * Frozen copy of the global tables taken at a flush boundary. Counters
+ * are zeroed and timer samples are handed over wholesale, arena and
+ * all, so the flush can sort and format at leisure while new samples
+ * land in the other timer arena (or fresh sketches).
+ */
+typedef struct {
+  statsd_counter_t *counters;
+  int num_counters, max_counters;
+  statsd_gauge_t *gauges;
+  int num_gauges, max_gauges;
+  statsd_timer_t *timers;
+  int num_timers, max_timers;
+  statsd_set_t *sets;
+  int num_sets, max_sets;
+  statsd_arena_t *arena;
+} statsd_snapshot_t;
+
+/* Interval timer samples, merged into timer_arena; the other is being flushed */
+extern statsd_arena_t timer_arenas[2];
+extern statsd_arena_t *timer_arena;
+
+extern statsd_slab_t agg_entries_slab;
+
+/* Snapshots taken so far; merges stamp entries with it */
+extern long flush_seq;
+
+void agg_init( statsd_agg_t *agg );
+void timer_arenas_init( void );
+int timer_add_samples( statsd_timer_t *t, const double *values, int n );
+void agg_counter( statsd_agg_t *agg, statsd_key_t *key, double value, double sample_rate );
+void agg_gauge( statsd_agg_t *agg, statsd_key_t *key, double value, int plusminus );
+void agg_timer( statsd_agg_t *agg, statsd_key_t *key, double value );
+void agg_set( statsd_agg_t *agg, statsd_key_t *key, const char *value, int len );
+void agg_merge( statsd_agg_t *agg );
+void snapshot_take( statsd_snapshot_t *snap );
+void snapshot_release( statsd_snapshot_t *snap );
+
+#endif /* __AGGREGATE_H__ */
@@ -0,0 +1,126 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "arena.h"
+
+#define ARENA_ROUND(x) ( ( (x) + 15 ) & ~(size_t) 15 )
+
+void arena_init( statsd_arena_t *arena ) {
+  memset(arena, 0, sizeof(statsd_arena_t));
+}
+
+static statsd_arena_block_t *arena_block( statsd_arena_t *arena, size_t size ) {
+  statsd_arena_block_t *b = malloc(sizeof(statsd_arena_block_t) + size);
+  if (b == NULL) {
+    syslog(LOG_ERR, "Unable to allocate %zu byte arena block", size);
+    return NULL;
+  }
+  b->size = size;
+  b->used = 0;
+  arena->reserved += sizeof(statsd_arena_block_t) + size;
+  return b;
+}
+
+/**
+ * size bytes, 16 byte aligned, valid until the next reset. NULL when
+ * out of memory.
+ */
+void *arena_alloc( statsd_arena_t *arena, size_t size ) {
+  statsd_arena_block_t *b = arena->blocks;
+  void *ptr;
+
+  size = ARENA_ROUND(size);
+  if (size > ARENA_LARGE) {
+    /* Behind the current block, which stays current */
+    if ((b = arena_block(arena, size)) == NULL) return NULL;
+    if (arena->blocks) {
+      b->next = arena->blocks->next;
+      arena->blocks->next = b;
+    } else {
+      b->next = NULL;
+      arena->blocks = b;
+    }
+  } else if (b == NULL || b->size - b->used < size) {
+    if (arena->spare) {
+      b = arena->spare;
+      arena->spare = b->next;
+    } else if ((b = arena_block(arena, ARENA_BLOCK_SIZE)) == NULL) {
+      return NULL;
+    }
+    b->next = arena->blocks;
+    arena->blocks = b;
+  }
+
+  ptr = (char *) b->data + b->used;
+  b->used += size;
+  arena->used += size;
+  return ptr;
+}
+
+/**
+ * Resize an allocation, in place when it is the last one made from the
+ * current block and there is room, otherwise by copying.
+ */
+void *arena_grow( statsd_arena_t *arena, void *ptr, size_t old_size, size_t new_size ) {
+  statsd_arena_block_t *b = arena->blocks;
+  void *fresh;
+
+  old_size = ARENA_ROUND(old_size);
+  new_size = ARENA_ROUND(new_size);
+  if (ptr != NULL && b != NULL && (char *) ptr + old_size == (char *) b->data + b->used
+      && b->size - b->used >= new_size - old_size) {
+    b->used += new_size - old_size;
+    arena->used += new_size - old_size;
+    return ptr;
+  }
+  fresh = arena_alloc(arena, new_size);
+  if (fresh != NULL && ptr != NULL) {
+    memcpy(fresh, ptr, old_size);
+  }
+  return fresh;
+}
+
+static void arena_release( statsd_arena_t *arena, statsd_arena_block_t *b ) {
+  arena->reserved -= sizeof(statsd_arena_block_t) + b->size;
+  free(b);
+}
+
+/**
+ * Drop everything allocated. Standard blocks used since the last reset
+ * become the spares; older spares and large blocks are freed.
+ */
+void arena_reset( statsd_arena_t *arena ) {
+  statsd_arena_block_t *b, *next, *keep = NULL;
+
+  for (b = arena->spare; b != NULL; b = next) {
+    next = b->next;
+    arena_release(arena, b);
+  }
+  for (b = arena->blocks; b != NULL; b = next) {
+    next = b->next;
+    if (b->size == ARENA_BLOCK_SIZE) {
+      b->used = 0;
+      b->next = keep;
+      keep = b;
+    } else {
+      arena_release(arena, b);
+    }
+  }
+  arena->blocks = NULL;
+  arena->spare = keep;
+  arena->used = 0;
+}
+
+void arena_destroy( statsd_arena_t *arena ) {
+  arena_reset(arena);
+  arena_reset(arena);
+}
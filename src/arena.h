@@ -0,0 +1,48 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stddef.h>
+
+#ifndef __ARENA_H__
+#define __ARENA_H__ 1
+
+/* Size of the blocks allocations are bumped out of */
+#define ARENA_BLOCK_SIZE ( 1024 * 1024 )
+
+/* Requests above this get a block of their own */
+#define ARENA_LARGE ( ARENA_BLOCK_SIZE / 4 )
+
+typedef struct statsd_arena_block {
+  struct statsd_arena_block *next;
+  size_t size;
+  size_t used;
+  double data[];
+} statsd_arena_block_t;
+
+/*
+ * Bump allocator for memory that dies all at once, such as an
+ * interval's timer samples. Nothing is freed individually; a reset
+ * hands every block back. Standard blocks the last interval used are
+ * kept for the next one and anything beyond that is returned to the
+ * system, so the footprint follows the most recent interval rather
+ * than the busiest one ever seen. Not thread safe.
+ */
+typedef struct {
+  statsd_arena_block_t *blocks;   /* current block first */
+  statsd_arena_block_t *spare;
+  size_t used;                    /* bytes handed out since the reset */
+  size_t reserved;                /* bytes held in blocks, spare included */
+} statsd_arena_t;
+
+void arena_init( statsd_arena_t *arena );
+void *arena_alloc( statsd_arena_t *arena, size_t size );
+void *arena_grow( statsd_arena_t *arena, void *ptr, size_t old_size, size_t new_size );
+void arena_reset( statsd_arena_t *arena );
+void arena_destroy( statsd_arena_t *arena );
+
+#endif /* __ARENA_H__ */
@@ -6,24 +6,26 @@
  *
  */
 
-#include <semaphore.h>
-
-#include "uthash/uthash.h"
+#include "keys.h"
+#include "shards.h"
+#include "slab.h"
 
 #ifndef __COUNTERS_H__
 #define __COUNTERS_H__ 1
 
+/* Indexed by key id in counters; ordered to pack into 32 bytes */
 typedef struct {
-  char key[100];
+  statsd_key_t *key;
+  long seen;          /* flush_seq of the last merge */
   long double value;
-  UT_hash_handle hh; /* makes this structure hashable */
 } statsd_counter_t;
 
-extern statsd_counter_t *counters;
-extern sem_t counters_lock;
+extern statsd_idtable_t counters;
+extern statsd_shard_t counters_shards[STATSD_SHARDS];
+extern statsd_slab_t counters_slab;
 
-#define wait_for_counters_lock() sem_wait(&counters_lock)
-#define remove_counters_lock() sem_post(&counters_lock)
+#define wait_for_counters_lock(key) pthread_mutex_lock(&counters_shards[KEY_SHARD(key)].lock)
+#define remove_counters_lock(key) pthread_mutex_unlock(&counters_shards[KEY_SHARD(key)].lock)
 
 #endif /* __COUNTERS_H__ */
 
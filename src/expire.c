@@ -0,0 +1,167 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "aggregate.h"
+#include "counters.h"
+#include "expire.h"
+#include "gauges.h"
+#include "keys.h"
+#include "sets.h"
+#include "timers.h"
+
+/**
+ * Parse "c=K,g=K,ms=K,s=K" (any subset, any order) into ttl. Returns 0 on
+ * a malformed spec, leaving ttl partly filled in.
+ */
+int expire_parse( const char *spec, statsd_ttl_t *ttl ) {
+  char *copy = strdup(spec), *save = NULL, *tok, *eq, *end;
+  int ok = 1;
+
+  for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    long k;
+    if ((eq = strchr(tok, '=')) == NULL) {
+      ok = 0;
+      break;
+    }
+    *eq = '\0';
+    k = strtol(eq + 1, &end, 10);
+    if (end == eq + 1 || *end != '\0' || k < 0) {
+      ok = 0;
+      break;
+    }
+    if (strcmp(tok, "c") == 0) {
+      ttl->counters = k;
+    } else if (strcmp(tok, "g") == 0) {
+      ttl->gauges = k;
+    } else if (strcmp(tok, "ms") == 0) {
+      ttl->timers = k;
+    } else if (strcmp(tok, "s") == 0) {
+      ttl->sets = k;
+    } else {
+      ok = 0;
+      break;
+    }
+  }
+  free(copy);
+  return ok;
+}
+
+/* Seen last before the interval just flushed and ttl before that */
+#define EXPIRE_IDLE(entry, ttl) ( (ttl) > 0 && flush_seq - (entry)->seen > (ttl) )
+
+static int expire_counter( uint32_t id, statsd_key_t *key, int ttl ) {
+  statsd_counter_t *c;
+
+  if ((c = idtable_get(&counters, id)) == NULL || !EXPIRE_IDLE(c, ttl)) return 0;
+  wait_for_counters_lock(key);
+  /* A merge may have touched it since */
+  if ((c = idtable_get(&counters, id)) != NULL && EXPIRE_IDLE(c, ttl)) {
+    idtable_set(&counters, id, NULL);
+  } else {
+    c = NULL;
+  }
+  remove_counters_lock(key);
+  slab_free(&counters_slab, c);
+  return c != NULL;
+}
+
+static int expire_gauge( uint32_t id, statsd_key_t *key, int ttl ) {
+  statsd_gauge_t *g;
+
+  if ((g = idtable_get(&gauges, id)) == NULL || !EXPIRE_IDLE(g, ttl)) return 0;
+  wait_for_gauges_lock(key);
+  if ((g = idtable_get(&gauges, id)) != NULL && EXPIRE_IDLE(g, ttl)) {
+    idtable_set(&gauges, id, NULL);
+  } else {
+    g = NULL;
+  }
+  remove_gauges_lock(key);
+  slab_free(&gauges_slab, g);
+  return g != NULL;
+}
+
+static int expire_timer( uint32_t id, statsd_key_t *key, int ttl ) {
+  statsd_timer_t *t;
+
+  if ((t = idtable_get(&timers, id)) == NULL || !EXPIRE_IDLE(t, ttl)) return 0;
+  wait_for_timers_lock(key);
+  if ((t = idtable_get(&timers, id)) != NULL && EXPIRE_IDLE(t, ttl)) {
+    idtable_set(&timers, id, NULL);
+  } else {
+    t = NULL;
+  }
+  remove_timers_lock(key);
+  if (t == NULL) return 0;
+  /* Samples live in the timer arena and go with it */
+  if (t->sketch) sketch_free(t->sketch);
+  slab_free(&timers_slab, t);
+  return 1;
+}
+
+static int expire_set( uint32_t id, statsd_key_t *key, int ttl ) {
+  statsd_set_t *s;
+
+  if ((s = idtable_get(&sets, id)) == NULL || !EXPIRE_IDLE(s, ttl)) return 0;
+  wait_for_sets_lock(key);
+  if ((s = idtable_get(&sets, id)) != NULL && EXPIRE_IDLE(s, ttl)) {
+    idtable_set(&sets, id, NULL);
+  } else {
+    s = NULL;
+  }
+  remove_sets_lock(key);
+  if (s == NULL) return 0;
+  if (s->hll) hll_free(s->hll);
+  slab_free(&sets_slab, s);
+  return 1;
+}
+
+/**
+ * Look at the next batch of key ids and remove entries idle for longer
+ * than their ttl. Called by the flush thread after snapshot_take, so a
+ * removed entry has already been flushed for the last time. Readers
+ * outside the flush thread must look entries up again under the
+ * entry's lock before using them.
+ */
+void expire_step( const statsd_ttl_t *ttl, statsd_expiry_t *x ) {
+  uint32_t total = keys_count(), batch, n;
+  struct timespec start, end;
+
+  x->scanned = 0;
+  x->scan_us = 0;
+  if (total == 0 || ( ttl->counters == 0 && ttl->gauges == 0 && ttl->timers == 0 && ttl->sets == 0 )) return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  batch = ( total + EXPIRE_SWEEP_FLUSHES - 1 ) / EXPIRE_SWEEP_FLUSHES;
+  if (batch < EXPIRE_MIN_BATCH) batch = EXPIRE_MIN_BATCH;
+  if (batch > total) batch = total;
+
+  for (n = 0; n < batch; n++) {
+    uint32_t id = x->cursor++;
+    statsd_key_t *key;
+
+    if (x->cursor >= total) x->cursor = 0;
+    if ((key = key_by_id(id)) == NULL) continue;
+    x->expired_counters += expire_counter(id, key, ttl->counters);
+    x->expired_gauges += expire_gauge(id, key, ttl->gauges);
+    x->expired_timers += expire_timer(id, key, ttl->timers);
+    x->expired_sets += expire_set(id, key, ttl->sets);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  x->scanned = batch;
+  x->scan_us = ( end.tv_sec - start.tv_sec ) * 1000000L + ( end.tv_nsec - start.tv_nsec ) / 1000;
+}
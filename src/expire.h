@@ -0,0 +1,46 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+
+#ifndef __EXPIRE_H__
+#define __EXPIRE_H__ 1
+
+/* A full pass over every key id is spread over this many flushes */
+#define EXPIRE_SWEEP_FLUSHES 4
+
+/* Fewest key ids looked at per flush */
+#define EXPIRE_MIN_BATCH 4096
+
+/* Idle flush intervals after which an entry is removed, 0 for never */
+typedef struct {
+  int counters;
+  int gauges;
+  int timers;
+  int sets;
+} statsd_ttl_t;
+
+/*
+ * Where the sweep is and what it has done. Only the flush thread runs
+ * it, one batch of key ids per flush, taking each entry's lock only
+ * while removing that entry.
+ */
+typedef struct {
+  uint32_t cursor;
+  long expired_counters;
+  long expired_gauges;
+  long expired_timers;
+  long expired_sets;
+  long scanned;         /* ids looked at by the last step */
+  long scan_us;         /* and how long that took */
+} statsd_expiry_t;
+
+int expire_parse( const char *spec, statsd_ttl_t *ttl );
+void expire_step( const statsd_ttl_t *ttl, statsd_expiry_t *x );
+
+#endif /* __EXPIRE_H__ */
@@ -0,0 +1,44 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "uthash/utstring.h"
+#include "ganglia.h"
+
+#ifndef __FLUSH_H__
+#define __FLUSH_H__ 1
+
+/* Default number of threads formatting a flush */
+#define NUM_FLUSHERS 1
+
+/* Snapshot entries a flusher claims at a time */
+#define FLUSH_CHUNK 32
+
+/*
+ * The flush thread is flusher 0; the others are helpers that sleep on
+ * start until a snapshot is ready. All of them claim chunks of the
+ * snapshot until none are left, formatting into their own out buffer,
+ * and the flush thread concatenates the buffers once every helper has
+ * posted flush_done.
+ */
+typedef struct {
+  int id;
+  pthread_t thread;
+  sem_t start;
+  UT_string *out;
+  UT_string **routed;   /* out split by graphite destination, if several */
+  statsd_ganglia_batch_t gbatch;
+  int num_stats;
+} statsd_flusher_t;
+
+extern statsd_flusher_t *flushers;
+extern int num_flushers;
+
+#endif /* __FLUSH_H__ */
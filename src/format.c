@@ -0,0 +1,355 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "format.h"
+
+/*
+ * Shortest round-trip double to text, by Loitsch's Grisu2: the value
+ * and its rounding boundaries are scaled by a cached power of ten into
+ * a 64-bit window and digits are generated until they pin the value
+ * down. The output always reads back as the same double and is the
+ * shortest such text in all but a tiny fraction of cases.
+ */
+
+typedef struct {
+  uint64_t f;
+  int e;
+} diyfp_t;
+
+#define DIYFP_HIDDEN_BIT 0x0010000000000000ULL
+#define DIYFP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+
+/* 10^k for k = -348, -340, ... 340, normalized to 64 bits, rounded */
+static const uint64_t cached_powers_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+  0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+  0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+  0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+  0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+  0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+  0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+  0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+  0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+  0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+  0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+  0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+  0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+  0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+  0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+static const int16_t cached_powers_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+  -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+  -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+  -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+  56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+  694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+  1013, 1039, 1066,
+};
+
+static const uint32_t pow10_32[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static const uint64_t pow10_64[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+  10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static diyfp_t diyfp_normalize( diyfp_t x ) {
+  int s = __builtin_clzll(x.f);
+  x.f <<= s;
+  x.e -= s;
+  return x;
+}
+
+/* Upper 64 bits of the 128 bit product, rounded */
+static diyfp_t diyfp_mul( diyfp_t a, diyfp_t b ) {
+  const uint64_t m32 = 0xFFFFFFFFULL;
+  uint64_t a_hi = a.f >> 32, a_lo = a.f & m32, b_hi = b.f >> 32, b_lo = b.f & m32;
+  uint64_t ac = a_hi * b_hi, bc = a_lo * b_hi, ad = a_hi * b_lo, bd = a_lo * b_lo;
+  uint64_t tmp = ( bd >> 32 ) + ( ad & m32 ) + ( bc & m32 ) + ( 1ULL << 31 );
+  diyfp_t r;
+  r.f = ac + ( ad >> 32 ) + ( bc >> 32 ) + ( tmp >> 32 );
+  r.e = a.e + b.e + 64;
+  return r;
+}
+
+static void grisu_round( char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w ) {
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+      ( rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w )) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static void grisu_digits( diyfp_t w, diyfp_t mp, uint64_t delta, char *buf, int *len, int *k ) {
+  diyfp_t one = { 1ULL << -mp.e, mp.e };
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t) ( mp.f >> -one.e );
+  uint64_t p2 = mp.f & ( one.f - 1 );
+  int kappa = 1;
+
+  while (kappa < 10 && p1 >= pow10_32[kappa]) kappa++;
+  *len = 0;
+
+  while (kappa > 0) {
+    uint32_t d = p1 / pow10_32[kappa - 1];
+    uint64_t rest;
+    p1 %= pow10_32[kappa - 1];
+    if (d || *len) buf[(*len)++] = '0' + d;
+    kappa--;
+    rest = ( (uint64_t) p1 << -one.e ) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      grisu_round(buf, *len, delta, rest, (uint64_t) pow10_32[kappa] << -one.e, wp_w);
+      return;
+    }
+  }
+
+  for (;;) {
+    uint32_t d;
+    p2 *= 10;
+    delta *= 10;
+    d = (uint32_t) ( p2 >> -one.e );
+    if (d || *len) buf[(*len)++] = '0' + d;
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      grisu_round(buf, *len, delta, p2, one.f, -kappa < 20 ? wp_w * pow10_64[-kappa] : 0);
+      return;
+    }
+  }
+}
+
+/* Digits of a finite, positive value; the value is digits * 10^k */
+static void grisu2( double value, char *buf, int *len, int *k ) {
+  uint64_t bits;
+  diyfp_t v, w, mp, mm, c;
+  int biased_e, ck, index;
+  double dk;
+
+  memcpy(&bits, &value, sizeof(bits));
+  biased_e = (int) ( ( bits >> 52 ) & 0x7FF );
+  if (biased_e) {
+    v.f = ( bits & DIYFP_SIGNIFICAND_MASK ) | DIYFP_HIDDEN_BIT;
+    v.e = biased_e - 1075;
+  } else {
+    v.f = bits & DIYFP_SIGNIFICAND_MASK;
+    v.e = -1074;
+  }
+
+  /* Boundaries halfway to the neighbouring doubles */
+  mp.f = ( v.f << 1 ) + 1;
+  mp.e = v.e - 1;
+  mp = diyfp_normalize(mp);
+  if (v.f == DIYFP_HIDDEN_BIT) {
+    mm.f = ( v.f << 2 ) - 1;
+    mm.e = v.e - 2;
+  } else {
+    mm.f = ( v.f << 1 ) - 1;
+    mm.e = v.e - 1;
+  }
+  mm.f <<= mm.e - mp.e;
+  mm.e = mp.e;
+
+  /* Cached power that brings mp's exponent into [-60, -32] */
+  dk = ( -61 - mp.e ) * 0.30102999566398114 + 347;
+  ck = (int) dk;
+  if (dk - ck > 0.0) ck++;
+  index = ( ck >> 3 ) + 1;
+  *k = -( -348 + index * 8 );
+  c.f = cached_powers_f[index];
+  c.e = cached_powers_e[index];
+
+  w = diyfp_mul(diyfp_normalize(v), c);
+  mp = diyfp_mul(mp, c);
+  mm = diyfp_mul(mm, c);
+  mm.f++;
+  mp.f--;
+  grisu_digits(w, mp, mp.f - mm.f, buf, len, k);
+}
+
+static int format_exponent( int e, char *buf ) {
+  int n = 0;
+  buf[n++] = 'e';
+  if (e < 0) {
+    buf[n++] = '-';
+    e = -e;
+  } else {
+    buf[n++] = '+';
+  }
+  if (e >= 100) {
+    buf[n++] = '0' + e / 100;
+    e %= 100;
+    buf[n++] = '0' + e / 10;
+  } else if (e >= 10) {
+    buf[n++] = '0' + e / 10;
+  }
+  buf[n++] = '0' + e % 10;
+  return n;
+}
+
+/* Lay out len digits worth digits * 10^k as plain decimal or exponent */
+static int format_digits( char *buf, int len, int k ) {
+  int kk = len + k;   /* 10^(kk-1) <= value < 10^kk */
+  int i;
+
+  if (k >= 0 && kk <= 21) {
+    /* 1234e7 -> 12340000000 */
+    for (i = len; i < kk; i++) buf[i] = '0';
+    return kk;
+  }
+  if (kk > 0 && kk <= 21) {
+    /* 1234e-2 -> 12.34 */
+    memmove(buf + kk + 1, buf + kk, len - kk);
+    buf[kk] = '.';
+    return len + 1;
+  }
+  if (kk > -6 && kk <= 0) {
+    /* 1234e-6 -> 0.001234 */
+    int offset = 2 - kk;
+    memmove(buf + offset, buf, len);
+    buf[0] = '0';
+    buf[1] = '.';
+    for (i = 2; i < offset; i++) buf[i] = '0';
+    return len + offset;
+  }
+  if (len == 1) {
+    /* 1e30 */
+    return 1 + format_exponent(kk - 1, buf + 1);
+  }
+  /* 1234e30 -> 1.234e+33 */
+  memmove(buf + 2, buf + 1, len - 1);
+  buf[1] = '.';
+  return len + 1 + format_exponent(kk - 1, buf + len + 1);
+}
+
+/**
+ * Write value into buf (at least FORMAT_NUMBER_MAX bytes) as the
+ * shortest text that reads back as the same double, NULL terminated.
+ * Returns the length.
+ */
+int format_double( double value, char *buf ) {
+  char *p = buf;
+  int len, k;
+
+  if (isnan(value)) {
+    memcpy(buf, "nan", 4);
+    return 3;
+  }
+  if (value < 0) {
+    *p++ = '-';
+    value = -value;
+  }
+  if (isinf(value)) {
+    memcpy(p, "inf", 4);
+    return p - buf + 3;
+  }
+  if (value == 0) {
+    memcpy(buf, "0", 2);
+    return 1;
+  }
+  /* Whole numbers are common (counts) and need no digit search */
+  if (value < 9007199254740992.0 && value == (double) (int64_t) value) {
+    len = p - buf + format_long((long) value, p);
+    return len;
+  }
+
+  grisu2(value, p, &len, &k);
+  len = format_digits(p, len, k);
+  p[len] = '\0';
+  return p - buf + len;
+}
+
+int format_long( long value, char *buf ) {
+  char tmp[FORMAT_NUMBER_MAX];
+  unsigned long u = value < 0 ? -(unsigned long) value : (unsigned long) value;
+  int n = 0, len = 0;
+
+  do {
+    tmp[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (value < 0) buf[len++] = '-';
+  while (n) buf[len++] = tmp[--n];
+  buf[len] = '\0';
+  return len;
+}
+
+void lines_init( statsd_lines_t *l, UT_string *out, const char *ts ) {
+  l->out = out;
+  l->ts = ts;
+  l->ts_len = strlen(ts);
+  l->stem_len = 0;
+}
+
+/**
+ * Set the name stem of the lines that follow to prefix, key and suffix.
+ * prefix and suffix are short literals (under FORMAT_AFFIX_MAX).
+ */
+void lines_stem( statsd_lines_t *l, const char *prefix, const statsd_key_t *key, const char *suffix ) {
+  int plen = strlen(prefix), slen = strlen(suffix);
+  memcpy(l->stem, prefix, plen);
+  memcpy(l->stem + plen, key->name, key->len);
+  memcpy(l->stem + plen + key->len, suffix, slen);
+  l->stem_len = plen + key->len + slen;
+}
+
+/* Room for stem, suffix, value and timestamp; returns where to write */
+static char *lines_reserve( statsd_lines_t *l, const char *suffix, int *slen ) {
+  char *p;
+  *slen = strlen(suffix);
+  utstring_reserve(l->out, l->stem_len + *slen + FORMAT_NUMBER_MAX + l->ts_len + 3);
+  p = utstring_body(l->out) + utstring_len(l->out);
+  memcpy(p, l->stem, l->stem_len);
+  p += l->stem_len;
+  memcpy(p, suffix, *slen);
+  p += *slen;
+  *p++ = ' ';
+  return p;
+}
+
+static void lines_finish( statsd_lines_t *l, char *p ) {
+  *p++ = ' ';
+  memcpy(p, l->ts, l->ts_len);
+  p += l->ts_len;
+  *p++ = '\n';
+  *p = '\0';
+  l->out->i = p - utstring_body(l->out);
+}
+
+/* Append "<stem><suffix> <value> <ts>\n" */
+void lines_add( statsd_lines_t *l, const char *suffix, double value ) {
+  int slen;
+  char *p = lines_reserve(l, suffix, &slen);
+  p += format_double(value, p);
+  lines_finish(l, p);
+}
+
+void lines_add_long( statsd_lines_t *l, const char *suffix, long value ) {
+  int slen;
+  char *p = lines_reserve(l, suffix, &slen);
+  p += format_long(value, p);
+  lines_finish(l, p);
+}
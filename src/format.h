@@ -0,0 +1,43 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "keys.h"
+#include "uthash/utstring.h"
+
+#ifndef __FORMAT_H__
+#define __FORMAT_H__ 1
+
+/* Longest text format_double() and format_long() produce, with NULL */
+#define FORMAT_NUMBER_MAX 32
+
+/* Longest prefix or suffix put around a key in an output name */
+#define FORMAT_AFFIX_MAX 32
+
+/*
+ * Builder for graphite plaintext lines "<name> <value> <timestamp>\n".
+ * The name stem (prefix, key and suffix) is assembled once and reused
+ * for every line of a metric; each line is written straight into the
+ * output buffer after reserving the most it can take.
+ */
+typedef struct {
+  UT_string *out;
+  const char *ts;
+  int ts_len;
+  char stem[STATSD_KEY_MAX + 2 * FORMAT_AFFIX_MAX];
+  int stem_len;
+} statsd_lines_t;
+
+int format_double( double value, char *buf );
+int format_long( long value, char *buf );
+
+void lines_init( statsd_lines_t *l, UT_string *out, const char *ts );
+void lines_stem( statsd_lines_t *l, const char *prefix, const statsd_key_t *key, const char *suffix );
+void lines_add( statsd_lines_t *l, const char *suffix, double value );
+void lines_add_long( statsd_lines_t *l, const char *suffix, long value );
+
+#endif /* __FORMAT_H__ */
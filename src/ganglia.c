@@ -0,0 +1,212 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "config.h"
+
+#ifdef HAVE_SENDMMSG
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "ganglia.h"
+
+void ganglia_init( statsd_ganglia_t *g, const char *spoof, unsigned int tmax, int metadata_interval ) {
+  memset(g, 0, sizeof(statsd_ganglia_t));
+  gmetric_create(&g->gm);
+  g->spoof = spoof;
+  g->tmax = tmax;
+  g->metadata_interval = metadata_interval > 0 ? metadata_interval : 1;
+  sem_init(&g->lock, 0, 1);
+}
+
+/* Resolve host and open the socket kept for every later flush */
+int ganglia_open( statsd_ganglia_t *g, const char *host, int port ) {
+  return gmetric_open(&g->gm, host, port);
+}
+
+/**
+ * Called by the flush thread before any flusher adds metrics: counts
+ * the flush and forgets metrics the previous flush did not send.
+ */
+void ganglia_flush_start( statsd_ganglia_t *g ) {
+  statsd_ganglia_metric_t *m, *tmp;
+
+  g->flushes++;
+  HASH_ITER(hh, g->metrics, m, tmp) {
+    if (m->used_flush < g->flushes - 1) {
+      HASH_DEL(g->metrics, m);
+      free(m);
+    }
+  }
+}
+
+void ganglia_batch_init( statsd_ganglia_batch_t *b ) {
+  memset(b, 0, sizeof(statsd_ganglia_batch_t));
+}
+
+/* Encode both packets of a metric not seen before */
+static statsd_ganglia_metric_t *ganglia_metric_new( statsd_ganglia_t *g, const char *group, const char *name, const char *units, gmetric_value_t type ) {
+  char meta[GMETRIC_MAX_MESSAGE_LEN], head[GMETRIC_MAX_MESSAGE_LEN];
+  int meta_len, head_len, name_len = strlen(name);
+  statsd_ganglia_metric_t *m;
+  gmetric_message_t msg = {
+    .format = GMETRIC_FORMAT_31,
+    .type = type,
+    .name = name,
+    .group = group,
+    .hostname = g->spoof,
+    .value.v_string = "",
+    .units = units,
+    .slope = GMETRIC_SLOPE_BOTH,
+    .tmax = g->tmax,
+    .dmax = g->tmax,
+    .spoof = 1
+  };
+
+  meta_len = gmetadata_message_create_xdr(meta, sizeof(meta), &msg);
+  head_len = gmetric31_message_create_xdr(head, sizeof(head), &msg);
+  if (meta_len < 0 || head_len < 4) {
+    return NULL;
+  }
+  /* The empty value string is the last 4 bytes; the flush supplies its own */
+  head_len -= 4;
+
+  m = malloc(sizeof(statsd_ganglia_metric_t) + name_len + 1 + meta_len + head_len);
+  if (m == NULL) return NULL;
+  m->name = (char *) ( m + 1 );
+  memcpy(m->name, name, name_len + 1);
+  m->meta = m->name + name_len + 1;
+  memcpy(m->meta, meta, meta_len);
+  m->meta_len = meta_len;
+  m->head = m->meta + meta_len;
+  memcpy(m->head, head, head_len);
+  m->head_len = head_len;
+  m->meta_flush = -1;
+  m->used_flush = -1;
+  HASH_ADD_KEYPTR(hh, g->metrics, m->name, name_len, m);
+  return m;
+}
+
+/* Queue one packet, sending the batch first if it is full */
+static int ganglia_slot( statsd_ganglia_t *g, statsd_ganglia_batch_t *b ) {
+  if (b->count == GANGLIA_BATCH) {
+    ganglia_batch_send(g, b);
+  }
+  return b->count++;
+}
+
+/**
+ * Queue the value of a metric, preceded by its metadata packet when it
+ * is new to the cache or metadata_interval flushes have passed.
+ */
+void ganglia_add( statsd_ganglia_t *g, statsd_ganglia_batch_t *b, const char *group, const char *name, const char *units, gmetric_value_t type, const char *value ) {
+  statsd_ganglia_metric_t *m;
+  int send_meta, len = strlen(value), i;
+  char *v;
+
+  if (len > GANGLIA_VALUE_MAX - 8) {
+    len = GANGLIA_VALUE_MAX - 8;
+  }
+
+  sem_wait(&g->lock);
+  HASH_FIND_STR(g->metrics, name, m);
+  if (m == NULL) {
+    m = ganglia_metric_new(g, group, name, units, type);
+  }
+  if (m == NULL) {
+    sem_post(&g->lock);
+    syslog(LOG_ERR, "Failed to encode gmetric %s", name);
+    b->failed++;
+    return;
+  }
+  send_meta = m->meta_flush < 0 || g->flushes - m->meta_flush >= g->metadata_interval;
+  if (send_meta) {
+    m->meta_flush = g->flushes;
+  }
+  m->used_flush = g->flushes;
+  sem_post(&g->lock);
+
+  if (send_meta) {
+    i = ganglia_slot(g, b);
+    b->iov[i][0].iov_base = m->meta;
+    b->iov[i][0].iov_len = m->meta_len;
+    b->iovlen[i] = 1;
+  }
+
+  i = ganglia_slot(g, b);
+  v = b->values[i];
+  v[0] = 0;
+  v[1] = 0;
+  v[2] = 0;
+  v[3] = (char) len;
+  memcpy(v + 4, value, len);
+  memset(v + 4 + len, 0, ( 4 - len % 4 ) % 4);
+  b->iov[i][0].iov_base = m->head;
+  b->iov[i][0].iov_len = m->head_len;
+  b->iov[i][1].iov_base = v;
+  b->iov[i][1].iov_len = 4 + ( ( len + 3 ) & ~3 );
+  b->iovlen[i] = 2;
+}
+
+void ganglia_add_double( statsd_ganglia_t *g, statsd_ganglia_batch_t *b, const char *group, const char *name, const char *units, double value ) {
+  char buf[FORMAT_NUMBER_MAX];
+  format_double(value, buf);
+  ganglia_add(g, b, group, name, units, GMETRIC_VALUE_DOUBLE, buf);
+}
+
+void ganglia_add_long( statsd_ganglia_t *g, statsd_ganglia_batch_t *b, const char *group, const char *name, const char *units, long value ) {
+  char buf[FORMAT_NUMBER_MAX];
+  format_long(value, buf);
+  ganglia_add(g, b, group, name, units, GMETRIC_VALUE_INT, buf);
+}
+
+/* Send everything queued in b; the cache entries it points to stay put until the next flush */
+void ganglia_batch_send( statsd_ganglia_t *g, statsd_ganglia_batch_t *b ) {
+  int i, done = 0;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[GANGLIA_BATCH];
+#else
+  struct msghdr hdr;
+#endif
+
+  if (b->count == 0) return;
+
+#ifdef HAVE_SENDMMSG
+  memset(msgs, 0, sizeof(struct mmsghdr) * b->count);
+  for (i = 0; i < b->count; i++) {
+    msgs[i].msg_hdr.msg_name = &g->gm.sa;
+    msgs[i].msg_hdr.msg_namelen = sizeof(g->gm.sa);
+    msgs[i].msg_hdr.msg_iov = b->iov[i];
+    msgs[i].msg_hdr.msg_iovlen = b->iovlen[i];
+  }
+  while (done < b->count) {
+    int n = sendmmsg(g->gm.s, msgs + done, b->count - done, 0);
+    if (n <= 0) break;
+    done += n;
+  }
+#else
+  for (i = 0; i < b->count; i++) {
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &g->gm.sa;
+    hdr.msg_namelen = sizeof(g->gm.sa);
+    hdr.msg_iov = b->iov[i];
+    hdr.msg_iovlen = b->iovlen[i];
+    if (sendmsg(g->gm.s, &hdr, 0) != -1) done++;
+  }
+#endif
+
+  b->sent += done;
+  b->failed += b->count - done;
+  b->count = 0;
+}
@@ -0,0 +1,80 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <semaphore.h>
+#include <sys/uio.h>
+
+#include "uthash/uthash.h"
+#include "embeddedgmetric/embeddedgmetric.h"
+#include "format.h"
+
+#ifndef __GANGLIA_H__
+#define __GANGLIA_H__ 1
+
+/* Packets handed to the kernel per sendmmsg() */
+#define GANGLIA_BATCH 64
+
+/* Default flushes between metadata packets for a metric, -E */
+#define GANGLIA_METADATA_INTERVAL 10
+
+/* An XDR string holding a formatted value: length, text, padding */
+#define GANGLIA_VALUE_MAX ( 4 + FORMAT_NUMBER_MAX + 4 )
+
+/*
+ * A metric gmond has been told about. Both packets are encoded once:
+ * meta is the whole metadata packet, head is the value packet up to
+ * the value itself, so a flush only encodes the value string.
+ */
+typedef struct {
+  char *name;           /* hash key, points into the same allocation */
+  char *meta;
+  int meta_len;
+  char *head;
+  int head_len;
+  long meta_flush;      /* flush that last sent meta */
+  long used_flush;      /* flush that last sent a value */
+  UT_hash_handle hh;
+} statsd_ganglia_metric_t;
+
+/*
+ * Persistent gmond socket and the metric cache. Metrics are dropped
+ * from the cache when a flush goes by without them, so one that comes
+ * back (after gmond may have expired it) is announced again.
+ */
+typedef struct {
+  gmetric_t gm;
+  const char *spoof;
+  unsigned int tmax;
+  int metadata_interval;
+  long flushes;
+  statsd_ganglia_metric_t *metrics;
+  sem_t lock;
+  long packets_sent;
+  long send_errors;
+} statsd_ganglia_t;
+
+/* Packets queued by one flusher, sent GANGLIA_BATCH at a time */
+typedef struct {
+  struct iovec iov[GANGLIA_BATCH][2];
+  int iovlen[GANGLIA_BATCH];
+  char values[GANGLIA_BATCH][GANGLIA_VALUE_MAX];
+  int count;
+  long sent;
+  long failed;
+} statsd_ganglia_batch_t;
+
+void ganglia_init( statsd_ganglia_t *g, const char *spoof, unsigned int tmax, int metadata_interval );
+int ganglia_open( statsd_ganglia_t *g, const char *host, int port );
+void ganglia_flush_start( statsd_ganglia_t *g );
+void ganglia_batch_init( statsd_ganglia_batch_t *b );
+void ganglia_add( statsd_ganglia_t *g, statsd_ganglia_batch_t *b, const char *group, const char *name, const char *units, gmetric_value_t type, const char *value );
+void ganglia_add_double( statsd_ganglia_t *g, statsd_ganglia_batch_t *b, const char *group, const char *name, const char *units, double value );
+void ganglia_add_long( statsd_ganglia_t *g, statsd_ganglia_batch_t *b, const char *group, const char *name, const char *units, long value );
+void ganglia_batch_send( statsd_ganglia_t *g, statsd_ganglia_batch_t *b );
+
+#endif /* __GANGLIA_H__ */
@@ -6,24 +6,27 @@
  *
  */
 
-#include <semaphore.h>
-
-#include "uthash/uthash.h"
+#include "keys.h"
+#include "shards.h"
+#include "slab.h"
 
 #ifndef __GAUGES_H__
 #define __GAUGES_H__ 1
 
+/* Indexed by key id in gauges */
 typedef struct {
-  char key[100];
+  statsd_key_t *key;
   long double value;
-  UT_hash_handle hh; /* makes this structure hashable */
+  uint64_t stamp;     /* of the absolute set value came from */
+  long seen;          /* flush_seq of the last merge */
 } statsd_gauge_t;
 
-extern statsd_gauge_t *gauges;
-extern sem_t gauges_lock;
+extern statsd_idtable_t gauges;
+extern statsd_shard_t gauges_shards[STATSD_SHARDS];
+extern statsd_slab_t gauges_slab;
 
-#define wait_for_gauges_lock() sem_wait(&gauges_lock)
-#define remove_gauges_lock() sem_post(&gauges_lock)
+#define wait_for_gauges_lock(key) pthread_mutex_lock(&gauges_shards[KEY_SHARD(key)].lock)
+#define remove_gauges_lock(key) pthread_mutex_unlock(&gauges_shards[KEY_SHARD(key)].lock)
 
 #endif /* __GAUGES_H__ */
 
@@ -0,0 +1,412 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+#include <stdio.h>
+
+#include "graphite.h"
+#include "md5.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static long graphite_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void graphite_init( statsd_graphite_t *g, const char *host, int port, const char *instance ) {
+  memset(g, 0, sizeof(statsd_graphite_t));
+  g->sock = -1;
+  g->backoff = GRAPHITE_BACKOFF_MIN;
+  g->host = strdup(host);
+  g->instance = instance ? strdup(instance) : NULL;
+  snprintf(g->port, sizeof(g->port), "%d", port);
+}
+
+/**
+ * Parse a csv list of carbon destinations, host[:port[:instance]] as
+ * in carbon's DESTINATIONS; IPv6 addresses go in brackets. Returns how
+ * many were set up in *out, or 0 if any of them is malformed.
+ */
+int graphite_destinations( const char *csv, int default_port, statsd_graphite_t **out ) {
+  char *copy = strdup(csv), *save = NULL, *tok;
+  int n = 0;
+
+  *out = NULL;
+  for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    char *host = tok, *rest, *instance = NULL;
+    int port = default_port;
+
+    if (*host == '[') {
+      host++;
+      rest = strchr(host, ']');
+      if (rest == NULL) goto bad;
+      *rest++ = '\0';
+      if (*rest == ':') rest++;
+      else if (*rest != '\0') goto bad;
+    } else {
+      rest = strchr(host, ':');
+      if (rest) *rest++ = '\0';
+    }
+    if (*host == '\0') goto bad;
+    if (rest && *rest) {
+      char *end;
+      port = strtol(rest, &end, 10);
+      if (end == rest || port <= 0 || port > 65535 || ( *end != '\0' && *end != ':' )) goto bad;
+      if (*end == ':' && end[1] != '\0') instance = end + 1;
+    }
+
+    *out = realloc(*out, ( n + 1 ) * sizeof(statsd_graphite_t));
+    graphite_init(&(*out)[n++], host, port, instance);
+  }
+  free(copy);
+  return n;
+
+bad:
+  fprintf(stderr, "Bad graphite destination '%s'\n", tok);
+  free(copy);
+  free(*out);
+  *out = NULL;
+  return 0;
+}
+
+static void graphite_disconnect( statsd_graphite_t *g ) {
+  if (g->sock >= 0) {
+    close(g->sock);
+    g->sock = -1;
+  }
+}
+
+static void graphite_failed( statsd_graphite_t *g, const char *what ) {
+  syslog(LOG_ERR, "Graphite %s %s:%s failed: %s, retrying in %ld ms", what, g->host, g->port, strerror(errno), g->backoff);
+  graphite_disconnect(g);
+  g->next_attempt = graphite_clock() + g->backoff * 1000;
+  g->backoff *= 2;
+  if (g->backoff > GRAPHITE_BACKOFF_MAX) g->backoff = GRAPHITE_BACKOFF_MAX;
+}
+
+/* Carbon never talks back, so anything readable is a close or an error */
+static int graphite_alive( statsd_graphite_t *g ) {
+  char c;
+  ssize_t n = recv(g->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK );
+}
+
+/*
+ * After losing the connection, drop the rest of a line that was partly
+ * written; it can't be finished on a new one. That line is at the head
+ * of pending, or of what is left of buf if pending was all written.
+ */
+static void graphite_drop_partial( statsd_graphite_t *g, const char *buf, size_t len, size_t *off ) {
+  const char *head = g->pending_len > 0 ? g->pending : buf + *off;
+  size_t head_len = g->pending_len > 0 ? g->pending_len : len - *off;
+  char *nl;
+  size_t cut;
+
+  if (!g->partial) return;
+  nl = memchr(head, '\n', head_len);
+  cut = nl ? (size_t) ( nl - head ) + 1 : head_len;
+  if (g->pending_len > 0) {
+    memmove(g->pending, g->pending + cut, g->pending_len - cut);
+    g->pending_len -= cut;
+  } else {
+    *off += cut;
+  }
+  g->dropped_lines++;
+  g->partial = 0;
+}
+
+/* Wait for events on the socket until deadline; 0 on timeout */
+static int graphite_wait( statsd_graphite_t *g, short events, long deadline ) {
+  struct pollfd pfd = { .fd = g->sock, .events = events };
+  long left = ( deadline - graphite_clock() ) / 1000;
+  if (left <= 0) return 0;
+  return poll(&pfd, 1, left) > 0;
+}
+
+/*
+ * Start a non-blocking connect to one address and wait for it until
+ * deadline. On failure the socket is closed and errno says why.
+ */
+static int graphite_try( statsd_graphite_t *g, const struct addrinfo *ai, long deadline ) {
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  g->sock = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+  if (g->sock < 0) return 0;
+  fcntl(g->sock, F_SETFL, fcntl(g->sock, F_GETFL) | O_NONBLOCK);
+
+  if (connect(g->sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+    if (errno != EINPROGRESS) goto fail;
+    if (!graphite_wait(g, POLLOUT, deadline)) {
+      errno = ETIMEDOUT;
+      goto fail;
+    }
+    if (getsockopt(g->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) goto fail;
+    if (err != 0) {
+      errno = err;
+      goto fail;
+    }
+  }
+  memcpy(&g->sa, ai->ai_addr, ai->ai_addrlen);
+  g->salen = ai->ai_addrlen;
+  return 1;
+
+fail:
+  err = errno;
+  graphite_disconnect(g);
+  errno = err;
+  return 0;
+}
+
+/**
+ * Connect without blocking past deadline, unless still backing off
+ * from the last failure. Each address the host resolves to is tried
+ * in turn, so a dual-stack relay that only listens on one family, or
+ * one dead member of a round-robin name, doesn't stop the rest.
+ * Returns whether the socket is usable.
+ */
+static int graphite_connect( statsd_graphite_t *g, long deadline ) {
+  struct addrinfo hints, *res = NULL, *ai;
+  int rc, ok = 0, err = 0;
+
+  if (g->sock >= 0) return 1;
+  if (graphite_clock() < g->next_attempt) return 0;
+
+  /* Resolve on every attempt, so a relay that moves is followed */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rc = getaddrinfo(g->host, g->port, &hints, &res)) != 0) {
+    syslog(LOG_ERR, "Unable to resolve graphite host %s: %s", g->host, gai_strerror(rc));
+    errno = EHOSTUNREACH;
+    graphite_failed(g, "lookup");
+    return 0;
+  }
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((ok = graphite_try(g, ai, deadline))) break;
+    err = errno;
+    if (ai->ai_next != NULL) {
+      syslog(LOG_DEBUG, "Graphite connect %s:%s failed on one address: %s, trying the next", g->host, g->port, strerror(err));
+    }
+  }
+  freeaddrinfo(res);
+  if (!ok) {
+    errno = err;
+    graphite_failed(g, "connect");
+    return 0;
+  }
+
+  if (g->connected_once) g->reconnects++;
+  g->connected_once = 1;
+  g->backoff = GRAPHITE_BACKOFF_MIN;
+  syslog(LOG_INFO, "Connected to graphite %s:%s", g->host, g->port);
+  return 1;
+}
+
+static void graphite_spill( statsd_graphite_t *g, const char *buf, size_t len ) {
+  size_t keep = 0, cut;
+
+  if (g->pending_len + len > g->pending_max) {
+    g->pending_max = g->pending_len + len;
+    g->pending = realloc(g->pending, g->pending_max);
+  }
+  memcpy(g->pending + g->pending_len, buf, len);
+  g->pending_len += len;
+  if (g->pending_len <= GRAPHITE_SPILL_MAX) return;
+
+  /* Over the limit: drop the oldest whole lines, past any partial one */
+  if (g->partial) {
+    char *nl = memchr(g->pending, '\n', g->pending_len);
+    keep = nl ? (size_t) ( nl - g->pending ) + 1 : g->pending_len;
+  }
+  cut = keep;
+  while (cut < g->pending_len && g->pending_len - ( cut - keep ) > GRAPHITE_SPILL_MAX) {
+    char *nl = memchr(g->pending + cut, '\n', g->pending_len - cut);
+    cut = nl ? (size_t) ( nl - g->pending ) + 1 : g->pending_len;
+    g->dropped_lines++;
+  }
+  memmove(g->pending + keep, g->pending + cut, g->pending_len - cut);
+  g->pending_len -= cut - keep;
+}
+
+/**
+ * Write out anything left from earlier flushes followed by buf. Gives
+ * up on the socket after GRAPHITE_SEND_TIMEOUT; what is left over is
+ * kept for the next call.
+ */
+void graphite_send( statsd_graphite_t *g, const char *buf, size_t len ) {
+  long deadline = graphite_clock() + GRAPHITE_SEND_TIMEOUT * 1000L;
+  size_t off = 0;
+
+  while (g->pending_len > 0 || off < len) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+    int cnt = 0;
+
+    if (g->sock >= 0 && !graphite_alive(g)) {
+      syslog(LOG_INFO, "Graphite %s:%s closed the connection", g->host, g->port);
+      graphite_disconnect(g);
+      graphite_drop_partial(g, buf, len, &off);
+      continue;
+    }
+    if (!graphite_connect(g, deadline)) break;
+
+    if (g->pending_len > 0) {
+      iov[cnt].iov_base = g->pending;
+      iov[cnt++].iov_len = g->pending_len;
+    }
+    if (off < len) {
+      iov[cnt].iov_base = (char *) buf + off;
+      iov[cnt++].iov_len = len - off;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+
+    n = sendmsg(g->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!graphite_wait(g, POLLOUT, deadline)) break;
+        continue;
+      }
+      graphite_failed(g, "send");
+      graphite_drop_partial(g, buf, len, &off);
+      continue;
+    }
+
+    g->bytes_sent += n;
+    if ((size_t) n > g->pending_len) {
+      off += n - g->pending_len;
+      g->pending_len = 0;
+      g->partial = buf[off - 1] != '\n';
+    } else if (n > 0) {
+      g->partial = g->pending[n - 1] != '\n';
+      memmove(g->pending, g->pending + n, g->pending_len - n);
+      g->pending_len -= n;
+    }
+  }
+
+  if (off < len) {
+    graphite_spill(g, buf + off, len - off);
+  }
+}
+
+void graphite_close( statsd_graphite_t *g ) {
+  graphite_disconnect(g);
+  free(g->pending);
+  g->pending = NULL;
+  g->pending_len = g->pending_max = 0;
+}
+
+static uint32_t ring_position( const char *key, size_t len ) {
+  uint8_t digest[16];
+  md5_digest(key, len, digest);
+  return ( digest[0] << 8 ) | digest[1];
+}
+
+static int ring_point_sort( const void *a, const void *b ) {
+  const statsd_ring_point_t *_a = a, *_b = b;
+  if (_a->position == _b->position) return 0;
+  return (_a->position < _b->position) ? -1 : 1;
+}
+
+/**
+ * Build the ring the way carbon-relay does: destinations in order, and
+ * a point that lands on a taken position moves up until it is free.
+ */
+void graphite_ring_init( statsd_graphite_ring_t *ring, statsd_graphite_t *dests, int num_dests ) {
+  int d, i, j;
+
+  ring->num_points = 0;
+  ring->points = malloc(num_dests * GRAPHITE_RING_REPLICAS * sizeof(statsd_ring_point_t));
+  for (d = 0; d < num_dests; d++) {
+    for (i = 0; i < GRAPHITE_RING_REPLICAS; i++) {
+      char key[300];
+      int len;
+      uint32_t position;
+
+      /* str() of carbon's (server, instance) tuple, then ":n" */
+      if (dests[d].instance) {
+        len = snprintf(key, sizeof(key), "('%s', '%s'):%d", dests[d].host, dests[d].instance, i);
+      } else {
+        len = snprintf(key, sizeof(key), "('%s', None):%d", dests[d].host, i);
+      }
+      position = ring_position(key, len);
+      for (j = 0; j < ring->num_points; j++) {
+        if (ring->points[j].position == position) {
+          position++;
+          j = -1;
+        }
+      }
+      ring->points[ring->num_points].position = position;
+      ring->points[ring->num_points++].dest = d;
+    }
+  }
+  qsort(ring->points, ring->num_points, sizeof(statsd_ring_point_t), ring_point_sort);
+}
+
+/* Destination for a metric name: the first point at or after its hash */
+int graphite_ring_lookup( const statsd_graphite_ring_t *ring, const char *metric, size_t len ) {
+  uint32_t position = ring_position(metric, len);
+  int lo = 0, hi = ring->num_points;
+
+  while (lo < hi) {
+    int mid = ( lo + hi ) / 2;
+    if (ring->points[mid].position < position) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return ring->points[ lo % ring->num_points ].dest;
+}
+
+/**
+ * Split plaintext protocol lines between destinations by the metric
+ * name, appending each line to outs[dest].
+ */
+void graphite_route( const statsd_graphite_ring_t *ring, const char *buf, size_t len, UT_string **outs ) {
+  const char *end = buf + len;
+
+  while (buf < end) {
+    const char *nl = memchr(buf, '\n', end - buf);
+    const char *sp;
+    size_t line = nl ? (size_t) ( nl - buf + 1 ) : (size_t) ( end - buf );
+
+    sp = memchr(buf, ' ', line);
+    utstring_bincpy(outs[ graphite_ring_lookup(ring, buf, sp ? (size_t) ( sp - buf ) : line) ], buf, line);
+    buf += line;
+  }
+}
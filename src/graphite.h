@@ -0,0 +1,82 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "uthash/utstring.h"
+
+#ifndef __GRAPHITE_H__
+#define __GRAPHITE_H__ 1
+
+/* Most unsent output kept across flushes while carbon is unreachable */
+#define GRAPHITE_SPILL_MAX ( 16 * 1024 * 1024 )
+
+/* Longest a flush waits on connecting and writing, in milliseconds */
+#define GRAPHITE_SEND_TIMEOUT 2000
+
+/* Reconnect backoff bounds, in milliseconds */
+#define GRAPHITE_BACKOFF_MIN 1000
+#define GRAPHITE_BACKOFF_MAX 60000
+
+/* Points per destination on the hash ring, as carbon-relay */
+#define GRAPHITE_RING_REPLICAS 100
+
+/*
+ * Long-lived connection to carbon. Output that cannot be written within
+ * GRAPHITE_SEND_TIMEOUT is kept in pending and goes out ahead of the
+ * next flush; past GRAPHITE_SPILL_MAX the oldest lines are dropped.
+ * Only the flush thread uses it.
+ */
+typedef struct {
+  char *host;
+  char port[8];
+  char *instance;       /* carbon instance name, NULL if none */
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  int sock;
+  long next_attempt;    /* monotonic usec before which we won't reconnect */
+  long backoff;         /* msec */
+  int connected_once;
+  int partial;          /* the first pending line is partly written */
+  char *pending;
+  size_t pending_len, pending_max;
+  long bytes_sent;
+  long reconnects;
+  long dropped_lines;
+} statsd_graphite_t;
+
+/*
+ * carbon-relay's consistent hash ring: every destination gets
+ * GRAPHITE_RING_REPLICAS points at the top 16 bits of the md5 of
+ * "('host', 'instance'):n", and a metric goes to the first point at or
+ * after the md5 of its name. Using the same ring as the relays means
+ * each carbon-cache receives the metrics it would get from them.
+ */
+typedef struct {
+  uint32_t position;
+  int dest;
+} statsd_ring_point_t;
+
+typedef struct {
+  statsd_ring_point_t *points;
+  int num_points;
+} statsd_graphite_ring_t;
+
+void graphite_init( statsd_graphite_t *g, const char *host, int port, const char *instance );
+int graphite_destinations( const char *csv, int default_port, statsd_graphite_t **out );
+void graphite_send( statsd_graphite_t *g, const char *buf, size_t len );
+void graphite_close( statsd_graphite_t *g );
+void graphite_ring_init( statsd_graphite_ring_t *ring, statsd_graphite_t *dests, int num_dests );
+int graphite_ring_lookup( const statsd_graphite_ring_t *ring, const char *metric, size_t len );
+void graphite_route( const statsd_graphite_ring_t *ring, const char *buf, size_t len, UT_string **outs );
+
+#endif /* __GRAPHITE_H__ */
@@ -0,0 +1,206 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_IMMINTRIN_H
+#include <immintrin.h>
+#endif
+
+#include "hll.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define HLL_X86 1
+#endif
+
+#define HLL_REGISTERS ( (size_t) 1 << hll_precision )
+
+int hll_precision = HLL_PRECISION_DEFAULT;
+
+static void hll_merge_scalar( statsd_hll_t *dst, const statsd_hll_t *src );
+
+void (*hll_merge)( statsd_hll_t *dst, const statsd_hll_t *src ) = hll_merge_scalar;
+static const char *hll_kernel = "scalar";
+
+static void hll_merge_scalar( statsd_hll_t *dst, const statsd_hll_t *src ) {
+  size_t i, m = HLL_REGISTERS;
+  for (i = 0; i < m; i++) {
+    if (src->registers[i] > dst->registers[i]) dst->registers[i] = src->registers[i];
+  }
+  dst->added += src->added;
+}
+
+#ifdef HLL_X86
+
+/* There are at least 16 registers, and always a power of two of them */
+
+__attribute__((target("sse2")))
+static void hll_merge_sse2( statsd_hll_t *dst, const statsd_hll_t *src ) {
+  size_t i, m = HLL_REGISTERS;
+  for (i = 0; i < m; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (dst->registers + i));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src->registers + i));
+    _mm_storeu_si128((__m128i *) (dst->registers + i), _mm_max_epu8(a, b));
+  }
+  dst->added += src->added;
+}
+
+__attribute__((target("avx2")))
+static void hll_merge_avx2( statsd_hll_t *dst, const statsd_hll_t *src ) {
+  size_t i, m = HLL_REGISTERS;
+  if (m < 32) {
+    hll_merge_scalar(dst, src);
+    return;
+  }
+  for (i = 0; i < m; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (dst->registers + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (src->registers + i));
+    _mm256_storeu_si256((__m256i *) (dst->registers + i), _mm256_max_epu8(a, b));
+  }
+  dst->added += src->added;
+}
+
+#endif /* HLL_X86 */
+
+/**
+ * Merge with the named kernel ("avx2", "sse2" or "scalar") if it was
+ * built in and the running CPU supports it. Returns 0 if not, keeping
+ * the current one. Mostly for tests and benchmarks comparing them.
+ */
+int hll_select( const char *name ) {
+#ifdef HLL_X86
+  __builtin_cpu_init();
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    hll_merge = hll_merge_avx2;
+    hll_kernel = "avx2";
+    return 1;
+  }
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    hll_merge = hll_merge_sse2;
+    hll_kernel = "sse2";
+    return 1;
+  }
+#endif
+  if (strcmp(name, "scalar") == 0) {
+    hll_merge = hll_merge_scalar;
+    hll_kernel = "scalar";
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Set the precision of all sets and pick the widest merge kernel the
+ * running CPU supports. Returns 0 if precision is out of bounds.
+ */
+int hll_init( int precision ) {
+  if (precision < HLL_PRECISION_MIN || precision > HLL_PRECISION_MAX) return 0;
+  hll_precision = precision;
+  if (!hll_select("avx2") && !hll_select("sse2")) {
+    hll_select("scalar");
+  }
+  return 1;
+}
+
+const char *hll_kernel_name() {
+  return hll_kernel;
+}
+
+statsd_hll_t *hll_new() {
+  return calloc(1, sizeof(statsd_hll_t) + HLL_REGISTERS);
+}
+
+void hll_free( statsd_hll_t *h ) {
+  free(h);
+}
+
+void hll_clear( statsd_hll_t *h ) {
+  memset(h->registers, 0, HLL_REGISTERS);
+  h->added = 0;
+}
+
+/**
+ * 64-bit FNV-1a of the value, finished with MurmurHash3's fmix64 so the
+ * top bits, which pick the register, depend on every byte.
+ */
+uint64_t hll_hash( const char *value, int len ) {
+  uint64_t h = 14695981039346656037ull;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) value[i];
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+void hll_add( statsd_hll_t *h, uint64_t hash ) {
+  uint32_t i = hash >> ( 64 - hll_precision );
+  /* The guard bit caps the rank at 64 - p + 1 */
+  uint64_t rest = ( hash << hll_precision ) | ( (uint64_t) 1 << ( hll_precision - 1 ) );
+  uint8_t rank = __builtin_clzll(rest) + 1;
+
+  if (rank > h->registers[i]) h->registers[i] = rank;
+  h->added++;
+}
+
+/* Helpers of Ertl's estimator, "New cardinality estimation algorithms
+ * for HyperLogLog sketches" (2017), section 4 */
+static double hll_sigma( double x ) {
+  double y = 1, z = x, prev;
+  if (x == 1) return INFINITY;
+  do {
+    x *= x;
+    prev = z;
+    z += x * y;
+    y += y;
+  } while (z != prev);
+  return z;
+}
+
+static double hll_tau( double x ) {
+  double y = 1, z = 1 - x, prev;
+  if (x == 0 || x == 1) return 0;
+  do {
+    x = sqrt(x);
+    prev = z;
+    y *= 0.5;
+    z -= ( 1 - x ) * ( 1 - x ) * y;
+  } while (z != prev);
+  return z / 3;
+}
+
+/**
+ * Estimated number of distinct values, with Ertl's improved estimator:
+ * it works from the histogram of register values and needs neither
+ * linear counting for small sets nor bias tables in between.
+ */
+double hll_count( const statsd_hll_t *h ) {
+  int q = 64 - hll_precision, k;
+  size_t i, m = HLL_REGISTERS;
+  uint32_t hist[64 + 2] = { 0 };
+  double z;
+
+  for (i = 0; i < m; i++) {
+    hist[ h->registers[i] ]++;
+  }
+  z = m * hll_tau(1 - (double) hist[q + 1] / m);
+  for (k = q; k >= 1; k--) {
+    z = 0.5 * ( z + hist[k] );
+  }
+  z += m * hll_sigma((double) hist[0] / m);
+  return ( 0.5 / M_LN2 ) * m * m / z;
+}
@@ -0,0 +1,47 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+
+#ifndef __HLL_H__
+#define __HLL_H__ 1
+
+/* Bounds and default for the precision p; a set has 2^p registers */
+#define HLL_PRECISION_MIN 4
+#define HLL_PRECISION_MAX 16
+#define HLL_PRECISION_DEFAULT 12
+
+/*
+ * HyperLogLog distinct counter. The top p bits of a value's 64-bit hash
+ * pick a register, which keeps the highest rank (leading zeros plus one)
+ * seen in the remaining bits. Registers are a byte each, so merging two
+ * sets is a byte-wise max over the whole array. The standard error of
+ * count is about 1.04 / sqrt(2^p): 1.6% at the default of 12, for 4KB.
+ */
+typedef struct {
+  uint64_t added;         /* values added or merged in, duplicates too */
+  uint8_t registers[];
+} statsd_hll_t;
+
+/* Precision of every set; fixed at startup, so any two can be merged */
+extern int hll_precision;
+
+/* dst |= src, register by register; the CPU's widest kernel after hll_init() */
+extern void (*hll_merge)( statsd_hll_t *dst, const statsd_hll_t *src );
+
+int hll_init( int precision );
+int hll_select( const char *name );
+const char *hll_kernel_name();
+statsd_hll_t *hll_new();
+void hll_free( statsd_hll_t *h );
+void hll_clear( statsd_hll_t *h );
+uint64_t hll_hash( const char *value, int len );
+void hll_add( statsd_hll_t *h, uint64_t hash );
+double hll_count( const statsd_hll_t *h );
+
+#endif /* __HLL_H__ */
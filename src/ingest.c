@@ -0,0 +1,168 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "json-c/json.h"
+#include "aggregate.h"
+#include "ingest.h"
+#include "keys.h"
+#include "parser.h"
+#include "scan.h"
+#include "statsd.h"
+#include "strings.h"
+
+long last_msg_seen = 0;
+atomic_long bad_lines_seen = 0;
+
+static void process_json_stats_object(statsd_agg_t *agg, json_object *sobj);
+
+void process_json_stats_packet(statsd_agg_t *agg, char buf_in[]) {
+  last_msg_seen = time(NULL);
+  if (strlen(buf_in) < 2) {
+    return;
+  }
+
+  json_object *obj = json_tokener_parse(&buf_in[0]);
+  if (!obj) {
+    syslog(LOG_ERR, "Bad JSON object, skipping");
+    return;
+  }
+
+  if (json_object_get_type(obj) == json_type_object) {
+    syslog(LOG_DEBUG, "Processing single stats object");
+    process_json_stats_object(agg, obj);
+  } else if (json_object_get_type(obj) == json_type_array) {
+    int i;
+    for (i=0; i<json_object_array_length(obj); i++) {
+      syslog(LOG_DEBUG, "Iterating through objects at pos %d", i);
+      process_json_stats_object(agg, json_object_array_get_idx(obj, i));
+    }
+  } else {
+    syslog(LOG_ERR, "Bad JSON data presented");
+  }
+}
+
+static void process_json_stats_object(statsd_agg_t *agg, json_object *sobj) {
+  syslog(LOG_INFO, "Processing stat %s", json_object_to_json_string(sobj));
+
+  json_object *timer_obj = json_object_object_get(sobj, "timer");
+  json_object *counter_obj = json_object_object_get(sobj, "counter");
+
+  if (timer_obj && counter_obj) {
+    syslog(LOG_ERR, "Can't specify both timer and counter in same object");
+    return;
+  }
+
+  if (timer_obj) {
+    json_object *value_obj = json_object_object_get(sobj, "value");
+
+    if (!timer_obj || !value_obj) {
+      syslog(LOG_ERR, "Could not process, requires timer && value attributes");
+      return;
+    }
+
+    char *key_name = (char *) json_object_get_string(timer_obj);
+    int prefix_len = sanitize_key_prefix(key_name, keys_prefix_depth());
+    statsd_key_t *key = key_intern(key_name, strlen(key_name), prefix_len);
+    double value = json_object_get_double(value_obj);
+
+    if (key) agg_timer(agg, key, value);
+  } else if (counter_obj) {
+    json_object *value_obj = json_object_object_get(sobj, "value");
+    json_object *sample_rate_obj = json_object_object_get(sobj, "sample_rate");
+
+    if (!counter_obj || !value_obj) {
+      syslog(LOG_ERR, "Could not process, requires counter && value attributes");
+      return;
+    }
+
+    char *key_name = (char *) json_object_get_string(counter_obj);
+    int prefix_len = sanitize_key_prefix(key_name, keys_prefix_depth());
+    statsd_key_t *key = key_intern(key_name, strlen(key_name), prefix_len);
+    double value = json_object_get_double(value_obj);
+    double sample_rate = sample_rate_obj ? json_object_get_double(sample_rate_obj) : 0;
+
+    if (key) agg_counter(agg, key, value, sample_rate);
+  }
+}
+
+static void process_stats_line(statsd_agg_t *agg, char *buf_in, int len, const uint64_t *delims, int base) {
+  statsd_line_t line;
+  statsd_key_t *key;
+  int i, depth, prefix_len;
+
+  if (statsd_parse_line(buf_in, len, delims, base, &line) < 0 || line.key.len >= STATSD_KEY_MAX) {
+    if (debug) syslog(LOG_DEBUG, "Bad line '%.*s'", len, buf_in);
+    atomic_fetch_add_explicit(&bad_lines_seen, 1, memory_order_relaxed);
+    return;
+  }
+  /* A new key over the key limits, with no overflow key; keys.c counts it */
+  depth = keys_prefix_depth();
+  prefix_len = line.num_dots >= depth ? line.dots[depth - 1] : line.key.len;
+  if ((key = key_intern(line.key.ptr, line.key.len, prefix_len)) == NULL) {
+    return;
+  }
+
+  if (line.num_values == 0) {
+    /* No value, assign "1" and process */
+    agg_counter(agg, key, 1.0, 1);
+  }
+
+  for (i = 0; i < line.num_values; i++) {
+    statsd_value_t *v = &line.values[i];
+    double value = v->value;
+
+    switch (v->type) {
+      case STATSD_TIMER:
+        agg_timer( agg, key, value );
+        break;
+      case STATSD_GAUGE:
+        /* 0 - value; 1 - subtract; 2 - add */
+        agg_gauge( agg, key, value, v->sign < 0 ? 1 : ( v->sign > 0 ? 2 : 0 ) );
+        break;
+      case STATSD_SET:
+        agg_set( agg, key, v->member.ptr, v->member.len );
+        break;
+      case STATSD_COUNTER:
+      default:
+        agg_counter( agg, key, value, v->sample_rate );
+        break;
+    }
+  }
+}
+
+/**
+ * Clients may batch several metrics into one datagram, one per line, so
+ * split the packet on newlines and parse each line where it sits. The
+ * delimiter bitmap is built once per packet and shared with the parser.
+ * end is the datagram length the receive path already has, and
+ * buf_in[end] must be writable.
+ */
+void process_stats_packet(statsd_agg_t *agg, char buf_in[], int end) {
+  uint64_t delims[ SCAN_WORDS(BUFLEN) ];
+  int line = 0, eol;
+
+  last_msg_seen = time(NULL);
+  statsd_scan(buf_in, end, delims);
+  while (line < end) {
+    int len;
+
+    for (eol = scan_next(delims, line, end); eol < end && buf_in[eol] != '\n'; eol = scan_next(delims, eol + 1, end)) { }
+    len = eol - line;
+    if (len > 0 && buf_in[eol - 1] == '\r') len--;
+    if (len > 1) {
+      process_stats_line(agg, buf_in + line, len, delims, line);
+    }
+    line = eol + 1;
+  }
+}
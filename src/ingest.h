@@ -0,0 +1,27 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdatomic.h>
+
+#include "aggregate.h"
+
+#ifndef __INGEST_H__
+#define __INGEST_H__ 1
+
+/* When the last packet came in, and how many lines could not be parsed */
+extern long last_msg_seen;
+extern atomic_long bad_lines_seen;
+
+/*
+ * Parse a datagram in place into a worker's aggregation map. The JSON
+ * form needs buf_in NULL terminated; the plain one is given its length.
+ */
+void process_stats_packet(statsd_agg_t *agg, char buf_in[], int end);
+void process_json_stats_packet(statsd_agg_t *agg, char buf_in[]);
+
+#endif /* __INGEST_H__ */
@@ -0,0 +1,364 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "arena.h"
+#include "keys.h"
+
+#define KEYS_INITIAL_SLOTS 4096
+
+/*
+ * Open addressing table of interned keys, probed linearly. Lookups do not
+ * take a lock; inserts and growth happen under keys_lock. A grown table
+ * replaces the old one, which is kept around (not freed) since readers
+ * may still be probing it; a miss there just falls through to the locked
+ * path, which always sees the current table.
+ */
+typedef struct key_table {
+  uint32_t mask;
+  struct key_table *previous;
+  _Atomic(statsd_key_t *) slots[];
+} key_table_t;
+
+/*
+ * Key count and rejections per prefix, in a fixed open addressing table
+ * allocated when limits are set. Slots are claimed under keys_lock and
+ * never given back; hash is published last, so a reader that sees it
+ * also sees len and name. Slot KEYS_PREFIX_SLOTS is the shared "other".
+ */
+typedef struct {
+  atomic_uint hash;         /* 0 while the slot is free */
+  atomic_uint keys;
+  atomic_long rejected;
+  int len;
+  char name[KEYS_PREFIX_MAX];
+} key_prefix_t;
+
+enum { KEY_ACCEPT = 0, KEY_OVER_MAX_KEYS, KEY_OVER_PREFIX, KEY_NO_MEMORY };
+
+sem_t keys_lock;
+static _Atomic(key_table_t *) keys_table = NULL;
+static statsd_idtable_t keys_by_id;
+static atomic_uint keys_next_id = 0;
+static statsd_arena_t keys_arena;
+
+static statsd_key_limits_t key_limits;
+static key_prefix_t *key_prefixes = NULL;
+static atomic_long rejected_max_keys = 0, rejected_prefix = 0, rejected_other = 0, overflowed = 0;
+static atomic_long rejected_memory = 0;
+
+static key_table_t *key_table_new(uint32_t size) {
+  key_table_t *t = calloc(1, sizeof(key_table_t) + size * sizeof(statsd_key_t *));
+  t->mask = size - 1;
+  return t;
+}
+
+void keys_init() {
+  sem_init(&keys_lock, 0, 1);
+  arena_init(&keys_arena);
+  atomic_store(&keys_table, key_table_new(KEYS_INITIAL_SLOTS));
+}
+
+/**
+ * FNV-1a, computed once per key as it is interned.
+ */
+uint32_t key_hash(const char *name, int len) {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static statsd_key_t *key_probe(key_table_t *t, const char *name, int len, uint32_t hash, uint32_t *slot) {
+  uint32_t i = hash & t->mask;
+  statsd_key_t *k;
+
+  while ((k = atomic_load_explicit(&t->slots[i], memory_order_acquire)) != NULL) {
+    if (k->hash == hash && k->len == (uint32_t) len && memcmp(k->name, name, len) == 0) {
+      return k;
+    }
+    i = (i + 1) & t->mask;
+  }
+  if (slot) *slot = i;
+  return NULL;
+}
+
+/* Double the table once it is half full; called with keys_lock held */
+static key_table_t *key_table_grow(key_table_t *old) {
+  key_table_t *t = key_table_new((old->mask + 1) * 2);
+  uint32_t i, slot;
+
+  for (i = 0; i <= old->mask; i++) {
+    statsd_key_t *k = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+    if (k) {
+      key_probe(t, k->name, k->len, k->hash, &slot);
+      atomic_store_explicit(&t->slots[slot], k, memory_order_relaxed);
+    }
+  }
+  t->previous = old;
+  atomic_store_explicit(&keys_table, t, memory_order_release);
+  syslog(LOG_INFO, "Key table grown to %u slots", t->mask + 1);
+  return t;
+}
+
+/**
+ * Find the slot for the prefix, the first plen bytes of a key. Without
+ * create, a prefix not seen yet gives NULL; with create (under
+ * keys_lock) it claims a free slot, or falls back on the shared one
+ * when none is free within a few probes.
+ */
+static key_prefix_t *key_prefix(const char *name, int plen, int create) {
+  uint32_t hash, i, n;
+  key_prefix_t *p;
+
+  hash = key_hash(name, plen) | 1;
+
+  for (i = hash & ( KEYS_PREFIX_SLOTS - 1 ), n = 0; n < KEYS_PREFIX_PROBES; i = ( i + 1 ) & ( KEYS_PREFIX_SLOTS - 1 ), n++) {
+    uint32_t h;
+    p = &key_prefixes[i];
+    h = atomic_load_explicit(&p->hash, memory_order_acquire);
+    if (h == hash && p->len == plen
+        && memcmp(p->name, name, plen < KEYS_PREFIX_MAX ? plen : KEYS_PREFIX_MAX - 1) == 0) {
+      return p;
+    }
+    if (h == 0) {
+      if (!create) return NULL;
+      p->len = plen;
+      memcpy(p->name, name, plen < KEYS_PREFIX_MAX ? plen : KEYS_PREFIX_MAX - 1);
+      atomic_store_explicit(&p->hash, hash, memory_order_release);
+      return p;
+    }
+  }
+  return &key_prefixes[KEYS_PREFIX_SLOTS];
+}
+
+/*
+ * The shared slot lumps together prefixes that did not get one of their
+ * own, so only the total cap applies to it.
+ */
+static int key_over_limit(key_prefix_t *p) {
+  if (key_limits.max_keys && keys_count() >= key_limits.max_keys) {
+    return KEY_OVER_MAX_KEYS;
+  }
+  if (p && p != &key_prefixes[KEYS_PREFIX_SLOTS] && key_limits.max_per_prefix
+      && atomic_load_explicit(&p->keys, memory_order_relaxed) >= key_limits.max_per_prefix) {
+    return KEY_OVER_PREFIX;
+  }
+  return KEY_ACCEPT;
+}
+
+/* Count a rejected key against its prefix and hand out the overflow key */
+static statsd_key_t *key_reject(key_prefix_t *p, int reason) {
+  /* Not a limit: the key is dropped, not folded, whatever the prefix */
+  if (reason == KEY_NO_MEMORY) {
+    if (atomic_fetch_add_explicit(&rejected_memory, 1, memory_order_relaxed) == 0) {
+      syslog(LOG_ERR, "Out of memory interning keys, dropping new keys");
+    }
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&p->rejected, 1, memory_order_relaxed);
+  if (p == &key_prefixes[KEYS_PREFIX_SLOTS]) {
+    atomic_fetch_add_explicit(&rejected_other, 1, memory_order_relaxed);
+  }
+  if (atomic_fetch_add_explicit(reason == KEY_OVER_MAX_KEYS ? &rejected_max_keys : &rejected_prefix,
+      1, memory_order_relaxed) == 0) {
+    syslog(LOG_WARNING, "%s reached (first under '%s'), %s new keys",
+      reason == KEY_OVER_MAX_KEYS ? "Key limit" : "Per prefix key limit", p->name,
+      key_limits.overflow ? "folding" : "dropping");
+  }
+  if (key_limits.overflow) {
+    atomic_fetch_add_explicit(&overflowed, 1, memory_order_relaxed);
+  }
+  return key_limits.overflow;
+}
+
+/**
+ * Return the interned key for name, creating it on first sight. This is
+ * the only place a key string is hashed. prefix_len is how much of name
+ * is its prefix for the per prefix cap, or -1 to split it on underscores,
+ * for keys whose dots are gone already. Returns NULL if the key is too
+ * long, the id space is exhausted or there is no memory for it, and the
+ * overflow key (or NULL) for a new key over a limit.
+ */
+statsd_key_t *key_intern(const char *name, int len, int prefix_len) {
+  uint32_t hash, slot, id;
+  key_table_t *t;
+  key_prefix_t *p = NULL;
+  statsd_key_t *k;
+  int reason;
+
+  if (len >= STATSD_KEY_MAX) return NULL;
+
+  hash = key_hash(name, len);
+  t = atomic_load_explicit(&keys_table, memory_order_acquire);
+  if ((k = key_probe(t, name, len, hash, NULL)) != NULL) {
+    return k;
+  }
+
+  /*
+   * New keys past the total cap, or of a known prefix past its cap, are
+   * turned away without a lock or allocation. Past the total cap an
+   * unknown prefix is not worth a slot and counts as "other".
+   */
+  if (key_prefixes) {
+    if (prefix_len < 0 || prefix_len > len) {
+      int dots = 0;
+      for (prefix_len = 0; prefix_len < len; prefix_len++) {
+        if (name[prefix_len] == '_' && ++dots == key_limits.prefix_depth) break;
+      }
+    }
+    p = key_prefix(name, prefix_len, 0);
+    if ((reason = key_over_limit(p)) != KEY_ACCEPT) {
+      return key_reject(p ? p : &key_prefixes[KEYS_PREFIX_SLOTS], reason);
+    }
+  }
+
+  sem_wait(&keys_lock);
+  t = atomic_load_explicit(&keys_table, memory_order_acquire);
+  if ((k = key_probe(t, name, len, hash, &slot)) == NULL) {
+    id = atomic_load_explicit(&keys_next_id, memory_order_relaxed);
+    if (key_prefixes) {
+      p = key_prefix(name, prefix_len, 1);
+      if ((reason = key_over_limit(p)) != KEY_ACCEPT) {
+        sem_post(&keys_lock);
+        return key_reject(p, reason);
+      }
+    }
+    if (id < IDTABLE_MAX_IDS) {
+      /* Never reset: keys live as long as the process */
+      if ((k = arena_alloc(&keys_arena, sizeof(statsd_key_t) + len + 1)) == NULL) {
+        sem_post(&keys_lock);
+        return key_reject(p, KEY_NO_MEMORY);
+      }
+      if (p) atomic_fetch_add_explicit(&p->keys, 1, memory_order_relaxed);
+      k->hash = hash;
+      k->id = id;
+      k->len = len;
+      memcpy(k->name, name, len);
+      k->name[len] = '\0';
+
+      idtable_set(&keys_by_id, id, k);
+      atomic_store_explicit(&keys_next_id, id + 1, memory_order_relaxed);
+      atomic_store_explicit(&t->slots[slot], k, memory_order_release);
+      if ((id + 1) * 2 > t->mask + 1) {
+        key_table_grow(t);
+      }
+    } else {
+      syslog(LOG_ERR, "Key table full, dropping key %.*s", len, name);
+    }
+  }
+  sem_post(&keys_lock);
+  return k;
+}
+
+statsd_key_t *key_by_id(uint32_t id) {
+  return idtable_get(&keys_by_id, id);
+}
+
+uint32_t keys_count() {
+  return atomic_load_explicit(&keys_next_id, memory_order_relaxed);
+}
+
+/* Bytes of key arena in use, and reserved from the system */
+size_t keys_bytes(size_t *reserved) {
+  size_t used;
+
+  sem_wait(&keys_lock);
+  used = keys_arena.used;
+  *reserved = keys_arena.reserved;
+  sem_post(&keys_lock);
+  return used;
+}
+
+/**
+ * Cap the number of keys, in total and per prefix, from here on. The
+ * overflow key, if any, is interned first and is exempt. Returns 0 if
+ * the overflow key is not a valid key.
+ */
+int keys_limit(uint32_t max_keys, uint32_t max_per_prefix, int prefix_depth, const char *overflow) {
+  if (overflow && (key_limits.overflow = key_intern(overflow, strlen(overflow), -1)) == NULL) {
+    return 0;
+  }
+  key_limits.max_keys = max_keys;
+  key_limits.max_per_prefix = max_per_prefix;
+  key_limits.prefix_depth = prefix_depth > 0 ? prefix_depth : 1;
+  if (max_keys || max_per_prefix) {
+    key_prefixes = calloc(KEYS_PREFIX_SLOTS + 1, sizeof(key_prefix_t));
+    strcpy(key_prefixes[KEYS_PREFIX_SLOTS].name, "(other)");
+  }
+  return 1;
+}
+
+/* Dotted components in a prefix, as set by keys_limit() */
+int keys_prefix_depth() {
+  return key_limits.prefix_depth > 0 ? key_limits.prefix_depth : 1;
+}
+
+void keys_rejects(statsd_key_rejects_t *r) {
+  r->keys = keys_count();
+  r->rejected_max_keys = atomic_load_explicit(&rejected_max_keys, memory_order_relaxed);
+  r->rejected_prefix = atomic_load_explicit(&rejected_prefix, memory_order_relaxed);
+  r->rejected_other = atomic_load_explicit(&rejected_other, memory_order_relaxed);
+  r->overflowed = atomic_load_explicit(&overflowed, memory_order_relaxed);
+  r->rejected_memory = atomic_load_explicit(&rejected_memory, memory_order_relaxed);
+}
+
+/**
+ * Fill top with up to n prefixes that had the most keys rejected, most
+ * first. Returns how many there are.
+ */
+int keys_top_prefixes(statsd_key_prefix_t *top, int n) {
+  int found = 0, i, j;
+
+  if (key_prefixes == NULL) return 0;
+  for (i = 0; i <= KEYS_PREFIX_SLOTS; i++) {
+    key_prefix_t *p = &key_prefixes[i];
+    long rejected = atomic_load_explicit(&p->rejected, memory_order_relaxed);
+
+    if (rejected == 0 || ( found == n && rejected <= top[n - 1].rejected )) continue;
+    /* Insertion into the short sorted list */
+    for (j = found < n ? found++ : n - 1; j > 0 && top[j - 1].rejected < rejected; j--) {
+      top[j] = top[j - 1];
+    }
+    memcpy(top[j].name, p->name, KEYS_PREFIX_MAX);
+    top[j].keys = atomic_load_explicit(&p->keys, memory_order_relaxed);
+    top[j].rejected = rejected;
+  }
+  return found;
+}
+
+/**
+ * Store ptr at id, allocating the chunk that covers it if need be. The
+ * caller holds the lock that guards the entry at id; setters of other
+ * ids may run concurrently, so chunk allocation and size are raced for
+ * with compare-and-swap.
+ */
+void idtable_set(statsd_idtable_t *t, uint32_t id, void *ptr) {
+  _Atomic(statsd_idslot_t *) *chunkp = &t->chunks[id >> IDTABLE_CHUNK_BITS];
+  statsd_idslot_t *chunk = atomic_load_explicit(chunkp, memory_order_acquire);
+  unsigned int size;
+
+  if (chunk == NULL) {
+    statsd_idslot_t *fresh = calloc(IDTABLE_CHUNK_SIZE, sizeof(statsd_idslot_t));
+    if (atomic_compare_exchange_strong_explicit(chunkp, &chunk, fresh, memory_order_acq_rel, memory_order_acquire)) {
+      chunk = fresh;
+    } else {
+      free(fresh);
+    }
+  }
+  atomic_store_explicit(&chunk[id & (IDTABLE_CHUNK_SIZE - 1)], ptr, memory_order_release);
+
+  size = atomic_load_explicit(&t->size, memory_order_relaxed);
+  while (id >= size && !atomic_compare_exchange_weak_explicit(&t->size, &size, id + 1, memory_order_release, memory_order_relaxed)) { }
+}
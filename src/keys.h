@@ -0,0 +1,116 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifndef __KEYS_H__
+#define __KEYS_H__ 1
+
+/* Longest key accepted, including the terminating NULL */
+#define STATSD_KEY_MAX 1024
+
+/* Id tables grow in chunks that are never moved once allocated */
+#define IDTABLE_CHUNK_BITS 12
+#define IDTABLE_CHUNK_SIZE ( 1 << IDTABLE_CHUNK_BITS )
+#define IDTABLE_MAX_CHUNKS 1024
+#define IDTABLE_MAX_IDS ( IDTABLE_CHUNK_SIZE * IDTABLE_MAX_CHUNKS )
+
+/* Prefixes counted for key limits; any beyond share one "other" slot */
+#define KEYS_PREFIX_SLOTS 4096
+
+/* Slots probed for a prefix before it is counted as "other" */
+#define KEYS_PREFIX_PROBES 16
+
+/* Longest prefix name kept for reporting, including the terminating NULL */
+#define KEYS_PREFIX_MAX 64
+
+/*
+ * An interned key. Every distinct metric name is hashed once, when it
+ * is first seen, and keeps that hash and a small dense id for good.
+ * Keys are packed back to back in the key arena, each taking only its
+ * length (plus the NULL) after the header.
+ */
+typedef struct {
+  uint32_t hash;
+  uint32_t id;
+  uint32_t len;
+  char name[];
+} statsd_key_t;
+
+/*
+ * Sparse array indexed by key id. Readers need no lock: chunks are only
+ * ever added, and size is published after the slot it covers. Writers
+ * of the same id serialize with whatever lock guards that entry.
+ */
+typedef _Atomic(void *) statsd_idslot_t;
+
+typedef struct {
+  _Atomic(statsd_idslot_t *) chunks[IDTABLE_MAX_CHUNKS];
+  atomic_uint size;
+} statsd_idtable_t;
+
+static inline void *idtable_get(statsd_idtable_t *t, uint32_t id) {
+  statsd_idslot_t *chunk;
+  if (id >= atomic_load_explicit(&t->size, memory_order_acquire)) return NULL;
+  chunk = atomic_load_explicit(&t->chunks[id >> IDTABLE_CHUNK_BITS], memory_order_acquire);
+  return chunk ? atomic_load_explicit(&chunk[id & (IDTABLE_CHUNK_SIZE - 1)], memory_order_acquire) : NULL;
+}
+
+/* Walk every occupied slot; ptr is set to the entry for id */
+#define IDTABLE_ITER(t, id, ptr) \
+  for ((id) = 0; (id) < atomic_load_explicit(&(t)->size, memory_order_acquire); (id)++) \
+    if (((ptr) = idtable_get((t), (id))) != NULL)
+
+void idtable_set(statsd_idtable_t *t, uint32_t id, void *ptr);
+
+/*
+ * Caps on new keys. A prefix is the first prefix_depth dotted components
+ * of a key. A new key over either cap is not interned: key_intern()
+ * hands back the overflow key instead, or NULL when there is none.
+ * Prefixes beyond the KEYS_PREFIX_SLOTS counted share one "other"
+ * prefix, which only max_keys applies to.
+ */
+typedef struct {
+  uint32_t max_keys;        /* 0 for no cap */
+  uint32_t max_per_prefix;  /* 0 for no cap */
+  int prefix_depth;
+  statsd_key_t *overflow;
+} statsd_key_limits_t;
+
+typedef struct {
+  long keys;
+  long rejected_max_keys;   /* new keys past max_keys */
+  long rejected_prefix;     /* new keys past max_per_prefix */
+  long rejected_other;      /* of all those, ones under the shared "other" prefix */
+  long overflowed;          /* of those, folded into the overflow key */
+  long rejected_memory;     /* new keys dropped for want of memory */
+} statsd_key_rejects_t;
+
+/* A prefix as reported by keys_top_prefixes() */
+typedef struct {
+  char name[KEYS_PREFIX_MAX];
+  long keys;
+  long rejected;
+} statsd_key_prefix_t;
+
+extern sem_t keys_lock;
+
+void keys_init();
+uint32_t key_hash(const char *name, int len);
+statsd_key_t *key_intern(const char *name, int len, int prefix_len);
+statsd_key_t *key_by_id(uint32_t id);
+uint32_t keys_count();
+size_t keys_bytes(size_t *reserved);
+int keys_limit(uint32_t max_keys, uint32_t max_per_prefix, int prefix_depth, const char *overflow);
+int keys_prefix_depth();
+void keys_rejects(statsd_key_rejects_t *r);
+int keys_top_prefixes(statsd_key_prefix_t *top, int n);
+
+#endif /* __KEYS_H__ */
@@ -0,0 +1,59 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <pthread.h>
+
+#include "aggregate.h"
+#include "pool.h"
+#include "queue.h"
+
+#ifndef __LISTENERS_H__
+#define __LISTENERS_H__ 1
+
+/* Default number of UDP listener threads */
+#define NUM_LISTENERS 1
+
+/* Packets a worker handles per hold of its aggregation lock */
+#define WORKER_BATCH 64
+
+/*
+ * Workers drain a queue and parse its packets. Listeners are assigned
+ * to workers round robin; a worker fed by more than one listener gets
+ * a multi-producer queue. Each worker aggregates into its own map.
+ * There are two: collect_aggregates() swaps active for the other one
+ * under agg_lock and merges the retired map once the lock is dropped.
+ */
+typedef struct {
+  int id;
+  int producers;
+  pthread_t thread;
+  statsd_queue_t queue;
+  pthread_mutex_t agg_lock;
+  statsd_agg_t agg[2];
+  statsd_agg_t *active;
+} statsd_worker_t;
+
+typedef struct {
+  int id;
+  int socket;
+  pthread_t thread_udp;
+  statsd_queue_t *queue;
+  statsd_pool_t pool;
+  long recv_calls;
+  long packets;
+  long queue_drops;
+  long pool_drops;
+  long kernel_drops;
+} statsd_listener_t;
+
+extern statsd_listener_t *listeners;
+extern int num_listeners;
+extern statsd_worker_t *workers;
+extern int num_workers;
+
+#endif /* __LISTENERS_H__ */
@@ -0,0 +1,18 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __MD5_H__
+#define __MD5_H__ 1
+
+/* RFC 1321 MD5, only here to place keys on carbon's hash ring */
+void md5_digest( const void *data, size_t len, uint8_t out[16] );
+
+#endif /* __MD5_H__ */
@@ -0,0 +1,186 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "scan.h"
+
+#define IS_DIGIT(c) ( (c) >= '0' && (c) <= '9' )
+#define IS_KEY_CHAR(c) ( ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || IS_DIGIT(c) || (c) == '_' || (c) == '-' )
+
+/* Powers of ten that are exact doubles */
+static const double pow10_exact[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Longest decimal mantissa that always fits a double exactly */
+#define FAST_MAX_DIGITS 15
+
+/**
+ * Parse [+-]digits[.digits][(e|E)[+-]digits] from the len bytes at p,
+ * independent of the current locale. Integers and short decimals are
+ * converted directly: with at most 15 significant digits both the
+ * mantissa and the power of ten are exact doubles, so one division is
+ * correctly rounded. Exponents and longer mantissas go through strtod()
+ * (the daemon never calls setlocale(), so it stays in the "C" locale).
+ * Returns 0, or -1 if anything but a complete number is present.
+ */
+int statsd_parse_number(const char *p, int len, double *out) {
+  const char *end = p + len, *start = p;
+  uint64_t mantissa = 0;
+  int negative = 0, digits = 0, frac_digits = 0, significant = 0;
+  char buf[128];
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  for (; p < end && IS_DIGIT(*p); p++, digits++) {
+    if (significant || *p != '0') {
+      mantissa = mantissa * 10 + (*p - '0');
+      significant++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && IS_DIGIT(*p); p++, digits++, frac_digits++) {
+      if (significant || *p != '0') {
+        mantissa = mantissa * 10 + (*p - '0');
+        significant++;
+      }
+    }
+  }
+  if (digits == 0) return -1;
+
+  if (p == end && significant <= FAST_MAX_DIGITS && frac_digits <= 22) {
+    *out = frac_digits ? (double) mantissa / pow10_exact[frac_digits] : (double) mantissa;
+    if (negative) *out = -*out;
+    return 0;
+  }
+
+  /* Slow path: validate the exponent, then let strtod() round */
+  if (p < end) {
+    if (*p != 'e' && *p != 'E') return -1;
+    p++;
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end || !IS_DIGIT(*p)) return -1;
+    while (p < end && IS_DIGIT(*p)) p++;
+    if (p != end) return -1;
+  }
+  if (len >= (int) sizeof(buf)) return -1;
+  memcpy(buf, start, len);
+  buf[len] = '\0';
+  *out = strtod(buf, NULL);
+  return 0;
+}
+
+/* Next delimiter at or after p, from the packet's delimiter bitmap */
+#define NEXT_DELIM(p) ( line + scan_next(delims, base + (int) ((p) - line), base + len) - base )
+
+/**
+ * Parse "key:value|type|@rate[:value|type|@rate...]" in a single pass.
+ *
+ * delims is the statsd_scan() bitmap of the packet that line sits in, at
+ * offset base, so field boundaries are found a word at a time rather than
+ * byte by byte. The key is sanitized in place (with the same rules as
+ * sanitize_key()) and NULL terminated, so out->key points straight into
+ * line; line[len] must be writable. Where the first few dots were, before
+ * they became underscores, is kept in out->dots for the key prefix
+ * limits. Values that are not plain numbers make the whole line
+ * malformed, except those of sets, which are taken as they are. Returns
+ * the number of values found, which is 0 for a bare key, or -1 for a
+ * malformed line.
+ */
+int statsd_parse_line(char *line, int len, const uint64_t *delims, int base, statsd_line_t *out) {
+  char *p, *q, *end = line + len, *w, *value;
+  int value_len;
+
+  /* Key, up to the first ':' */
+  for (p = NEXT_DELIM(line); p < end && *p != ':'; p = NEXT_DELIM(p + 1)) { }
+  out->key.ptr = w = line;
+  out->num_dots = 0;
+  for (q = line; q < p; q++) {
+    if (*q == '.') {
+      if (out->num_dots < STATSD_KEY_DEPTH_MAX) out->dots[out->num_dots++] = w - line;
+      *w++ = '_';
+    } else if (*q == '\\' || *q == '/') {
+      *w++ = '-';
+    } else if (IS_KEY_CHAR(*q)) {
+      *w++ = *q;
+    }
+  }
+  out->key.len = w - out->key.ptr;
+  if (out->key.len == 0) return -1;
+  *w = '\0';
+  out->num_values = 0;
+
+  while (p < end) {
+    /* Either the key or the previous value ended on a ':' */
+    char *field = ++p;
+    statsd_value_t *v;
+
+    if (out->num_values == STATSD_MAX_VALUES) return -1;
+    v = &out->values[ out->num_values ];
+    v->type = STATSD_COUNTER;
+    v->sign = 0;
+    v->sample_rate = 1.0;
+
+    /* Value, checked once the type is known */
+    p = NEXT_DELIM(field);
+    if (p < end && *p == '@') return -1;
+    value = field;
+    value_len = p - field;
+
+    /* Type */
+    if (p < end && *p == '|') {
+      char *type = ++p;
+      p = NEXT_DELIM(type);
+      if (p - type == 1 && *type == 'c') {
+        v->type = STATSD_COUNTER;
+      } else if (p - type == 2 && type[0] == 'm' && type[1] == 's') {
+        v->type = STATSD_TIMER;
+      } else if (p - type == 1 && *type == 'g') {
+        v->type = STATSD_GAUGE;
+      } else if (p - type == 1 && *type == 's') {
+        v->type = STATSD_SET;
+      } else {
+        return -1;
+      }
+      if (p < end && *p == '@') return -1;
+
+      /* Sample rate */
+      if (p < end && *p == '|') {
+        char *rate = ++p;
+        for (p = NEXT_DELIM(rate); p < end && *p != ':'; p = NEXT_DELIM(p + 1)) { }
+        if (*rate != '@' || statsd_parse_number(rate + 1, p - rate - 1, &v->sample_rate) < 0) return -1;
+        if (!(v->sample_rate > 0)) return -1;
+      }
+    }
+
+    if (v->type == STATSD_SET) {
+      if (value_len == 0) return -1;
+      v->member.ptr = value;
+      v->member.len = value_len;
+      out->num_values++;
+      continue;
+    }
+
+    /* A leading sign makes a gauge relative */
+    if (value_len > 0 && (*value == '+' || (*value == '-' && v->type == STATSD_GAUGE))) {
+      if (v->type == STATSD_GAUGE) v->sign = *value == '+' ? 1 : -1;
+      value++;
+      value_len--;
+    }
+    if (statsd_parse_number(value, value_len, &v->value) < 0) return -1;
+    out->num_values++;
+  }
+
+  return out->num_values;
+}
@@ -0,0 +1,52 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+
+#ifndef __PARSER_H__
+#define __PARSER_H__ 1
+
+/* Most values accepted for one key ("key:1|c:2|c:...") */
+#define STATSD_MAX_VALUES 16
+
+/* Leading dots of a key whose place is kept, the deepest prefix capped */
+#define STATSD_KEY_DEPTH_MAX 8
+
+typedef enum {
+  STATSD_COUNTER = 0,
+  STATSD_TIMER,
+  STATSD_GAUGE,
+  STATSD_SET
+} statsd_metric_type_t;
+
+/* Points into the packet buffer, NULL terminated */
+typedef struct {
+  char *ptr;
+  int len;
+} statsd_view_t;
+
+typedef struct {
+  double value;
+  statsd_metric_type_t type;
+  int sign;            /* gauges only: -1 subtract, 1 add, 0 set */
+  double sample_rate;
+  statsd_view_t member; /* sets only: the value as sent, not terminated */
+} statsd_value_t;
+
+typedef struct {
+  statsd_view_t key;
+  int num_dots;
+  int dots[STATSD_KEY_DEPTH_MAX]; /* where the key's first dots were, now '_' */
+  int num_values;
+  statsd_value_t values[STATSD_MAX_VALUES];
+} statsd_line_t;
+
+int statsd_parse_number(const char *p, int len, double *out);
+int statsd_parse_line(char *line, int len, const uint64_t *delims, int base, statsd_line_t *out);
+
+#endif /* __PARSER_H__ */
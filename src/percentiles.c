@@ -0,0 +1,183 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "percentiles.h"
+
+/* Ranges this short are finished off with an insertion sort */
+#define SELECT_SMALL 16
+
+static int percentile_sort( const void *a, const void *b ) {
+  double _a = ((const statsd_percentile_t *) a)->value;
+  double _b = ((const statsd_percentile_t *) b)->value;
+  if (_a == _b) return 0;
+  return (_a < _b) ? -1 : 1;
+}
+
+static int value_sort( const void *a, const void *b ) {
+  double _a = *(const double *) a;
+  double _b = *(const double *) b;
+  if (_a == _b) return 0;
+  return (_a < _b) ? -1 : 1;
+}
+
+/**
+ * Parse a csv list of percentile thresholds into out, in ascending
+ * order. Entries that are not a number in (0, 100] are skipped with a
+ * warning. Returns the number of thresholds kept.
+ */
+int percentiles_parse( const char *csv, statsd_percentile_t *out, int max ) {
+  char *copy = strdup(csv), *save = NULL, *tok, *end, *c;
+  int n = 0;
+
+  for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    double value = strtod(tok, &end);
+    if (end == tok || *end != '\0' || value <= 0 || value > 100 || strlen(tok) >= sizeof(out->name)) {
+      fprintf(stderr, "Ignoring bad percentile threshold '%s'\n", tok);
+      continue;
+    }
+    if (n == max) {
+      fprintf(stderr, "Too many percentile thresholds, ignoring '%s'\n", tok);
+      continue;
+    }
+    out[n].value = value;
+    strcpy(out[n].name, tok);
+    for (c = out[n].name; *c; c++) {
+      if (*c == '.') *c = '_';
+    }
+    snprintf(out[n].upper, sizeof(out[n].upper), "upper_%s", out[n].name);
+    n++;
+  }
+  free(copy);
+
+  qsort(out, n, sizeof(statsd_percentile_t), percentile_sort);
+  return n;
+}
+
+/**
+ * 1-based rank of the sample reported as upper_<pct>: the largest of the
+ * lowest pct% of count samples, rounded as statsd does.
+ */
+int percentile_rank( double pct, int count ) {
+  int rank = (int) ( pct / 100 * count + 0.5 );
+  if (rank < 1) rank = 1;
+  if (rank > count) rank = count;
+  return rank;
+}
+
+/**
+ * min, max, sum, mean and (population) standard deviation in a single
+ * pass, the latter two by Welford's method.
+ */
+void timer_summarize( const double *values, int count, statsd_timer_summary_t *out ) {
+  double mean = 0, m2 = 0;
+  int i;
+
+  memset(out, 0, sizeof(statsd_timer_summary_t));
+  if (count < 1) return;
+
+  out->min = out->max = values[0];
+  for (i = 0; i < count; i++) {
+    double v = values[i], delta = v - mean;
+    if (v < out->min) out->min = v;
+    if (v > out->max) out->max = v;
+    out->sum += v;
+    mean += delta / ( i + 1 );
+    m2 += delta * ( v - mean );
+  }
+  out->mean = mean;
+  out->stddev = sqrt(m2 / count);
+}
+
+static void insertion_sort( double *v, int lo, int hi ) {
+  int i, j;
+  for (i = lo + 1; i <= hi; i++) {
+    double x = v[i];
+    for (j = i - 1; j >= lo && v[j] > x; j--) {
+      v[j + 1] = v[j];
+    }
+    v[j + 1] = x;
+  }
+}
+
+static double median3( double a, double b, double c ) {
+  if (a < b) {
+    if (b < c) return b;
+    return a < c ? c : a;
+  }
+  if (a < c) return a;
+  return b < c ? c : b;
+}
+
+/*
+ * Partition v[lo..hi] around a pivot and only descend into the sides
+ * that still contain a wanted position (pos is ascending, all within
+ * lo..hi). With k positions that is O(n log k) rather than a full sort;
+ * past depth levels it gives up and sorts what is left, as introselect.
+ */
+static void select_positions( double *v, int lo, int hi, const int *pos, int num_pos, int depth ) {
+  while (num_pos > 0) {
+    double pivot;
+    int i, j, left;
+
+    if (hi - lo < SELECT_SMALL) {
+      insertion_sort(v, lo, hi);
+      return;
+    }
+    if (depth-- == 0) {
+      qsort(v + lo, hi - lo + 1, sizeof(double), value_sort);
+      return;
+    }
+
+    pivot = median3(v[lo], v[lo + ( hi - lo ) / 2], v[hi]);
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (v[i] < pivot) i++;
+      while (v[j] > pivot) j--;
+      if (i <= j) {
+        double t = v[i];
+        v[i++] = v[j];
+        v[j--] = t;
+      }
+    }
+
+    /* v[lo..j] <= pivot, v[j+1..i-1] == pivot, v[i..hi] >= pivot */
+    for (left = 0; left < num_pos && pos[left] <= j; left++) { }
+    select_positions(v, lo, j, pos, left, depth);
+    while (left < num_pos && pos[left] < i) left++;
+    pos += left;
+    num_pos -= left;
+    lo = i;
+  }
+}
+
+/**
+ * Store in out[n] the value of 1-based rank ranks[n] within values, as
+ * if values were sorted. ranks must be ascending. values is reordered.
+ */
+void select_ranks( double *values, int count, const int *ranks, int num_ranks, double *out ) {
+  int pos[num_ranks], depth = 0, i;
+
+  if (count < 1 || num_ranks < 1) return;
+
+  for (i = 0; i < num_ranks; i++) {
+    pos[i] = ranks[i] - 1;
+  }
+  for (i = count; i > 1; i >>= 1) {
+    depth += 2;
+  }
+  select_positions(values, 0, count - 1, pos, num_ranks, depth);
+  for (i = 0; i < num_ranks; i++) {
+    out[i] = values[ pos[i] ];
+  }
+}
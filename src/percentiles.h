@@ -0,0 +1,36 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#ifndef __PERCENTILES_H__
+#define __PERCENTILES_H__ 1
+
+/* Most thresholds accepted by -T */
+#define STATSD_MAX_PERCENTILES 16
+
+/* A -T threshold; name is the metric suffix, "99_9" for 99.9 */
+typedef struct {
+  double value;
+  char name[16];
+  char upper[24];       /* graphite suffix, "upper_99_9" */
+} statsd_percentile_t;
+
+/* Everything about a timer's samples that does not need them ordered */
+typedef struct {
+  double min;
+  double max;
+  double sum;
+  double mean;
+  double stddev;
+} statsd_timer_summary_t;
+
+int percentiles_parse( const char *csv, statsd_percentile_t *out, int max );
+int percentile_rank( double pct, int count );
+void timer_summarize( const double *values, int count, statsd_timer_summary_t *out );
+void select_ranks( double *values, int count, const int *ranks, int num_ranks, double *out );
+
+#endif /* __PERCENTILES_H__ */
@@ -0,0 +1,50 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "pool.h"
+
+void pool_init( statsd_pool_t *pool, int count, int buflen ) {
+  int i;
+
+  syslog(LOG_DEBUG, "pool_init (%d buffers of %d bytes)", count, buflen);
+  pool->count = count;
+  pool->buflen = buflen;
+  pool->packets = calloc(count, sizeof(statsd_packet_t));
+  /* Pages are only committed once the kernel writes into them */
+  pool->buffers = malloc((size_t) count * buflen);
+  queue_init(&pool->free, count, 1, 0);
+  for (i = 0; i < count; i++) {
+    pool->packets[i].data = pool->buffers + (size_t) i * buflen;
+    pool->packets[i].len = 0;
+    pool->packets[i].pool = pool;
+    queue_store(&pool->free, &pool->packets[i]);
+  }
+}
+
+void pool_destroy( statsd_pool_t *pool ) {
+  queue_destroy(&pool->free);
+  if (pool->buffers) free(pool->buffers);
+  if (pool->packets) free(pool->packets);
+  pool->buffers = NULL;
+  pool->packets = NULL;
+}
+
+/**
+ * Returns NULL when every buffer is in flight.
+ */
+statsd_packet_t *pool_acquire( statsd_pool_t *pool ) {
+  return (statsd_packet_t *) queue_pop_first(&pool->free);
+}
+
+void pool_release( statsd_packet_t *packet ) {
+  queue_store(&packet->pool->free, packet);
+}
@@ -0,0 +1,48 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "queue.h"
+
+#ifndef __POOL_H__
+#define __POOL_H__ 1
+
+/* Default number of receive buffers per listener */
+#define PACKET_POOL_SIZE 1024
+
+struct statsd_pool;
+
+/*
+ * A receive buffer. The listener reads a datagram straight into it, the
+ * buffer travels through the worker queue, is parsed in place and is
+ * then handed back to the pool it came from.
+ */
+typedef struct {
+  char *data;
+  int len;
+  struct statsd_pool *pool;
+} statsd_packet_t;
+
+/*
+ * Buffers are carved out of one allocation up front. Only the listener
+ * acquires and only its worker releases, so the free list is an SPSC
+ * queue running in the opposite direction of the packet queue.
+ */
+typedef struct statsd_pool {
+  statsd_packet_t *packets;
+  char *buffers;
+  int count;
+  int buflen;
+  statsd_queue_t free;
+} statsd_pool_t;
+
+void pool_init( statsd_pool_t *pool, int count, int buflen );
+void pool_destroy( statsd_pool_t *pool );
+statsd_packet_t *pool_acquire( statsd_pool_t *pool );
+void pool_release( statsd_packet_t *packet );
+
+#endif /* __POOL_H__ */
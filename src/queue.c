@@ -6,50 +6,230 @@
  *
  */
 
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "queue.h"
 
-int queue_store_pos = 0;
-int queue_retrieve_pos = 0;
-char *queue[MAX_QUEUE_SIZE];
-//pthread_mutex_t queue_mutex;
-
-void queue_init( ) {
-  syslog(LOG_DEBUG, "queue_init");
-  queue_store_pos = 0;
-  queue_retrieve_pos = 0;
-  //pthread_mutex_init(&queue_mutex, NULL);
-  int p;
-  for (p = 0; p < MAX_QUEUE_SIZE; p++ ) queue[ p ] = NULL;
-}
-
-int queue_store( char *ptr ) {
-  syslog(LOG_DEBUG, "queue_store ('%s')", ptr);
-  if (queue_store_pos == MAX_QUEUE_SIZE) {
-    syslog(LOG_INFO, "Queue has reached maximum size of %d, wrapping", MAX_QUEUE_SIZE);
-    queue_store_pos = 0;
-  }
-  //pthread_mutex_lock(&queue_mutex);
-  queue[ queue_store_pos ] = ptr;
-  queue_store_pos ++;
-  //pthread_mutex_unlock(&queue_mutex);
+#if defined(__x86_64__) || defined(__i386__)
+#define QUEUE_CPU_RELAX() __asm__ __volatile__("pause")
+#else
+#define QUEUE_CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/**
+ * Capacity is rounded up to a power of two.
+ */
+void queue_init( statsd_queue_t *q, unsigned long size, int producers, int spins ) {
+  unsigned long i;
+
+  for (i = 1; i < size; i <<= 1) { }
+  size = i;
+
+  syslog(LOG_DEBUG, "queue_init (%lu slots, %d producers)", size, producers);
+  q->producers = producers;
+  q->mask = size - 1;
+  q->slots = NULL;
+  q->cells = NULL;
+  if (producers > 1) {
+    q->cells = malloc(size * sizeof(statsd_queue_cell_t));
+    for (i = 0; i < size; i++) {
+      atomic_init(&q->cells[i].seq, i);
+      q->cells[i].data = NULL;
+    }
+  } else {
+    q->slots = calloc(size, sizeof(void *));
+  }
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->head, 0);
+  atomic_init(&q->dropped, 0);
+  q->head_cache = 0;
+  q->tail_cache = 0;
+  q->high_water = 0;
+
+  atomic_init(&q->waiting, 0);
+  q->spin_max = spins;
+  q->spin_budget = spins;
+  q->wakeups = 0;
+#ifdef HAVE_SYS_EVENTFD_H
+  q->wake_fd[0] = q->wake_fd[1] = eventfd(0, 0);
+#else
+  if (pipe(q->wake_fd) == -1) {
+    q->wake_fd[0] = q->wake_fd[1] = -1;
+  }
+#endif
+  if (q->wake_fd[0] == -1) {
+    syslog(LOG_ERR, "queue_init: could not create wakeup descriptor");
+  }
+}
+
+/**
+ * Releases the queue storage only, anything still queued belongs to
+ * the caller.
+ */
+void queue_destroy( statsd_queue_t *q ) {
+  if (q->slots) free(q->slots);
+  if (q->cells) free(q->cells);
+  q->slots = NULL;
+  q->cells = NULL;
+  if (q->wake_fd[0] != -1) close(q->wake_fd[0]);
+  if (q->wake_fd[1] != q->wake_fd[0]) close(q->wake_fd[1]);
+  q->wake_fd[0] = q->wake_fd[1] = -1;
+}
+
+static int queue_is_empty( statsd_queue_t *q ) {
+  unsigned long pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (q->producers > 1) {
+    return atomic_load_explicit(&q->cells[ pos & q->mask ].seq, memory_order_acquire) != pos + 1;
+  }
+  return atomic_load_explicit(&q->tail, memory_order_acquire) == pos;
+}
+
+/**
+ * Wake the consumer if it is blocked in queue_wait(). Producers call
+ * this once after storing a batch of packets.
+ */
+void queue_notify( statsd_queue_t *q ) {
+  /* Pairs with the fence in queue_wait(): either we see the consumer
+   * waiting, or it sees the packets we just stored. */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->waiting, memory_order_relaxed) == 0) return;
+  if (atomic_exchange_explicit(&q->waiting, 0, memory_order_acq_rel) == 0) return;
+
+  uint64_t one = 1;
+  if (write(q->wake_fd[1], &one, q->wake_fd[0] == q->wake_fd[1] ? sizeof(one) : 1) == -1 && errno != EAGAIN) {
+    syslog(LOG_ERR, "queue_notify: wakeup failed");
+  }
+}
+
+/**
+ * Called by the consumer once the queue is empty. Polls for a while
+ * (the budget grows when polling pays off and shrinks when it doesn't),
+ * then blocks until a producer calls queue_notify().
+ */
+void queue_wait( statsd_queue_t *q ) {
+  int i;
+
+  for (i = 0; i < q->spin_budget; i++) {
+    if (!queue_is_empty(q)) {
+      if (q->spin_budget < q->spin_max) q->spin_budget = q->spin_budget * 2 + 1;
+      if (q->spin_budget > q->spin_max) q->spin_budget = q->spin_max;
+      return;
+    }
+    QUEUE_CPU_RELAX();
+  }
+  q->spin_budget /= 2;
+
+  atomic_store_explicit(&q->waiting, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!queue_is_empty(q) || q->wake_fd[0] == -1) {
+    atomic_store_explicit(&q->waiting, 0, memory_order_relaxed);
+    return;
+  }
+
+  struct pollfd pfd;
+  pfd.fd = q->wake_fd[0];
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, -1) == -1 && errno == EINTR) { }
+
+  uint64_t count;
+  if (read(q->wake_fd[0], &count, q->wake_fd[0] == q->wake_fd[1] ? sizeof(count) : 1) == -1) {
+    syslog(LOG_ERR, "queue_wait: wakeup read failed");
+  }
+  q->wakeups++;
+}
+
+/**
+ * Store a pointer. Returns 0 without storing it when the queue is full,
+ * in which case the caller still owns it.
+ */
+int queue_store( statsd_queue_t *q, void *ptr ) {
+  unsigned long pos;
+
+  if (q->producers > 1) {
+    statsd_queue_cell_t *cell;
+    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+      cell = &q->cells[ pos & q->mask ];
+      long dif = (long) atomic_load_explicit(&cell->seq, memory_order_acquire) - (long) pos;
+      if (dif == 0) {
+        if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return 0;
+      } else {
+        pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+      }
+    }
+    cell->data = ptr;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+  }
+
+  pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if (pos - q->head_cache > q->mask) {
+    q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (pos - q->head_cache > q->mask) {
+      atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+      return 0;
+    }
+  }
+  q->slots[ pos & q->mask ] = ptr;
+  atomic_store_explicit(&q->tail, pos + 1, memory_order_release);
   return 1;
 }
 
-char *queue_pop_first( ) {
-  if (queue[ queue_retrieve_pos ] == NULL) return NULL;
-  //pthread_mutex_lock(&queue_mutex);
-  char *tmpptr = queue[ queue_retrieve_pos ];
-  queue[ queue_retrieve_pos ] = NULL;
-  queue_retrieve_pos ++;
-  if (queue_retrieve_pos == MAX_QUEUE_SIZE) {
-    queue_retrieve_pos = 0;
+void *queue_pop_first( statsd_queue_t *q ) {
+  unsigned long pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  void *tmpptr;
+
+  if (q->producers > 1) {
+    statsd_queue_cell_t *cell = &q->cells[ pos & q->mask ];
+    if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1) return NULL;
+    tmpptr = cell->data;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    atomic_store_explicit(&q->head, pos + 1, memory_order_release);
+
+    /* Sample the depth now and then, reading tail costs a shared line */
+    if ((pos & 63) == 0) {
+      unsigned long depth = atomic_load_explicit(&q->tail, memory_order_relaxed) - pos;
+      if (depth > q->high_water) q->high_water = depth;
+    }
+    return tmpptr;
+  }
+
+  if (pos == q->tail_cache) {
+    q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (pos == q->tail_cache) return NULL;
+    if (q->tail_cache - pos > q->high_water) q->high_water = q->tail_cache - pos;
   }
-  //pthread_mutex_unlock(&queue_mutex);
+  tmpptr = q->slots[ pos & q->mask ];
+  atomic_store_explicit(&q->head, pos + 1, memory_order_release);
   return tmpptr;
 }
 
+/**
+ * Counters are read without synchronizing with either side, so they
+ * are only approximate while packets are in flight.
+ */
+void queue_get_stats( statsd_queue_t *q, statsd_queue_stats_t *st ) {
+  st->dequeued = atomic_load_explicit(&q->head, memory_order_relaxed);
+  st->enqueued = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  st->dropped = atomic_load_explicit(&q->dropped, memory_order_relaxed);
+  st->high_water = q->high_water;
+  st->wakeups = q->wakeups;
+}
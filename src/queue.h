@@ -6,6 +6,8 @@
  *
  */
 
+#include <stdatomic.h>
+
 #include "counters.h"
 #include "stats.h"
 #include "timers.h"
@@ -13,11 +15,62 @@
 #ifndef __QUEUE_H
 #define __QUEUE_H 1
 
-#define MAX_QUEUE_SIZE ( 1024 * 1024 )
+#define QUEUE_CACHELINE 64
 
-void queue_init( );
-int queue_store( char *ptr );
-char *queue_pop_first( );
+/* Default number of polls an idle consumer makes before it blocks */
+#define QUEUE_SPIN_COUNT 2000
 
-#endif /* __QUEUE_H */
+/*
+ * Bounded lock-free pointer queue with a single consumer. With one
+ * producer it runs as a plain SPSC ring; with more it uses per-slot
+ * sequence numbers so that producers can claim slots with a CAS (MPSC).
+ * A full queue drops the new packet rather than overwriting old ones.
+ */
+
+typedef struct {
+  atomic_ulong seq;
+  void *data;
+} statsd_queue_cell_t;
+
+typedef struct {
+  unsigned long enqueued;
+  unsigned long dequeued;
+  unsigned long dropped;
+  unsigned long high_water;
+  unsigned long wakeups;
+} statsd_queue_stats_t;
+
+typedef struct {
+  int producers;
+  unsigned long mask;
+  void **slots;               /* SPSC storage */
+  statsd_queue_cell_t *cells; /* MPSC storage */
 
+  /* Producer side */
+  _Alignas(QUEUE_CACHELINE) atomic_ulong tail;
+  unsigned long head_cache;
+
+  /* Consumer side */
+  _Alignas(QUEUE_CACHELINE) atomic_ulong head;
+  unsigned long tail_cache;
+  unsigned long high_water;
+
+  _Alignas(QUEUE_CACHELINE) atomic_ulong dropped;
+
+  /* Wakeup of a blocked consumer */
+  _Alignas(QUEUE_CACHELINE) atomic_int waiting;
+  int wake_fd[2];
+  int spin_max;
+  int spin_budget;
+  unsigned long wakeups;
+} statsd_queue_t;
+
+void queue_init( statsd_queue_t *q, unsigned long size, int producers, int spins );
+void queue_destroy( statsd_queue_t *q );
+int queue_store( statsd_queue_t *q, void *ptr );
+void *queue_pop_first( statsd_queue_t *q );
+void queue_notify( statsd_queue_t *q );
+void queue_wait( statsd_queue_t *q );
+void queue_get_stats( statsd_queue_t *q, statsd_queue_stats_t *st );
+
+#endif /* __QUEUE_H */
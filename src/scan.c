@@ -0,0 +1,150 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+#ifdef HAVE_IMMINTRIN_H
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define SCAN_X86 1
+#endif
+
+#define IS_DELIM(c) ( (c) == '\n' || (c) == ':' || (c) == '|' || (c) == '@' )
+
+static void scan_scalar(const char *buf, int len, uint64_t *bitmap);
+
+void (*statsd_scan)(const char *buf, int len, uint64_t *bitmap) = scan_scalar;
+static const char *scan_name = "scalar";
+
+static void scan_scalar(const char *buf, int len, uint64_t *bitmap) {
+  int i;
+  memset(bitmap, 0, SCAN_WORDS(len) * sizeof(uint64_t));
+  for (i = 0; i < len; i++) {
+    if (IS_DELIM(buf[i])) {
+      bitmap[i >> 6] |= (uint64_t) 1 << (i & 63);
+    }
+  }
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Each kernel builds one bitmap word per 64 byte block. The last, short
+ * block is copied into a zeroed one rather than scanned a byte at a
+ * time, since most datagrams are shorter than a block; NUL is not a
+ * delimiter, so the padding sets no bits.
+ */
+
+__attribute__((target("sse2")))
+static inline uint64_t scan_block_sse2(const char *p) {
+  const __m128i nl = _mm_set1_epi8('\n'), colon = _mm_set1_epi8(':');
+  const __m128i pipe = _mm_set1_epi8('|'), at = _mm_set1_epi8('@');
+  uint64_t bits = 0;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (p + i * 16));
+    __m128i m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, colon)),
+      _mm_or_si128(_mm_cmpeq_epi8(v, pipe), _mm_cmpeq_epi8(v, at)) );
+    bits |= (uint64_t) (uint16_t) _mm_movemask_epi8(m) << (i * 16);
+  }
+  return bits;
+}
+
+__attribute__((target("sse2")))
+static void scan_sse2(const char *buf, int len, uint64_t *bitmap) {
+  int i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    bitmap[i >> 6] = scan_block_sse2(buf + i);
+  }
+  if (i < len) {
+    char block[64] = { 0 };
+    memcpy(block, buf + i, len - i);
+    bitmap[i >> 6] = scan_block_sse2(block);
+  }
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t scan_block_avx2(const char *p) {
+  const __m256i nl = _mm256_set1_epi8('\n'), colon = _mm256_set1_epi8(':');
+  const __m256i pipe = _mm256_set1_epi8('|'), at = _mm256_set1_epi8('@');
+  uint64_t bits = 0;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (p + i * 32));
+    __m256i m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, colon)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, pipe), _mm256_cmpeq_epi8(v, at)) );
+    bits |= (uint64_t) (uint32_t) _mm256_movemask_epi8(m) << (i * 32);
+  }
+  return bits;
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const char *buf, int len, uint64_t *bitmap) {
+  int i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    bitmap[i >> 6] = scan_block_avx2(buf + i);
+  }
+  if (i < len) {
+    char block[64] = { 0 };
+    memcpy(block, buf + i, len - i);
+    bitmap[i >> 6] = scan_block_avx2(block);
+  }
+}
+
+#endif /* SCAN_X86 */
+
+/**
+ * Use the named kernel ("avx2", "sse2" or "scalar") if it was built in
+ * and the running CPU supports it. Returns 0 if not, keeping the current
+ * one. Mostly for tests and benchmarks comparing the kernels.
+ */
+int scan_select( const char *name ) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    statsd_scan = scan_avx2;
+    scan_name = "avx2";
+    return 1;
+  }
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    statsd_scan = scan_sse2;
+    scan_name = "sse2";
+    return 1;
+  }
+#endif
+  if (strcmp(name, "scalar") == 0) {
+    statsd_scan = scan_scalar;
+    scan_name = "scalar";
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Pick the widest kernel the running CPU supports.
+ */
+void scan_init() {
+  if (!scan_select("avx2") && !scan_select("sse2")) {
+    scan_select("scalar");
+  }
+}
+
+const char *scan_kernel_name() {
+  return scan_name;
+}
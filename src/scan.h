@@ -0,0 +1,43 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+
+#ifndef __SCAN_H__
+#define __SCAN_H__ 1
+
+/* Number of bitmap words needed to cover len bytes */
+#define SCAN_WORDS(len) ( ((len) + 63) / 64 )
+
+/*
+ * Delimiter scanner: sets bit i of bitmap when buf[i] is one of
+ * '\n', ':', '|' or '@'. Bits past len are left clear. Points at the
+ * fastest kernel the CPU supports once scan_init() has run.
+ */
+extern void (*statsd_scan)(const char *buf, int len, uint64_t *bitmap);
+
+void scan_init();
+int scan_select( const char *name );
+const char *scan_kernel_name();
+
+/* Position of the first delimiter at or after from, or end if none */
+static inline int scan_next(const uint64_t *bitmap, int from, int end) {
+  int word = from >> 6;
+  uint64_t bits;
+
+  if (from >= end) return end;
+  bits = bitmap[word] & (~(uint64_t) 0 << (from & 63));
+  while (bits == 0) {
+    if (++word >= SCAN_WORDS(end)) return end;
+    bits = bitmap[word];
+  }
+  from = (word << 6) + __builtin_ctzll(bits);
+  return from < end ? from : end;
+}
+
+#endif /* __SCAN_H__ */
@@ -8,17 +8,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 
 #include "json-c/json.h"
-#include "uthash/utarray.h"
 
+#include "aggregate.h"
 #include "counters.h"
 #include "gauges.h"
+#include "keys.h"
 #include "stats.h"
 #include "timers.h"
 
-extern UT_icd timers_icd;
 
 int statsd_deserialize( char *filename ) {
   FILE *fp;
@@ -54,25 +55,21 @@ int statsd_deserialize( char *filename ) {
   json_object *obj_stats = json_object_object_get(obj, "stats");
   {
     json_object_object_foreach(obj_stats, key, val) {
-      statsd_stat_t *s = malloc(sizeof(statsd_stat_t));
-      memset(s, 0, sizeof(statsd_stat_t));
+      statsd_stat_t *s;
 
       syslog(LOG_DEBUG, "Found key %s in file\n", key);
 
+      /* Saved as group.key; the group has no period in it */
       char *period = strchr(key, '.');
+      wait_for_stats_lock();
       if (!period) {
-        strcpy(s->name.key_name, key);
+        s = stat_get("", key);
       } else {
-        int period_pos = period - key;
-        strncpy(s->name.group_name, key, period_pos);
-        strncpy(s->name.key_name, key + period_pos + 1, strlen(key) - period_pos + 1);
+        *period = '\0';
+        s = stat_get(key, period + 1);
+        *period = '.';
       }
-
       s->value = json_object_get_int(val);
-      s->locked = 0;
-
-      wait_for_stats_lock();
-      HASH_ADD( hh, stats, name, sizeof(statsd_stat_name_t), s );
       remove_stats_lock();
     }
   }
@@ -80,48 +77,61 @@ int statsd_deserialize( char *filename ) {
   json_object *obj_timers = json_object_object_get(obj, "timers");
   {
     json_object_object_foreach(obj_timers, key, val) {
-      statsd_timer_t *t = malloc(sizeof(statsd_timer_t));
-
-      strcpy(t->key, key);
-      t->count = json_object_array_length(val);
-      utarray_new(t->values, &timers_icd);
-      int i;
-      for (i = 0; i < t->count; i++) {
+      statsd_key_t *k = key_intern(key, strlen(key), -1);
+      if (!k) continue;
+      statsd_timer_t *t = slab_alloc(&timers_slab);
+      int i, n = json_object_array_length(val);
+
+      t->key = k;
+      if (sketch_alpha > 0) {
+        t->sketch = sketch_new();
+      }
+      for (i = 0; i < n; i++) {
         double d = json_object_get_double(json_object_array_get_idx(val, i));
-        utarray_push_back(t->values, &d);
+        if (t->sketch) {
+          sketch_add(t->sketch, d);
+        } else {
+          timer_add_samples(t, &d, 1);
+        }
       }
+      /* Less any sample the sketch had no memory for */
+      if (t->sketch) t->count = t->sketch->count;
 
-      wait_for_timers_lock();
-      HASH_ADD_STR( timers, key, t );
-      remove_timers_lock();
+      wait_for_timers_lock(k);
+      idtable_set( &timers, k->id, t );
+      remove_timers_lock(k);
     }
   }
 
   json_object *obj_gauges = json_object_object_get(obj, "gauges");
   {
     json_object_object_foreach(obj_gauges, key, val) {
-      statsd_gauge_t *g = malloc(sizeof(statsd_gauge_t));
+      statsd_key_t *k = key_intern(key, strlen(key), -1);
+      if (!k) continue;
+      statsd_gauge_t *g = slab_alloc(&gauges_slab);
 
-      strcpy(g->key, key);
+      g->key = k;
       g->value = json_object_get_double(val);
 
-      wait_for_gauges_lock();
-      HASH_ADD_STR( gauges, key, g );
-      remove_gauges_lock();
+      wait_for_gauges_lock(k);
+      idtable_set( &gauges, k->id, g );
+      remove_gauges_lock(k);
     }
   }
 
   json_object *obj_counters = json_object_object_get(obj, "counters");
   {
     json_object_object_foreach(obj_counters, key, val) {
-      statsd_counter_t *s = malloc(sizeof(statsd_counter_t));
+      statsd_key_t *k = key_intern(key, strlen(key), -1);
+      if (!k) continue;
+      statsd_counter_t *s = slab_alloc(&counters_slab);
 
-      strcpy(s->key, key);
+      s->key = k;
       s->value = json_object_get_double(val);
 
-      wait_for_counters_lock();
-      HASH_ADD_STR( counters, key, s );
-      remove_counters_lock();
+      wait_for_counters_lock(k);
+      idtable_set( &counters, k->id, s );
+      remove_counters_lock(k);
     }
   }
 
@@ -139,12 +149,8 @@ int statsd_serialize( char *filename ) {
     wait_for_stats_lock();
     statsd_stat_t *s, *tmp;
     HASH_ITER(hh, stats, s, tmp) {
-      char *tmpkey = malloc(sizeof(s->name.group_name ? strlen(s->name.group_name) + strlen(s->name.key_name) + 1 : strlen(s->name.key_name)));
-      if (s->name.group_name) {
-        sprintf(tmpkey, "%s.%s", s->name.group_name, s->name.key_name);
-      } else {
-        tmpkey = strdup(s->name.key_name);
-      }
+      char tmpkey[s->name_len + 1];
+      sprintf(tmpkey, "%s.%s", s->group_name, s->key_name);
       syslog(LOG_DEBUG, "Serializing with key '%s'\n", tmpkey);
       json_object_object_add(obj_stats, tmpkey, json_object_new_int(s->value));
     }
@@ -152,35 +158,52 @@ int statsd_serialize( char *filename ) {
   }
   json_object *obj_timers = json_object_new_object();
   {
-    statsd_timer_t *s, *tmp;
-    wait_for_timers_lock();
-    HASH_ITER(hh, timers, s, tmp) {
-      double *iter = NULL;
-      json_object *array = json_object_new_array();
-      while ( (iter = (double *) utarray_next(s->values, iter))) {
-        json_object_array_add(array, json_object_new_double(*iter));
+    statsd_timer_t *s;
+    uint32_t id;
+    IDTABLE_ITER(&timers, id, s) {
+      int j;
+      json_object *array;
+      statsd_key_t *key = key_by_id(id);
+      wait_for_timers_lock(key);
+      /* Look it up again under the lock, it may have expired */
+      if ((s = idtable_get(&timers, id)) == NULL) {
+        remove_timers_lock(key);
+        continue;
+      }
+      array = json_object_new_array();
+      /* A sketch does not keep its samples, so there is nothing to save */
+      for (j = 0; s->values && j < s->count; j++) {
+        json_object_array_add(array, json_object_new_double(s->values[j]));
       }
-      json_object_object_add(obj_timers, s->key, array);
+      remove_timers_lock(key);
+      json_object_object_add(obj_timers, key->name, array);
     }
-    remove_timers_lock();
   }
   json_object *obj_counters = json_object_new_object();
   {
-    statsd_counter_t *s, *tmp;
-    wait_for_counters_lock();
-    HASH_ITER(hh, counters, s, tmp) {
-      json_object_object_add(obj_counters, s->key, json_object_new_double(s->value));
+    statsd_counter_t *s;
+    uint32_t id;
+    IDTABLE_ITER(&counters, id, s) {
+      statsd_key_t *key = key_by_id(id);
+      wait_for_counters_lock(key);
+      if ((s = idtable_get(&counters, id)) != NULL) {
+        json_object_object_add(obj_counters, key->name, json_object_new_double(s->value));
+      }
+      remove_counters_lock(key);
     }
-    remove_counters_lock();
   }
   json_object *obj_gauges = json_object_new_object();
   {
-    statsd_gauge_t *g, *tmp;
-    wait_for_gauges_lock();
-    HASH_ITER(hh, gauges, g, tmp) {
-      json_object_object_add(obj_gauges, g->key, json_object_new_double(g->value));
+    statsd_gauge_t *g;
+    uint32_t id;
+    IDTABLE_ITER(&gauges, id, g) {
+      statsd_key_t *key = key_by_id(id);
+      wait_for_gauges_lock(key);
+      if ((g = idtable_get(&gauges, id)) != NULL) {
+        json_object_object_add(obj_gauges, key->name, json_object_new_double(g->value));
+      }
+      remove_gauges_lock(key);
     }
-    remove_gauges_lock();
   }
 
   json_object_object_add(obj, "stats", obj_stats);
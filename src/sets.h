@@ -0,0 +1,34 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include "hll.h"
+#include "keys.h"
+#include "shards.h"
+#include "slab.h"
+
+#ifndef __SETS_H__
+#define __SETS_H__ 1
+
+/*
+ * Indexed by key id in sets. hll holds the interval's distinct values;
+ * it goes to the snapshot at a flush and is NULL until the next value.
+ */
+typedef struct {
+  statsd_key_t *key;
+  statsd_hll_t *hll;
+  long seen;          /* flush_seq of the last merge */
+} statsd_set_t;
+
+extern statsd_idtable_t sets;
+extern statsd_shard_t sets_shards[STATSD_SHARDS];
+extern statsd_slab_t sets_slab;
+
+#define wait_for_sets_lock(key) pthread_mutex_lock(&sets_shards[KEY_SHARD(key)].lock)
+#define remove_sets_lock(key) pthread_mutex_unlock(&sets_shards[KEY_SHARD(key)].lock)
+
+#endif /* __SETS_H__ */
@@ -0,0 +1,45 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <pthread.h>
+
+#include "keys.h"
+
+#ifndef __SHARDS_H__
+#define __SHARDS_H__ 1
+
+/*
+ * Aggregation tables are lock striped: a key's entry is guarded by one
+ * of STATSD_SHARDS locks, picked from the top bits of its interned hash
+ * (the low bits already place it in the key table). Updates to keys in
+ * different shards never contend.
+ */
+#define STATSD_SHARD_BITS 6
+#define STATSD_SHARDS ( 1 << STATSD_SHARD_BITS )
+
+#define KEY_SHARD(key) ( (key)->hash >> ( 32 - STATSD_SHARD_BITS ) )
+
+typedef struct {
+  _Alignas(64) pthread_mutex_t lock;
+} statsd_shard_t;
+
+static inline void shards_init(statsd_shard_t *shards) {
+  int i;
+  for (i = 0; i < STATSD_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+}
+
+static inline void shards_destroy(statsd_shard_t *shards) {
+  int i;
+  for (i = 0; i < STATSD_SHARDS; i++) {
+    pthread_mutex_destroy(&shards[i].lock);
+  }
+}
+
+#endif /* __SHARDS_H__ */
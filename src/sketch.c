@@ -0,0 +1,252 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "sketch.h"
+
+/* Spare bins allocated on either side when a store grows */
+#define SKETCH_SLACK 32
+
+double sketch_alpha = 0;
+static double sketch_gamma = 0;
+static double sketch_inv_log_gamma = 0;
+
+/* Indexes of SKETCH_MIN_VALUE and SKETCH_MAX_VALUE, the most a store spans */
+static int sketch_index_min = 0;
+static int sketch_index_max = 0;
+
+/**
+ * Set the relative accuracy. A store holds a bin for every index between
+ * those of SKETCH_MIN_VALUE and SKETCH_MAX_VALUE, so that it never has to
+ * fold bins together; an alpha that would need more than SKETCH_MAX_BINS
+ * of them is refused, returning -1 and leaving the accuracy as it was.
+ */
+int sketch_init( double alpha ) {
+  double gamma, inv_log_gamma, bins;
+
+  if (!( alpha > 0 && alpha < 1 )) return -1;
+  gamma = ( 1 + alpha ) / ( 1 - alpha );
+  inv_log_gamma = 1 / log(gamma);
+  bins = ceil(log(SKETCH_MAX_VALUE) * inv_log_gamma) - ceil(log(SKETCH_MIN_VALUE) * inv_log_gamma) + 1;
+  if (bins > SKETCH_MAX_BINS) return -1;
+
+  sketch_alpha = alpha;
+  sketch_gamma = gamma;
+  sketch_inv_log_gamma = inv_log_gamma;
+  sketch_index_min = (int) ceil(log(SKETCH_MIN_VALUE) * inv_log_gamma);
+  sketch_index_max = (int) ceil(log(SKETCH_MAX_VALUE) * inv_log_gamma);
+  return 0;
+}
+
+static inline int sketch_index( double magnitude ) {
+  int index;
+  if (magnitude >= SKETCH_MAX_VALUE) return sketch_index_max;
+  index = (int) ceil(log(magnitude) * sketch_inv_log_gamma);
+  return index < sketch_index_min ? sketch_index_min : index;
+}
+
+/* Midpoint (in relative terms) of ( gamma^(i-1), gamma^i ] */
+static inline double sketch_value( int index ) {
+  return 2 * pow(sketch_gamma, index) / ( sketch_gamma + 1 );
+}
+
+/* An empty sketch, or NULL when out of memory */
+statsd_sketch_t *sketch_new() {
+  statsd_sketch_t *s = calloc(1, sizeof(statsd_sketch_t));
+  if (s == NULL) syslog(LOG_ERR, "Unable to allocate timer sketch");
+  return s;
+}
+
+void sketch_free( statsd_sketch_t *s ) {
+  if (s == NULL) return;
+  free(s->pos.bins);
+  free(s->neg.bins);
+  free(s);
+}
+
+/**
+ * Forget every sample but keep the bins allocated, since the same key
+ * tends to see the same range of values from one interval to the next.
+ */
+void sketch_clear( statsd_sketch_t *s ) {
+  if (s->pos.bins) memset(s->pos.bins, 0, s->pos.len * sizeof(uint64_t));
+  if (s->neg.bins) memset(s->neg.bins, 0, s->neg.len * sizeof(uint64_t));
+  s->zero_count = s->count = 0;
+  s->min = s->max = s->sum = s->mean = s->m2 = 0;
+}
+
+/**
+ * Reallocate a store so that it covers lo..hi, growing by at least half
+ * its length on the side that grew so that a run of new extremes costs
+ * only a few reallocations. It never reaches past the indexes of
+ * SKETCH_MIN_VALUE and SKETCH_MAX_VALUE, so a store at its widest covers
+ * every index and is never reallocated again. Returns -1, leaving the
+ * store as it was, when out of memory.
+ */
+static int store_resize( statsd_sketch_store_t *st, int lo, int hi ) {
+  int grow = st->len / 2 > SKETCH_SLACK ? st->len / 2 : SKETCH_SLACK;
+  int new_lo = lo, new_hi = hi;
+  uint64_t *bins;
+
+  if (st->len == 0 || lo < st->offset) new_lo = lo - grow;
+  if (st->len == 0 || hi > st->offset + st->len - 1) new_hi = hi + grow;
+  if (new_lo < sketch_index_min) new_lo = sketch_index_min;
+  if (new_hi > sketch_index_max) new_hi = sketch_index_max;
+
+  bins = calloc(new_hi - new_lo + 1, sizeof(uint64_t));
+  if (bins == NULL) {
+    syslog(LOG_ERR, "Unable to allocate %d sketch bins", new_hi - new_lo + 1);
+    return -1;
+  }
+  if (st->len > 0) {
+    memcpy(bins + ( st->offset - new_lo ), st->bins, st->len * sizeof(uint64_t));
+  }
+  free(st->bins);
+  st->bins = bins;
+  st->offset = new_lo;
+  st->len = new_hi - new_lo + 1;
+  return 0;
+}
+
+/**
+ * Count n samples in bin index, always within sketch_index_min..max.
+ * Returns 0, or when the store can't grow to it, 1 if they went to the
+ * nearest bin it has and -1 if it has none and they were dropped.
+ */
+static int store_add( statsd_sketch_store_t *st, int index, uint64_t n ) {
+  int lo = st->offset, hi = st->offset + st->len - 1, rc = 0;
+
+  if (st->len == 0 || index < lo || index > hi) {
+    if (store_resize(st, st->len == 0 || index < lo ? index : lo, st->len == 0 || index > hi ? index : hi) < 0) {
+      if (st->len == 0) return -1;
+      index = index < lo ? lo : hi;
+      rc = 1;
+    }
+  }
+  st->bins[ index - st->offset ] += n;
+  return rc;
+}
+
+/* Returns as store_add(), for the worst bin; dropped counts what was lost */
+static int store_merge( statsd_sketch_store_t *dst, const statsd_sketch_store_t *src, uint64_t *dropped ) {
+  int i, r, rc = 0;
+  if (src->len == 0) return 0;
+  store_add(dst, src->offset, 0);
+  store_add(dst, src->offset + src->len - 1, 0);
+  for (i = 0; i < src->len; i++) {
+    if (src->bins[i] == 0) continue;
+    if ((r = store_add(dst, src->offset + i, src->bins[i])) < 0) {
+      *dropped += src->bins[i];
+      rc = -1;
+    } else if (r > 0 && rc == 0) {
+      rc = 1;
+    }
+  }
+  return rc;
+}
+
+/**
+ * Add a sample. Returns 0, or -1 when out of memory for its bin: it is
+ * then counted in the nearest bin there is, or dropped if there is none.
+ */
+int sketch_add( statsd_sketch_t *s, double value ) {
+  double delta;
+  int rc = 0;
+
+  if (value > SKETCH_MIN_VALUE) {
+    rc = store_add(&s->pos, sketch_index(value), 1);
+  } else if (value < -SKETCH_MIN_VALUE) {
+    rc = store_add(&s->neg, sketch_index(-value), 1);
+  } else {
+    s->zero_count++;
+  }
+  if (rc < 0) return -1;
+  if (s->count == 0 || value < s->min) s->min = value;
+  if (s->count == 0 || value > s->max) s->max = value;
+  s->sum += value;
+  /* Welford's update, as timer_summarize() does for exact timers */
+  delta = value - s->mean;
+  s->count++;
+  s->mean += delta / s->count;
+  s->m2 += delta * ( value - s->mean );
+  return rc == 0 ? 0 : -1;
+}
+
+/**
+ * Add src's samples to dst. Returns 0, or -1 when out of memory for some
+ * of dst's bins, with those samples handled as sketch_add() does; dst's
+ * count only takes the samples it kept.
+ */
+int sketch_merge( statsd_sketch_t *dst, const statsd_sketch_t *src ) {
+  uint64_t dropped = 0;
+  double n, delta;
+  int rc;
+
+  if (src->count == 0) return 0;
+  rc = store_merge(&dst->pos, &src->pos, &dropped) | store_merge(&dst->neg, &src->neg, &dropped);
+  dst->zero_count += src->zero_count;
+  if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+  if (dst->count == 0 || src->max > dst->max) dst->max = src->max;
+  dst->sum += src->sum;
+  /* Chan et al.'s pairwise combination of the two means and m2s */
+  n = (double) dst->count + src->count;
+  delta = src->mean - dst->mean;
+  dst->mean += delta * src->count / n;
+  dst->m2 += src->m2 + delta * delta * dst->count * src->count / n;
+  dst->count += src->count - dropped;
+  return rc == 0 ? 0 : -1;
+}
+
+/**
+ * Value at quantile q (0..1): the largest of the lowest q * count
+ * samples, as statsd's upper_N, clamped to the exact min and max so that
+ * the extremes come out right.
+ */
+double sketch_quantile( const statsd_sketch_t *s, double q ) {
+  double value;
+  uint64_t rank, seen = 0;
+  int i;
+
+  if (s->count == 0) return 0;
+  if (q <= 0) return s->min;
+  if (q >= 1) return s->max;
+
+  rank = (uint64_t) ( q * s->count + 0.5 );
+  if (rank < 1) rank = 1;
+  value = s->max;
+
+  /* Most negative first: walk the negative store from the top down */
+  for (i = s->neg.len - 1; i >= 0; i--) {
+    seen += s->neg.bins[i];
+    if (seen >= rank) {
+      value = -sketch_value(s->neg.offset + i);
+      goto found;
+    }
+  }
+  seen += s->zero_count;
+  if (seen >= rank) {
+    value = 0;
+    goto found;
+  }
+  for (i = 0; i < s->pos.len; i++) {
+    seen += s->pos.bins[i];
+    if (seen >= rank) {
+      value = sketch_value(s->pos.offset + i);
+      goto found;
+    }
+  }
+
+found:
+  if (value < s->min) value = s->min;
+  if (value > s->max) value = s->max;
+  return value;
+}
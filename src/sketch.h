@@ -0,0 +1,59 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdint.h>
+
+#ifndef __SKETCH_H__
+#define __SKETCH_H__ 1
+
+/* Most bins a store may need; finer alphas than that allows are refused */
+#define SKETCH_MAX_BINS 65536
+
+/* Magnitudes below this are counted as zero */
+#define SKETCH_MIN_VALUE 1e-9
+
+/* Magnitudes above this go to the top bin, and come out as the exact max */
+#define SKETCH_MAX_VALUE 1e12
+
+/* Dense run of bin counts; bins[0] holds the count for index offset */
+typedef struct {
+  uint64_t *bins;
+  int offset;
+  int len;
+} statsd_sketch_store_t;
+
+/*
+ * DDSketch: value x > 0 lands in bin ceil(log_gamma(x)), so every
+ * quantile it answers is within a relative error alpha of an actual
+ * sample. Negative values go to their own store by magnitude. Sketches
+ * with the same alpha merge by adding bins.
+ */
+typedef struct {
+  statsd_sketch_store_t pos;
+  statsd_sketch_store_t neg;
+  uint64_t zero_count;
+  uint64_t count;
+  double min;
+  double max;
+  double sum;
+  double mean;
+  double m2;              /* sum of squared differences from the mean */
+} statsd_sketch_t;
+
+/* Relative accuracy of timer sketches; 0 keeps every sample instead */
+extern double sketch_alpha;
+
+int sketch_init( double alpha );
+statsd_sketch_t *sketch_new();
+void sketch_free( statsd_sketch_t *s );
+void sketch_clear( statsd_sketch_t *s );
+int sketch_add( statsd_sketch_t *s, double value );
+int sketch_merge( statsd_sketch_t *dst, const statsd_sketch_t *src );
+double sketch_quantile( const statsd_sketch_t *s, double q );
+
+#endif /* __SKETCH_H__ */
@@ -0,0 +1,89 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "slab.h"
+
+#define SLAB_ROUND(x) ( ( (x) + SLAB_ALIGN - 1 ) & ~( (size_t) SLAB_ALIGN - 1 ) )
+#define SLAB_ROUND_PTR(x) ( ( (x) + sizeof(void *) - 1 ) & ~( sizeof(void *) - 1 ) )
+
+statsd_slab_t *slab_list = NULL;
+static pthread_mutex_t slab_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void slab_init( statsd_slab_t *slab, const char *name, size_t size ) {
+  memset(slab, 0, sizeof(statsd_slab_t));
+  slab->name = name;
+  /*
+   * Free records hold the free list link. Records are packed at their
+   * sizeof, which is a multiple of their alignment, so each stays
+   * aligned without padding out to SLAB_ALIGN.
+   */
+  slab->size = SLAB_ROUND_PTR(size < sizeof(void *) ? sizeof(void *) : size);
+  slab->per_page = ( SLAB_PAGE_SIZE - SLAB_ROUND(sizeof(statsd_slab_page_t)) ) / slab->size;
+  pthread_mutex_init(&slab->lock, NULL);
+
+  pthread_mutex_lock(&slab_list_lock);
+  slab->next = slab_list;
+  slab_list = slab;
+  pthread_mutex_unlock(&slab_list_lock);
+}
+
+/* Carve a new page onto the free list; called with the lock held */
+static int slab_grow( statsd_slab_t *slab ) {
+  statsd_slab_page_t *page = malloc(SLAB_PAGE_SIZE);
+  char *obj;
+  int i;
+
+  if (page == NULL) {
+    syslog(LOG_ERR, "Unable to grow %s slab", slab->name);
+    return 0;
+  }
+  page->next = slab->pages;
+  slab->pages = page;
+  slab->num_pages++;
+  slab->capacity += slab->per_page;
+
+  obj = (char *) page + SLAB_ROUND(sizeof(statsd_slab_page_t));
+  for (i = 0; i < slab->per_page; i++, obj += slab->size) {
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+  }
+  return 1;
+}
+
+/**
+ * A zeroed record, or NULL when out of memory.
+ */
+void *slab_alloc( statsd_slab_t *slab ) {
+  void *obj = NULL;
+
+  pthread_mutex_lock(&slab->lock);
+  if (slab->free_list != NULL || slab_grow(slab)) {
+    obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+    slab->in_use++;
+  }
+  pthread_mutex_unlock(&slab->lock);
+
+  if (obj != NULL) {
+    memset(obj, 0, slab->size);
+  }
+  return obj;
+}
+
+void slab_free( statsd_slab_t *slab, void *ptr ) {
+  if (ptr == NULL) return;
+  pthread_mutex_lock(&slab->lock);
+  *(void **) ptr = slab->free_list;
+  slab->free_list = ptr;
+  slab->in_use--;
+  pthread_mutex_unlock(&slab->lock);
+}
@@ -0,0 +1,51 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifndef __SLAB_H__
+#define __SLAB_H__ 1
+
+/* Bytes carved into objects at a time */
+#define SLAB_PAGE_SIZE ( 64 * 1024 )
+
+/* Records start this far into a page, for those holding long doubles */
+#define SLAB_ALIGN 16
+
+typedef struct statsd_slab_page {
+  struct statsd_slab_page *next;
+} statsd_slab_page_t;
+
+/*
+ * Allocator for one kind of fixed-size record (counters, keys, ...).
+ * Records come from SLAB_PAGE_SIZE pages and go back on a free list
+ * for the next record of the same kind, so a churn of short-lived keys
+ * reuses memory instead of fragmenting the heap. Pages are kept for
+ * the life of the process. Every slab is on slab_list for reporting.
+ */
+typedef struct statsd_slab {
+  const char *name;
+  size_t size;
+  int per_page;
+  pthread_mutex_t lock;
+  void *free_list;
+  statsd_slab_page_t *pages;
+  long in_use;
+  long capacity;
+  long num_pages;
+  struct statsd_slab *next;
+} statsd_slab_t;
+
+extern statsd_slab_t *slab_list;
+
+void slab_init( statsd_slab_t *slab, const char *name, size_t size );
+void *slab_alloc( statsd_slab_t *slab );
+void slab_free( statsd_slab_t *slab, void *ptr );
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,44 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+
+/* Names of stats, which are never removed; guarded by stats_lock */
+static statsd_arena_t stats_names;
+
+void stats_init() {
+  sem_init(&stats_lock, 0, 1);
+  arena_init(&stats_names);
+}
+
+/**
+ * Find the stat group.key, adding it with a value of 0 if it is not
+ * there yet. Called with stats_lock held.
+ */
+statsd_stat_t *stat_get( const char *group, const char *key ) {
+  int group_len = strlen(group), key_len = strlen(key);
+  int name_len = group_len + 1 + key_len;
+  char name[name_len + 1];
+  statsd_stat_t *s;
+
+  memcpy(name, group, group_len + 1);
+  memcpy(name + group_len + 1, key, key_len + 1);
+  HASH_FIND( hh, stats, name, name_len, s );
+  if (s) return s;
+
+  s = slab_alloc(&stats_slab);
+  s->group_name = arena_alloc(&stats_names, name_len + 1);
+  memcpy((char *) s->group_name, name, name_len + 1);
+  s->key_name = s->group_name + group_len + 1;
+  s->name_len = name_len;
+  HASH_ADD_KEYPTR( hh, stats, s->group_name, s->name_len, s );
+  return s;
+}
@@ -9,18 +9,21 @@
 #include <stdbool.h>
 #include <semaphore.h>
 
+#include "slab.h"
 #include "uthash/uthash.h"
 
 #ifndef __STATS_H__
 #define __STATS_H__ 1
 
+/*
+ * An internal stat. Its name is stored once, in the stat names arena,
+ * as "group\0key\0"; the hash is over the name_len bytes up to the end
+ * of the key, so group "a" key "b.c" and group "a.b" key "c" differ.
+ */
 typedef struct {
-  char group_name[100];
-  char key_name[100];
-} statsd_stat_name_t;
-
-typedef struct {
-  statsd_stat_name_t name;
+  const char *group_name;
+  const char *key_name;   /* points into the same bytes */
+  int name_len;
   long value;
   bool locked;
   UT_hash_handle hh; /* makes this structure hashable */
@@ -28,9 +31,13 @@ typedef struct {
 
 extern statsd_stat_t *stats;
 extern sem_t stats_lock;
+extern statsd_slab_t stats_slab;
 
 #define wait_for_stats_lock() sem_wait(&stats_lock)
 #define remove_stats_lock() sem_post(&stats_lock)
 
+void stats_init();
+statsd_stat_t *stat_get( const char *group, const char *key );
+
 #endif /* __STATS_H__ */
 
@@ -8,6 +8,10 @@
 
 #include "config.h"
 
+#ifdef HAVE_RECVMMSG
+#define _GNU_SOURCE 1
+#endif
+
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
@@ -37,7 +41,9 @@
 #ifdef HAVE_SEMAPHORE_H
 #include <semaphore.h>
 #endif
+#include <math.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,13 +60,28 @@
 #include "uthash/utarray.h"
 #include "uthash/utstring.h"
 #include "queue.h"
+#include "listeners.h"
+#include "flush.h"
+#include "format.h"
+#include "ganglia.h"
+#include "graphite.h"
 #include "statsd.h"
 #include "serialize.h"
 #include "stats.h"
 #include "timers.h"
 #include "counters.h"
+#include "expire.h"
 #include "gauges.h"
+#include "hll.h"
+#include "ingest.h"
+#include "sets.h"
 #include "strings.h"
+#include "aggregate.h"
+#include "keys.h"
+#include "parser.h"
+#include "percentiles.h"
+#include "scan.h"
+#include "slab.h"
 #include "embeddedgmetric/embeddedgmetric.h"
 
 #define LOCK_FILE "/tmp/statsd.lock"
@@ -71,41 +92,67 @@
 
 statsd_stat_t *stats = NULL;
 sem_t stats_lock;
-statsd_counter_t *counters = NULL;
-sem_t counters_lock;
-statsd_gauge_t *gauges = NULL;
-sem_t gauges_lock;
-statsd_timer_t *timers = NULL;
-sem_t timers_lock;
-UT_icd timers_icd = { sizeof(double), NULL, NULL, NULL };
-
-int stats_udp_socket, stats_mgmt_socket;
-pthread_t thread_udp;
+sem_t merge_lock;
+statsd_idtable_t counters;
+statsd_shard_t counters_shards[STATSD_SHARDS];
+statsd_idtable_t gauges;
+statsd_shard_t gauges_shards[STATSD_SHARDS];
+statsd_idtable_t timers;
+statsd_shard_t timers_shards[STATSD_SHARDS];
+statsd_idtable_t sets;
+statsd_shard_t sets_shards[STATSD_SHARDS];
+statsd_slab_t counters_slab, gauges_slab, timers_slab, sets_slab, stats_slab;
+statsd_ttl_t ttl;
+statsd_expiry_t expiry;
+
+int stats_mgmt_socket;
 pthread_t thread_mgmt;
 pthread_t thread_flush;
-pthread_t thread_queue;
+statsd_listener_t *listeners = NULL;
+int num_listeners = NUM_LISTENERS;
+statsd_worker_t *workers = NULL;
+int num_workers = 0;
+statsd_flusher_t *flushers = NULL;
+int num_flushers = NUM_FLUSHERS;
+statsd_graphite_t *graphites = NULL;
+int num_graphites = 0;
+statsd_graphite_ring_t graphite_ring;
+UT_string **graphite_payloads = NULL;
 int port = PORT, mgmt_port = MGMT_PORT, ganglia_port = GANGLIA_PORT, flush_interval = FLUSH_INTERVAL;
 int debug = 0, friendly = 0, clear_stats = 0, daemonize = 0, enable_gmetric = 0, enable_graphite = 0, graphite_port = 2003;
 char *serialize_file = NULL, *ganglia_host = NULL, *ganglia_spoof = NULL, *graphite_host = NULL, *ganglia_metric_prefix = NULL, *lock_file = NULL;
-int percentiles[5], num_percentiles = 0;
+statsd_percentile_t percentiles[STATSD_MAX_PERCENTILES];
+int num_percentiles = 0;
+int udp_batch_size = UDP_BATCH_SIZE;
+int queue_spins = QUEUE_SPIN_COUNT;
+int packet_pool_size = PACKET_POOL_SIZE;
+
+/* The flush in progress, shared by the flushers */
+statsd_snapshot_t flush_snap;
+char flush_ts[FORMAT_NUMBER_MAX];
+atomic_int flush_cursor;
+sem_t flush_done;
+/* Posted by each stopped thread, counted down by cleanup() */
+sem_t threads_stopped;
+statsd_ganglia_t ganglia;
+int ganglia_metadata_interval = GANGLIA_METADATA_INTERVAL;
+uint32_t max_keys = 0, max_keys_per_prefix = 0;
+int key_prefix_depth = 1;
+char *overflow_key = NULL;
 
 /*
  * FUNCTION PROTOTYPES
  */
 
-void add_timer( char *key, double value );
 void update_stat( char *group, char *key, char *value);
-void update_counter( char *key, double value, double sample_rate );
-void update_gauge( char *key, double value );
-void update_gauge_plusminus( char *key, double value, int plusminus );
-void update_timer( char *key, double value );
-void process_stats_packet(char buf_in[]);
-void process_json_stats_packet(char buf_in[]);
-void process_json_stats_object(json_object *sobj);
+long collect_aggregates();
 void dump_stats();
+void update_internal_stats();
 void p_thread_udp(void *ptr);
 void p_thread_mgmt(void *ptr);
 void p_thread_flush(void *ptr);
+void p_thread_flusher(void *ptr);
+void flush_part(statsd_flusher_t *f);
 void p_thread_queue(void *ptr);
 
 void init_stats() {
@@ -118,26 +165,63 @@ void init_stats() {
     statsd_deserialize(serialize_file);
   }
 
-  remove_stats_lock();
-
   update_stat( "graphite", "last_flush", startup_time );
   update_stat( "messages", "last_msg_seen", startup_time );
   update_stat( "messages", "bad_lines_seen", "0" );
+  last_msg_seen = time(NULL);
+}
+
+/*
+ * The flush, mgmt, flusher and worker threads take the table locks, so
+ * they run with cancellation disabled and only allow it while idle; a
+ * cancel waits until they hold nothing cleanup() will need.
+ */
+void thread_idle_begin() {
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  pthread_testcancel();
+}
+
+void thread_idle_end() {
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+}
+
+void thread_stopped(void *ptr) {
+  sem_post(&threads_stopped);
 }
 
 void cleanup() {
-  pthread_cancel(thread_flush);
-  pthread_cancel(thread_udp);
-  pthread_cancel(thread_mgmt);
-  pthread_cancel(thread_queue);
-
-  if (stats_udp_socket) {
-    syslog(LOG_INFO, "Closing UDP stats socket.");
-    close(stats_udp_socket);
+  int l, stopping;
+
+  /*
+   * Listeners start last, with these signals blocked everywhere but in
+   * main(), so once there are flushers every other thread is running.
+   * Stop the flush first, it waits on the flushers; then everything
+   * else feeding the tables, before the final merge below.
+   */
+  if (flushers != NULL) {
+    pthread_cancel(thread_flush);
+    pthread_cancel(thread_mgmt);
+    for (stopping = 2; stopping > 0; stopping--) sem_wait(&threads_stopped);
+    for (l = 1; l < num_flushers; l++) {
+      pthread_cancel(flushers[l].thread);
+    }
+    for (l = 0; l < num_workers; l++) {
+      pthread_cancel(workers[l].thread);
+    }
+    for (stopping = num_flushers - 1 + num_workers; stopping > 0; stopping--) sem_wait(&threads_stopped);
+  }
+  for (l = 0; listeners != NULL && l < num_listeners; l++) {
+    pthread_cancel(listeners[l].thread_udp);
+
+    if (listeners[l].socket > 0) {
+      syslog(LOG_INFO, "Closing UDP stats socket %d.", l);
+      close(listeners[l].socket);
+    }
   }
 
   if (serialize_file) {
     syslog(LOG_INFO, "Serializing state to file.");
+    collect_aggregates();
     if (statsd_serialize(serialize_file)) {
       syslog(LOG_INFO, "Serialized state successfully.");
     } else {
@@ -146,9 +230,14 @@ void cleanup() {
   }
 
   sem_destroy(&stats_lock);
-  sem_destroy(&timers_lock);
-  sem_destroy(&counters_lock);
-  sem_destroy(&gauges_lock);
+  sem_destroy(&merge_lock);
+  sem_destroy(&flush_done);
+  sem_destroy(&threads_stopped);
+  shards_destroy(timers_shards);
+  shards_destroy(counters_shards);
+  shards_destroy(gauges_shards);
+  shards_destroy(sets_shards);
+  sem_destroy(&keys_lock);
 
   syslog(LOG_INFO, "Removing lockfile %s", lock_file != NULL ? lock_file : LOCK_FILE);
   unlink(lock_file != NULL ? lock_file : LOCK_FILE);
@@ -184,13 +273,6 @@ void sigterm_handler (int signum) {
   exit(1);
 }
 
-int double_sort (const void *a, const void *b) {
-  double _a = *(double *)a;
-  double _b = *(double *)b;
-  if (_a == _b) return 0;
-  return (_a < _b) ? -1 : 1;
-}
-
 void daemonize_server() {
   int pid;
   int lockfp;
@@ -243,16 +325,17 @@ void daemonize_server() {
 
 void syntax(char *argv[]) {
   fprintf(stderr, "statsd-c version %s\nhttps://github.com/jbuchbinder/statsd-c\n\n", STATSD_VERSION);
-  fprintf(stderr, "Usage: %s [-hDdfFc] [-p port] [-m port] [-s file] [-G host] [-g port] [-S spoofhost] [-P prefix] [-l lockfile] [-T percentiles] [-R host] [-r port]\n", argv[0]);
+  fprintf(stderr, "Usage: %s [-hDdfFc] [-p port] [-m port] [-s file] [-G host] [-g port] [-S spoofhost] [-P prefix] [-l lockfile] [-T percentiles] [-R host] [-r port] [-B batch] [-w listeners] [-W workers] [-y spins] [-n buffers] [-K accuracy] [-j flushers] [-E flushes] [-X ttls] [-L keys] [-A keys[:depth]] [-O key] [-H precision]\n", argv[0]);
   fprintf(stderr, "\t-p port           set statsd udp listener port (default 8125)\n");
   fprintf(stderr, "\t-m port           set statsd management port (default 8126)\n");
   fprintf(stderr, "\t-s file           serialize state to and from file (default disabled)\n");
   fprintf(stderr, "\t-G host           ganglia host (default disabled)\n");
   fprintf(stderr, "\t-g port           ganglia port (default 8649)\n");
-  fprintf(stderr, "\t-R ipv4           graphite ip address  (default disabled)\n");
+  fprintf(stderr, "\t-R hosts          graphite destinations, csv of host[:port[:instance]], sharded as carbon-relay's consistent hashing (default disabled)\n");
   fprintf(stderr, "\t-r port           graphite port (default 2003), TCP (not UDP)\n");
   fprintf(stderr, "\t-S spoofhost      ganglia spoof host (default statsd:statsd)\n");
   fprintf(stderr, "\t-P prefix         ganglia metric prefix (default is none)\n");
+  fprintf(stderr, "\t-E flushes        resend ganglia metadata every this many flushes (default %d)\n", GANGLIA_METADATA_INTERVAL);
   fprintf(stderr, "\t-l lockfile       lock file (only used when daemonizing)\n");
   fprintf(stderr, "\t-h                this help display\n");
   fprintf(stderr, "\t-d                enable debug\n");
@@ -260,27 +343,48 @@ void syntax(char *argv[]) {
   fprintf(stderr, "\t-f                enable friendly mode (breaks wire compatibility)\n");
   fprintf(stderr, "\t-F seconds        set flush interval in seconds (default 10)\n");
   fprintf(stderr, "\t-c                clear stats on startup\n");
-  fprintf(stderr, "\t-T                percentile thresholds, csv (defaults to 90)\n");
+  fprintf(stderr, "\t-T percentiles    percentile thresholds, csv, e.g. 90,99,99.9 (defaults to 90)\n");
+  fprintf(stderr, "\t-B batch          datagrams read per udp receive call (default %d)\n", UDP_BATCH_SIZE);
+  fprintf(stderr, "\t-w listeners      udp listener threads sharing the port (default %d)\n", NUM_LISTENERS);
+  fprintf(stderr, "\t-W workers        packet parsing threads (default one per listener)\n");
+  fprintf(stderr, "\t-y spins          polls by an idle worker before it sleeps, 0 to disable (default %d)\n", QUEUE_SPIN_COUNT);
+  fprintf(stderr, "\t-n buffers        receive buffers per udp listener (default %d)\n", PACKET_POOL_SIZE);
+  fprintf(stderr, "\t-j flushers       threads formatting each flush (default %d)\n", NUM_FLUSHERS);
+  fprintf(stderr, "\t-X ttls           remove entries idle for this many flushes, per type, e.g. c=60,g=360,ms=60,s=60 (default never)\n");
+  fprintf(stderr, "\t-L keys           most distinct keys accepted (default unlimited)\n");
+  fprintf(stderr, "\t-A keys[:depth]   most distinct keys under one prefix of depth dotted components, up to 8 (default unlimited, depth 1)\n");
+  fprintf(stderr, "\t-O key            fold keys over -L or -A into this key instead of dropping them\n");
+  fprintf(stderr, "\t-H precision      sets count distinct values in 2^precision registers, %d to %d (default %d)\n", HLL_PRECISION_MIN, HLL_PRECISION_MAX, HLL_PRECISION_DEFAULT);
+  fprintf(stderr, "\t-K accuracy       summarize timers in quantile sketches of this relative accuracy, e.g. 0.01 (default disabled, keeps every sample)\n");
   exit(1);
 }
 
 int main(int argc, char *argv[]) {
-  int pids[4] = { 1, 2, 3, 4 };
-  int opt, rc = 0;
-  char *p_raw, *pch;
+  int pids[2] = { 1, 2 };
+  int opt, rc = 0, l;
   pthread_attr_t attr;
+  sigset_t sigs;
 
   signal (SIGINT, sigint_handler);
   signal (SIGQUIT, sigquit_handler);
 
-  sem_init(&stats_lock, 0, 1);
-  sem_init(&timers_lock, 0, 1);
-  sem_init(&counters_lock, 0, 1);
-  sem_init(&gauges_lock, 0, 1);
-
-  queue_init();
-
-  while ((opt = getopt(argc, argv, "dDfhp:m:s:cg:G:F:S:P:l:T:R:r:")) != -1) {
+  stats_init();
+  sem_init(&merge_lock, 0, 1);
+  shards_init(timers_shards);
+  shards_init(counters_shards);
+  shards_init(gauges_shards);
+  shards_init(sets_shards);
+  slab_init(&counters_slab, "counters", sizeof(statsd_counter_t));
+  slab_init(&gauges_slab, "gauges", sizeof(statsd_gauge_t));
+  slab_init(&timers_slab, "timers", sizeof(statsd_timer_t));
+  slab_init(&sets_slab, "sets", sizeof(statsd_set_t));
+  slab_init(&stats_slab, "stats", sizeof(statsd_stat_t));
+  slab_init(&agg_entries_slab, "agg_entries", sizeof(statsd_agg_entry_t));
+  timer_arenas_init();
+  keys_init();
+  hll_init(HLL_PRECISION_DEFAULT);
+
+  while ((opt = getopt(argc, argv, "dDfhp:m:s:cg:G:F:S:P:E:l:T:R:r:B:w:W:y:n:K:j:X:L:A:O:H:")) != -1) {
     switch (opt) {
       case 'd':
         printf("Debug enabled.\n");
@@ -317,7 +421,7 @@ int main(int argc, char *argv[]) {
       case 'R':
         graphite_host = strdup(optarg);
         enable_graphite = 1;
-        printf("Graphite host %s\n", graphite_host);
+        printf("Graphite destinations %s\n", graphite_host);
         break;
       case 'r':
         graphite_port = atoi(optarg);
@@ -345,15 +449,91 @@ int main(int argc, char *argv[]) {
         printf("Lock file %s\n", lock_file);
         break;
       case 'T':
-        p_raw = strdup(optarg);
-        pch = strtok (p_raw, ",");
-        while (pch != NULL)
+        num_percentiles = percentiles_parse(optarg, percentiles, STATSD_MAX_PERCENTILES);
+        printf("Percentiles %s (%d values)\n", optarg, num_percentiles);
+        break;
+      case 'B':
+        udp_batch_size = atoi(optarg);
+        if (udp_batch_size < 1) udp_batch_size = 1;
+        printf("UDP receive batch size set to %d\n", udp_batch_size);
+        break;
+      case 'w':
+        num_listeners = atoi(optarg);
+        if (num_listeners < 1) num_listeners = 1;
+#ifndef SO_REUSEPORT
+        if (num_listeners > 1) {
+          printf("SO_REUSEPORT is not supported, using a single listener.\n");
+          num_listeners = 1;
+        }
+#endif
+        printf("UDP listener threads set to %d\n", num_listeners);
+        break;
+      case 'W':
+        num_workers = atoi(optarg);
+        printf("Packet parsing threads set to %d\n", num_workers);
+        break;
+      case 'y':
+        queue_spins = atoi(optarg);
+        if (queue_spins < 0) queue_spins = 0;
+        printf("Idle worker spin count set to %d\n", queue_spins);
+        break;
+      case 'n':
+        packet_pool_size = atoi(optarg);
+        if (packet_pool_size < 1) packet_pool_size = 1;
+        printf("Receive buffers per listener set to %d\n", packet_pool_size);
+        break;
+      case 'E':
+        ganglia_metadata_interval = atoi(optarg);
+        if (ganglia_metadata_interval < 1) ganglia_metadata_interval = 1;
+        printf("Ganglia metadata every %d flushes\n", ganglia_metadata_interval);
+        break;
+      case 'j':
+        num_flushers = atoi(optarg);
+        if (num_flushers < 1) num_flushers = 1;
+        printf("Flush threads set to %d\n", num_flushers);
+        break;
+      case 'K':
+        {
+          double alpha = atof(optarg);
+          if (sketch_init(alpha) == 0) {
+            printf("Timer sketch accuracy set to %g\n", alpha);
+          } else {
+            printf("Timer sketch accuracy must be between 0.0004 and 1, keeping every sample\n");
+          }
+        }
+        break;
+      case 'X':
+        if (!expire_parse(optarg, &ttl)) {
+          fprintf(stderr, "Bad expiry spec '%s', expected e.g. c=60,g=360,ms=60,s=60\n", optarg);
+          exit(1);
+        }
+        printf("Idle expiry after %d counter, %d gauge, %d timer, %d set flushes\n", ttl.counters, ttl.gauges, ttl.timers, ttl.sets);
+        break;
+      case 'H':
+        if (!hll_init(atoi(optarg))) {
+          fprintf(stderr, "Set precision must be between %d and %d\n", HLL_PRECISION_MIN, HLL_PRECISION_MAX);
+          exit(1);
+        }
+        printf("Set precision set to %d (%d registers)\n", hll_precision, 1 << hll_precision);
+        break;
+      case 'L':
+        max_keys = strtoul(optarg, NULL, 10);
+        printf("Key limit set to %u\n", max_keys);
+        break;
+      case 'A':
         {
-          percentiles[num_percentiles] = atoi(pch);
-          pch = strtok (p_raw, ",");
-          num_percentiles++;
+          char *depth = strchr(optarg, ':');
+          max_keys_per_prefix = strtoul(optarg, NULL, 10);
+          if (depth) key_prefix_depth = atoi(depth + 1);
+          if (key_prefix_depth < 1) key_prefix_depth = 1;
+          if (key_prefix_depth > STATSD_KEY_DEPTH_MAX) key_prefix_depth = STATSD_KEY_DEPTH_MAX;
+          printf("Key limit per prefix of depth %d set to %u\n", key_prefix_depth, max_keys_per_prefix);
         }
-        printf("Percentiles %s (%d values)\n", p_raw, num_percentiles);
+        break;
+      case 'O':
+        overflow_key = strdup(optarg);
+        sanitize_key(overflow_key);
+        printf("Keys over the limits go to %s\n", overflow_key);
         break;
       case 'h':
       default:
@@ -362,14 +542,37 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (num_workers < 1 || num_workers > num_listeners) {
+    num_workers = num_listeners;
+  }
+
+  if (!keys_limit(max_keys, max_keys_per_prefix, key_prefix_depth, overflow_key)) {
+    fprintf(stderr, "Bad overflow key '%s'\n", overflow_key);
+    exit(1);
+  }
+
   if (num_percentiles == 0) {
-    percentiles[0] = 90;
-    num_percentiles = 1;
+    num_percentiles = percentiles_parse("90", percentiles, STATSD_MAX_PERCENTILES);
+  }
+
+  if (enable_graphite) {
+    num_graphites = graphite_destinations(graphite_host, graphite_port, &graphites);
+    if (num_graphites == 0) {
+      printf("graphite won't work!\n");
+      enable_graphite = 0;
+    } else if (num_graphites > 1) {
+      graphite_ring_init(&graphite_ring, graphites, num_graphites);
+      graphite_payloads = calloc(num_graphites, sizeof(UT_string *));
+      for (l = 0; l < num_graphites; l++) {
+        utstring_new(graphite_payloads[l]);
+      }
+    }
   }
 
   if (ganglia_spoof == NULL) {
     ganglia_spoof = strdup("statsd:statsd");
   }
+  ganglia_init(&ganglia, ganglia_spoof, flush_interval + 10, ganglia_metadata_interval);
 
   if (debug) {
     setlogmask(LOG_UPTO(LOG_DEBUG));
@@ -391,233 +594,121 @@ int main(int argc, char *argv[]) {
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
   }
 
-  pthread_create (&thread_udp,   daemonize ? &attr : NULL, (void *) &p_thread_udp,   (void *) &pids[0]);
-  pthread_create (&thread_mgmt,  daemonize ? &attr : NULL, (void *) &p_thread_mgmt,  (void *) &pids[1]);
-  pthread_create (&thread_flush, daemonize ? &attr : NULL, (void *) &p_thread_flush, (void *) &pids[2]);
-  pthread_create (&thread_queue, daemonize ? &attr : NULL, (void *) &p_thread_queue, (void *) &pids[3]);
+  /*
+   * The shutdown handlers stop the other threads and wait for them, so
+   * only run them here: threads inherit the blocked set, and main()
+   * unblocks it again once they are all started.
+   */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGQUIT);
+  sigaddset(&sigs, SIGHUP);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  sem_init(&threads_stopped, 0, 0);
+
+  scan_init();
+  syslog(LOG_INFO, "Using %s delimiter scanner", scan_kernel_name());
+  syslog(LOG_INFO, "Using %s set register merge", hll_kernel_name());
+
+  /* Each listener gets its own socket and feeds one worker's queue */
+  listeners = calloc(num_listeners, sizeof(statsd_listener_t));
+  workers = calloc(num_workers, sizeof(statsd_worker_t));
+  for (l = 0; l < num_listeners; l++) {
+    listeners[l].id = l;
+    listeners[l].queue = &workers[l % num_workers].queue;
+    pool_init(&listeners[l].pool, packet_pool_size, BUFLEN);
+    workers[l % num_workers].producers++;
+  }
+  for (l = 0; l < num_workers; l++) {
+    workers[l].id = l;
+    /* Big enough to hold every buffer of every listener feeding it */
+    queue_init(&workers[l].queue, packet_pool_size * workers[l].producers, workers[l].producers, queue_spins);
+    pthread_mutex_init(&workers[l].agg_lock, NULL);
+    agg_init(&workers[l].agg[0]);
+    agg_init(&workers[l].agg[1]);
+    workers[l].active = &workers[l].agg[0];
+    pthread_create (&workers[l].thread, daemonize ? &attr : NULL, (void *) &p_thread_queue, (void *) &workers[l]);
+  }
+  /* Flusher 0 is the flush thread itself */
+  sem_init(&flush_done, 0, 0);
+  flushers = calloc(num_flushers, sizeof(statsd_flusher_t));
+  for (l = 0; l < num_flushers; l++) {
+    flushers[l].id = l;
+    sem_init(&flushers[l].start, 0, 0);
+    utstring_new(flushers[l].out);
+    ganglia_batch_init(&flushers[l].gbatch);
+    if (num_graphites > 1) {
+      int d;
+      flushers[l].routed = calloc(num_graphites, sizeof(UT_string *));
+      for (d = 0; d < num_graphites; d++) {
+        utstring_new(flushers[l].routed[d]);
+      }
+    }
+    if (l > 0) {
+      pthread_create (&flushers[l].thread, daemonize ? &attr : NULL, (void *) &p_thread_flusher, (void *) &flushers[l]);
+    }
+  }
+  pthread_create (&thread_mgmt,  daemonize ? &attr : NULL, (void *) &p_thread_mgmt,  (void *) &pids[0]);
+  pthread_create (&thread_flush, daemonize ? &attr : NULL, (void *) &p_thread_flush, (void *) &pids[1]);
+  /* Last, so a listener failing to bind finds everything to clean up */
+  for (l = 0; l < num_listeners; l++) {
+    pthread_create (&listeners[l].thread_udp, daemonize ? &attr : NULL, (void *) &p_thread_udp, (void *) &listeners[l]);
+  }
+  pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
 
   if (daemonize) {
     syslog(LOG_DEBUG, "Destroying pthread attributes");
     pthread_attr_destroy(&attr);
     syslog(LOG_DEBUG, "Detaching pthreads");
-    rc = pthread_detach(thread_udp);
-    CHECK_PTHREAD_DETACH();
+    for (l = 0; l < num_listeners; l++) {
+      rc = pthread_detach(listeners[l].thread_udp);
+      CHECK_PTHREAD_DETACH();
+    }
+    for (l = 0; l < num_workers; l++) {
+      rc = pthread_detach(workers[l].thread);
+      CHECK_PTHREAD_DETACH();
+    }
+    for (l = 1; l < num_flushers; l++) {
+      rc = pthread_detach(flushers[l].thread);
+      CHECK_PTHREAD_DETACH();
+    }
     rc = pthread_detach(thread_mgmt);
     CHECK_PTHREAD_DETACH();
     rc = pthread_detach(thread_flush);
     CHECK_PTHREAD_DETACH();
-    rc = pthread_detach(thread_queue);
-    CHECK_PTHREAD_DETACH();
     for (;;) { }
   } else {
     syslog(LOG_DEBUG, "Waiting for pthread termination");
-    pthread_join(thread_udp,   NULL);
+    for (l = 0; l < num_listeners; l++) {
+      pthread_join(listeners[l].thread_udp, NULL);
+    }
+    for (l = 0; l < num_workers; l++) {
+      pthread_join(workers[l].thread, NULL);
+    }
+    for (l = 1; l < num_flushers; l++) {
+      pthread_join(flushers[l].thread, NULL);
+    }
     pthread_join(thread_mgmt,  NULL);
     pthread_join(thread_flush, NULL);
-    pthread_join(thread_queue, NULL);
     syslog(LOG_DEBUG, "Pthreads terminated");
   }
 
   return 0;
 }
 
-void add_timer( char *key, double value ) {
-  statsd_timer_t *t;
-  HASH_FIND_STR( timers, key, t );
-  if (t) {
-    /* Add to old entry */
-    wait_for_timers_lock();
-    t->count++;
-    utarray_push_back(t->values, &value);
-    remove_timers_lock();
-  } else {
-    /* Create new entry */
-    t = malloc(sizeof(statsd_timer_t));
-
-    strcpy(t->key, key);
-    t->count = 1;
-    utarray_new(t->values, &timers_icd);
-    utarray_push_back(t->values, &value);
-
-    wait_for_timers_lock();
-    HASH_ADD_STR( timers, key, t );
-    remove_timers_lock();
-  }
-}
-
 /**
  * Record or update stat value.
  */
 void update_stat( char *group, char *key, char *value ) {
   syslog(LOG_DEBUG, "update_stat ( %s, %s, %s )\n", group, key, value);
   statsd_stat_t *s;
-  statsd_stat_name_t l;
-
-  memset(&l, 0, sizeof(statsd_stat_name_t));
-  strcpy(l.group_name, group);
-  strcpy(l.key_name, key);
-  syslog(LOG_DEBUG, "HASH_FIND '%s' '%s'\n", l.group_name, l.key_name);
-  HASH_FIND( hh, stats, &l, sizeof(statsd_stat_name_t), s );
-
-  if (s) {
-    syslog(LOG_DEBUG, "Updating old stat entry");
-
-#ifndef LOCK_OPTIMIZE
-    wait_for_stats_lock();
-#endif /* !LOCK_OPTIMIZE */
-    s->value = atol( value );
-#ifndef LOCK_OPTIMIZE
-    remove_stats_lock();
-#endif /* !LOCK_OPTIMIZE */
-  } else {
-    syslog(LOG_DEBUG, "Adding new stat entry");
-    s = malloc(sizeof(statsd_stat_t));
-    memset(s, 0, sizeof(statsd_stat_t));
-
-    strcpy(s->name.group_name, group);
-    strcpy(s->name.key_name, key);
-    s->value = atol(value);
-    s->locked = 0;
-
-    wait_for_stats_lock();
-    HASH_ADD( hh, stats, name, sizeof(statsd_stat_name_t), s );
-    remove_stats_lock();
-  }
-}
 
-void update_counter( char *key, double value, double sample_rate ) {
-  syslog(LOG_DEBUG, "update_counter ( %s, %f, %f )\n", key, value, sample_rate);
-  statsd_counter_t *c;
-  HASH_FIND_STR( counters, key, c );
-  if (c) {
-    syslog(LOG_DEBUG, "Updating old counter entry");
-    if (sample_rate == 0) {
-#ifndef LOCK_OPTIMIZE
-      wait_for_counters_lock();
-#endif /* !LOCK_OPTIMIZE */
-      c->value = c->value + value;
-#ifndef LOCK_OPTIMIZE
-      remove_counters_lock();
-#endif /* !LOCK_OPTIMIZE */
-    } else {
-#ifndef LOCK_OPTIMIZE
-      wait_for_counters_lock();
-#endif /* !LOCK_OPTIMIZE */
-      c->value = c->value + ( value * ( 1 / sample_rate ) );
-#ifndef LOCK_OPTIMIZE
-      remove_counters_lock();
-#endif /* !LOCK_OPTIMIZE */
-    }
-  } else {
-    syslog(LOG_DEBUG, "Adding new counter entry");
-    c = malloc(sizeof(statsd_counter_t));
-
-    strcpy(c->key, key);
-    c->value = 0;
-    if (sample_rate == 0) {
-      c->value = value;
-    } else {
-      c->value = value * ( 1 / sample_rate );
-    }
-
-    wait_for_counters_lock();
-    HASH_ADD_STR( counters, key, c );
-    remove_counters_lock();
-  }
-}
-
-void update_gauge_plusminus( char *key, double value, int plusminus ) {
-  syslog(LOG_DEBUG, "update_gauge %s, %f, %d, where 0 - value; 1 - subtract; 2 - add\n", key, value, plusminus);
-  statsd_gauge_t *g;
-  syslog(LOG_DEBUG, "HASH_FIND_STR '%s'\n", key);
-  HASH_FIND_STR( gauges, key, g );
-  syslog(LOG_DEBUG, "after HASH_FIND_STR '%s'\n", key);
-  if (g) {
-    syslog(LOG_DEBUG, "Updating old timer entry");
-#ifndef LOCK_OPTIMIZE
-    wait_for_gauges_lock();
-#endif /* !LOCK_OPTIMIZE */
-	if (plusminus < 1) g->value = value;
-	else if (plusminus < 2) g->value = g->value - value;
-	else if (plusminus < 3) g->value = g->value + value;
-	else syslog(LOG_ERR, "Error updating gauge!");
-#ifndef LOCK_OPTIMIZE
-    remove_gauges_lock();
-#endif /* !LOCK_OPTIMIZE */
-  } else {
-    syslog(LOG_DEBUG, "Adding new timer entry");
-    g = malloc(sizeof(statsd_gauge_t));
-
-    strcpy(g->key, key);
-	if (plusminus < 1) g->value = value;
-	else if (plusminus < 2) g->value = 0 - value;
-	else if (plusminus < 3) g->value = 0 + value;
-	else syslog(LOG_ERR, "Error updating gauge!");
-
-    wait_for_gauges_lock();
-    HASH_ADD_STR( gauges, key, g );
-    remove_gauges_lock();
-  }
-}
-
-void update_gauge( char *key, double value ) {
-  syslog(LOG_DEBUG, "update_gauge ( %s, %f )\n", key, value);
-  statsd_gauge_t *g;
-  syslog(LOG_DEBUG, "HASH_FIND_STR '%s'\n", key);
-  HASH_FIND_STR( gauges, key, g );
-  syslog(LOG_DEBUG, "after HASH_FIND_STR '%s'\n", key);
-  if (g) {
-    syslog(LOG_DEBUG, "Updating old timer entry");
-#ifndef LOCK_OPTIMIZE
-    wait_for_gauges_lock();
-#endif /* !LOCK_OPTIMIZE */
-    g->value = value;
-#ifndef LOCK_OPTIMIZE
-    remove_gauges_lock();
-#endif /* !LOCK_OPTIMIZE */
-  } else {
-    syslog(LOG_DEBUG, "Adding new timer entry");
-    g = malloc(sizeof(statsd_gauge_t));
-
-    strcpy(g->key, key);
-    g->value = value;
-
-    wait_for_gauges_lock();
-    HASH_ADD_STR( gauges, key, g );
-    remove_gauges_lock();
-  }
-}
-
-void update_timer( char *key, double value ) {
-  syslog(LOG_DEBUG, "update_timer ( %s, %f )\n", key, value);
-  statsd_timer_t *t;
-  syslog(LOG_DEBUG, "HASH_FIND_STR '%s'\n", key);
-  HASH_FIND_STR( timers, key, t );
-  syslog(LOG_DEBUG, "after HASH_FIND_STR '%s'\n", key);
-  if (t) {
-    syslog(LOG_DEBUG, "Updating old timer entry");
-#ifndef LOCK_OPTIMIZE
-    wait_for_timers_lock();
-#endif /* !LOCK_OPTIMIZE */
-    utarray_push_back(t->values, &value);
-    t->count++;
-#ifndef LOCK_OPTIMIZE
-    remove_timers_lock();
-#endif /* !LOCK_OPTIMIZE */
-  } else {
-    syslog(LOG_DEBUG, "Adding new timer entry");
-    t = malloc(sizeof(statsd_timer_t));
-
-    strcpy(t->key, key);
-    t->count = 0;
-    utarray_new(t->values, &timers_icd);
-    utarray_push_back(t->values, &value);
-    t->count++;
-
-    wait_for_timers_lock();
-    HASH_ADD_STR( timers, key, t );
-    remove_timers_lock();
-  }
+  /* Lookups happen under the lock too, several threads may add stats */
+  wait_for_stats_lock();
+  s = stat_get(group, key);
+  s->value = atol( value );
+  remove_stats_lock();
 }
 
 void dump_stats() {
@@ -625,241 +716,144 @@ void dump_stats() {
     {
       syslog(LOG_DEBUG, "Stats dump:");
       statsd_stat_t *s, *tmp;
+      wait_for_stats_lock();
       HASH_ITER(hh, stats, s, tmp) {
-        syslog(LOG_DEBUG, "%s.%s: %ld", s->name.group_name, s->name.key_name, s->value);
+        syslog(LOG_DEBUG, "%s.%s: %ld", s->group_name, s->key_name, s->value);
       }
-      if (s) free(s);
-      if (tmp) free(tmp);
+      remove_stats_lock();
     }
 
     {
       syslog(LOG_DEBUG, "Counters dump:");
-      statsd_counter_t *c, *tmp;
-      HASH_ITER(hh, counters, c, tmp) {
-        syslog(LOG_DEBUG, "%s: %Lf", c->key, c->value);
+      statsd_counter_t *c;
+      uint32_t id;
+      IDTABLE_ITER(&counters, id, c) {
+        syslog(LOG_DEBUG, "%s: %Lf", c->key->name, c->value);
       }
-      if (c) free(c);
-      if (tmp) free(tmp);
     }
 
     {
       syslog(LOG_DEBUG, "Gauges dump:");
-      statsd_gauge_t *g, *tmp;
-      HASH_ITER(hh, gauges, g, tmp) {
-        syslog(LOG_DEBUG, "%s: %Lf", g->key, g->value);
+      statsd_gauge_t *g;
+      uint32_t id;
+      IDTABLE_ITER(&gauges, id, g) {
+        syslog(LOG_DEBUG, "%s: %Lf", g->key->name, g->value);
       }
-      if (g) free(g);
-      if (tmp) free(tmp);
     }
   }
 }
 
-void process_json_stats_packet(char buf_in[]) {
-  if (strlen(buf_in) < 2) {
-    UPDATE_LAST_MSG_SEEN()
-    return;
-  }
-
-  json_object *obj = json_tokener_parse(&buf_in[0]);
-  if (!obj) {
-    syslog(LOG_ERR, "Bad JSON object, skipping");
-    return;
-  }
+long monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
 
-  if (json_object_get_type(obj) == json_type_object) {
-    syslog(LOG_DEBUG, "Processing single stats object");
-    process_json_stats_object(obj);
-  } else if (json_object_get_type(obj) == json_type_array) {
-    int i;
-    for (i=0; i<json_object_array_length(obj); i++) {
-      syslog(LOG_DEBUG, "Iterating through objects at pos %d", i);
-      process_json_stats_object(json_object_array_get_idx(obj, i));
-    }
-  } else {
-    syslog(LOG_ERR, "Bad JSON data presented");
+/**
+ * Merge every worker's local aggregation map into the global tables.
+ * Workers only stall for the pointer swap; the retired map is merged
+ * after their lock is dropped. Returns the longest a single swap took,
+ * in microseconds.
+ */
+long collect_aggregates() {
+  long pause, max_pause = 0;
+  int w;
+
+  /* A second collector could swap a map back in while we merge it */
+  sem_wait(&merge_lock);
+  for (w = 0; workers != NULL && w < num_workers; w++) {
+    statsd_agg_t *retired;
+
+    pause = monotonic_usec();
+    pthread_mutex_lock( &workers[w].agg_lock );
+    retired = workers[w].active;
+    workers[w].active = retired == &workers[w].agg[0] ? &workers[w].agg[1] : &workers[w].agg[0];
+    pthread_mutex_unlock( &workers[w].agg_lock );
+    pause = monotonic_usec() - pause;
+    if (pause > max_pause) max_pause = pause;
+
+    agg_merge( retired );
   }
+  sem_post(&merge_lock);
+  return max_pause;
 }
 
-void process_json_stats_object(json_object *sobj) {
-  syslog(LOG_INFO, "Processing stat %s", json_object_to_json_string(sobj));
+/**
+ * Publish counters kept outside of the stats table (by the listener
+ * threads, mostly) so that they show up in "stats" and are persisted.
+ */
+void update_internal_stats() {
+  long recv_calls = 0, packets = 0, drops = 0;
+  int l;
 
-  json_object *timer_obj = json_object_object_get(sobj, "timer");
-  json_object *counter_obj = json_object_object_get(sobj, "counter");
+  UPDATE_STAT_LONG( "messages", "last_msg_seen", last_msg_seen );
+  UPDATE_STAT_LONG( "messages", "bad_lines_seen", atomic_load(&bad_lines_seen) );
 
-  if (timer_obj && counter_obj) {
-    syslog(LOG_ERR, "Can't specify both timer and counter in same object");
-    return;
+  {
+    statsd_key_rejects_t r;
+    keys_rejects(&r);
+    UPDATE_STAT_LONG( "keys", "count", r.keys );
+    UPDATE_STAT_LONG( "keys", "rejected_max_keys", r.rejected_max_keys );
+    UPDATE_STAT_LONG( "keys", "rejected_prefix", r.rejected_prefix );
+    UPDATE_STAT_LONG( "keys", "rejected_other", r.rejected_other );
+    UPDATE_STAT_LONG( "keys", "rejected_memory", r.rejected_memory );
+    UPDATE_STAT_LONG( "keys", "overflowed", r.overflowed );
   }
 
-  if (timer_obj) {
-    json_object *value_obj = json_object_object_get(sobj, "value");
-
-    if (!timer_obj || !value_obj) {
-      syslog(LOG_ERR, "Could not process, requires timer && value attributes");
-      return;
-    }
-
-    char *key_name = (char *) json_object_get_string(timer_obj);
-    sanitize_key(key_name);
-    double value = json_object_get_double(value_obj);
-
-    update_timer(key_name, value);
-  } else if (counter_obj) {
-    json_object *value_obj = json_object_object_get(sobj, "value");
-    json_object *sample_rate_obj = json_object_object_get(sobj, "sample_rate");
-
-    if (!counter_obj || !value_obj) {
-      syslog(LOG_ERR, "Could not process, requires counter && value attributes");
-      return;
-    }
-
-    char *key_name = (char *) json_object_get_string(counter_obj);
-    sanitize_key(key_name);
-    double value = json_object_get_double(value_obj);
-    double sample_rate = sample_rate_obj ? json_object_get_double(sample_rate_obj) : 0;
-
-    update_counter(key_name, value, sample_rate);
+  for (l = 0; l < num_listeners; l++) {
+    char group[32];
+    sprintf(group, "listener_%d", l);
+    UPDATE_STAT_LONG( group, "packets", listeners[l].packets );
+    UPDATE_STAT_LONG( group, "queue_drops", listeners[l].queue_drops );
+    UPDATE_STAT_LONG( group, "pool_drops", listeners[l].pool_drops );
+    UPDATE_STAT_LONG( group, "kernel_drops", listeners[l].kernel_drops );
+
+    recv_calls += listeners[l].recv_calls;
+    packets += listeners[l].packets;
+    drops += listeners[l].queue_drops + listeners[l].pool_drops + listeners[l].kernel_drops;
   }
-}
-
-void process_stats_packet(char buf_in[]) {
-  char *key_name = NULL;
 
-  if (strlen(buf_in) < 2) {
-    UPDATE_LAST_MSG_SEEN()
-    return;
+  UPDATE_STAT_LONG( "udp", "recv_calls", recv_calls );
+  UPDATE_STAT_LONG( "udp", "packets_received", packets );
+  UPDATE_STAT_LONG( "udp", "packets_dropped", drops );
+  UPDATE_STAT_LONG( "udp", "avg_batch_fill", recv_calls > 0 ? ( packets + recv_calls / 2 ) / recv_calls : 0 );
+
+  for (l = 0; l < num_workers; l++) {
+    char group[32];
+    statsd_queue_stats_t qs;
+    sprintf(group, "queue_%d", l);
+    queue_get_stats(&workers[l].queue, &qs);
+    UPDATE_STAT_LONG( group, "enqueued", qs.enqueued );
+    UPDATE_STAT_LONG( group, "dequeued", qs.dequeued );
+    UPDATE_STAT_LONG( group, "dropped", qs.dropped );
+    UPDATE_STAT_LONG( group, "high_water", qs.high_water );
+    UPDATE_STAT_LONG( group, "wakeups", qs.wakeups );
   }
 
-  char *save, *subsave, *token, *subtoken, *bits, *fields, *charvalue;
-  double value = 1.0;
-
-  int i;
-  for (i = 1, bits=&buf_in[0]; ; i++, bits=NULL) {
-    syslog(LOG_DEBUG, "i = %d\n", i);
-    token = strtok_r(bits, ":", &save);
-    if (token == NULL) { break; }
-    if (i == 1) {
-      syslog(LOG_DEBUG, "Found token '%s', key name\n", token);
-      key_name = strdup( token );
-      sanitize_key(key_name);
-      /* break; */
-    } else {
-      syslog(LOG_DEBUG, "\ttoken [#%d] = %s\n", i, token);
-      char *s_sample_rate = NULL, *s_number = NULL;
-      double sample_rate = 1.0;
-      bool is_timer = 0, is_gauge = 0;
-
-      if (strstr(token, "|") == NULL) {
-        syslog(LOG_DEBUG, "No pipes found, basic logic");
-        sanitize_value(token);
-        syslog(LOG_DEBUG, "\t\tvalue = %s\n", token);
-        value = strtod(token, (char **) NULL);
-        syslog(LOG_DEBUG, "\t\tvalue = %s => %f\n", token, value);
-      } else {
-        int j;
-        for (j = 1, fields = token; ; j++, fields = NULL) {
-          subtoken = strtok_r(fields, "|", &subsave);
-          if (subtoken == NULL) { break; }
-          syslog(LOG_DEBUG, "\t\tsubtoken = %s\n", subtoken);
-          switch (j) {
-            case 1:
-              syslog(LOG_DEBUG, "case 1");
-/*              printf("case 1 subtoken przed sanitize:\t%s\n", subtoken);
-              sanitize_value(subtoken);
-              printf("case 1 subtoken po sanitize:\t%s\n", subtoken);
-              value = strtod(subtoken, (char **) NULL);*/
-              sanitize_gaugevalue(subtoken);
-//              charvalue = (char*)malloc(strlen(subtoken) + 1);
-//              strcpy (charvalue,subtoken);
-              charvalue = strdup(subtoken);
-              break;
-            case 2:
-              syslog(LOG_DEBUG, "case 2");
-              if (subtoken == NULL) { break ; }
-              if (strlen(subtoken) < 2) {
-                syslog(LOG_DEBUG, "subtoken length < 2");
-                is_timer = 0;
-                if (*subtoken == 'g') {
-                  is_gauge = 1;
-                }
-              } else {
-                syslog(LOG_DEBUG, "subtoken length >= 2");
-                if (*subtoken == 'm' && *(subtoken + 1) == 's') {
-                  is_timer = 1;
-                  is_gauge = 0;
-                }
-              }
-              break;
-            case 3:
-              syslog(LOG_DEBUG, "case 3");
-              if (subtoken == NULL) { break ; }
-              s_sample_rate = strdup(subtoken);
-              break;
-          }
-        }
-      }
-
-      syslog(LOG_DEBUG, "Post token processing");
-
-      if (is_timer == 1) {
-        /* ms passed, handle timer */
-        sanitize_value(charvalue);
-        value = strtod(charvalue, (char **) NULL);
-        update_timer( key_name, value );
-      } else if (is_gauge == 1) {
-        /* Handle non-timer, as gauge */
-        syslog(LOG_DEBUG, "Found gauge key name '%s'\n", key_name);
-        syslog(LOG_DEBUG, "Found gauge value '%f'\n", value);
-        if (*charvalue == '-') {
-			charvalue++;
-			sanitize_value(charvalue);
-			value = strtod(charvalue, (char **) NULL);
-			update_gauge_plusminus(key_name, value, 1);
-			charvalue--;
-			free(charvalue);
-		}
-		else if (*charvalue == '+') {
-			charvalue++;
-			sanitize_value(charvalue);
-			value = strtod(charvalue, (char **) NULL);
-			update_gauge_plusminus(key_name, value, 2);
-			charvalue--;
-			free(charvalue);
-		}
-		else {
-			sanitize_value(charvalue);
-			value = strtod(charvalue, (char **) NULL);
-			update_gauge_plusminus(key_name, value, 0);
-			free(charvalue);
-		}
-      } else {
-        if (s_sample_rate && *s_sample_rate == '@') {
-        /* Handle non-timer, as counter */
-          sample_rate = strtod( (s_sample_rate + 1), (char **) NULL );
-        }
-        sanitize_value(charvalue);
-        value = strtod(charvalue, (char **) NULL);
-        update_counter(key_name, value, sample_rate);
-        syslog(LOG_DEBUG, "Found key name '%s'\n", key_name);
-        syslog(LOG_DEBUG, "Found value '%f'\n", value);
-      }
-      if (s_sample_rate) free(s_sample_rate);
-      if (s_number) free(s_number);
+  {
+    statsd_slab_t *slab;
+    long agg_reserved = 0;
+    size_t key_used, key_reserved;
+
+    for (slab = slab_list; slab != NULL; slab = slab->next) {
+      char group[48];
+      sprintf(group, "slab_%s", slab->name);
+      UPDATE_STAT_LONG( group, "in_use", slab->in_use );
+      UPDATE_STAT_LONG( group, "capacity", slab->capacity );
+      UPDATE_STAT_LONG( group, "bytes", slab->num_pages * SLAB_PAGE_SIZE );
     }
-  }
-  i--; /* For ease */
 
-  syslog(LOG_DEBUG, "After loop, i = %d, value = %f", i, value);
+    for (l = 0; l < num_workers; l++) {
+      agg_reserved += workers[l].agg[0].arena.reserved + workers[l].agg[1].arena.reserved;
+    }
+    UPDATE_STAT_LONG( "arena", "timer_bytes_used", timer_arena->used );
+    UPDATE_STAT_LONG( "arena", "timer_bytes_reserved", timer_arenas[0].reserved + timer_arenas[1].reserved );
+    UPDATE_STAT_LONG( "arena", "worker_bytes_reserved", agg_reserved );
 
-  if (i <= 1) {
-    /* No value, assign "1" and process */
-    update_counter(key_name, value, 1);
+    key_used = keys_bytes(&key_reserved);
+    UPDATE_STAT_LONG( "arena", "key_bytes_used", key_used );
+    UPDATE_STAT_LONG( "arena", "key_bytes_reserved", key_reserved );
   }
-
-  syslog(LOG_DEBUG, "freeing key and value");
-  if (key_name) free(key_name);
-
-  UPDATE_LAST_MSG_SEEN()
 }
 
 /*
@@ -867,42 +861,75 @@ void process_stats_packet(char buf_in[]) {
  */
 
 void p_thread_udp(void *ptr) {
-  syslog(LOG_INFO, "Thread[Udp]: Starting thread %d\n", (int) *((int *) ptr));
-    struct sockaddr_in si_me, si_other;
+  statsd_listener_t *listener = (statsd_listener_t *) ptr;
+  syslog(LOG_INFO, "Thread[Udp]: Starting listener %d\n", listener->id);
+    struct sockaddr_in si_me;
     fd_set read_flags,write_flags;
     struct timeval waitd;
-    int stat;
+    int stat, b;
+    int sock;
 
     /* begin udp listener */
 
-    if ((stats_udp_socket=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))==-1)
+    if ((sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))==-1)
       die_with_error("UDP: Could not grab socket.");
+    listener->socket = sock;
 
     /* Reuse socket, please */
     int on = 1;
-    setsockopt(stats_udp_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    /* Let the kernel spread incoming flows across all listeners */
+    if (num_listeners > 1) {
+      if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        die_with_error("UDP: Could not set SO_REUSEPORT");
+    }
+#endif
+#ifdef SO_RXQ_OVFL
+    /* Ask for the socket's drop count alongside each datagram */
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
 
     /* Use non-blocking sockets */
-    int flags = fcntl(stats_udp_socket, F_GETFL, 0);
-    fcntl(stats_udp_socket, F_SETFL, flags | O_NONBLOCK);
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
 
     memset((char *) &si_me, 0, sizeof(si_me));
     si_me.sin_family = AF_INET;
     si_me.sin_port = htons(port);
     si_me.sin_addr.s_addr = htonl(INADDR_ANY);
     syslog(LOG_DEBUG, "UDP: Binding to socket.");
-    if (bind(stats_udp_socket, (struct sockaddr *)&si_me, sizeof(si_me))==-1)
+    if (bind(sock, (struct sockaddr *)&si_me, sizeof(si_me))==-1)
         die_with_error("UDP: Could not bind");
-    syslog(LOG_DEBUG, "UDP: Bound to socket on port %d", port);
+    syslog(LOG_DEBUG, "UDP: Listener %d bound to socket on port %d", listener->id, port);
+
+    /*
+     * Datagrams are received straight into pool buffers, which are then
+     * handed to the worker as they are. Slots of the batch are refilled
+     * from the pool as their packets are queued.
+     */
+    statsd_packet_t **batch = calloc(udp_batch_size, sizeof(statsd_packet_t *));
+    char *scratch = malloc(BUFLEN);
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr *msgs = calloc(udp_batch_size, sizeof(struct mmsghdr));
+    struct iovec *iovecs = calloc(udp_batch_size, sizeof(struct iovec));
+#ifdef SO_RXQ_OVFL
+    char *cmsgbufs = calloc(udp_batch_size, CMSG_SPACE(sizeof(uint32_t)));
+#endif
+    for (b = 0; b < udp_batch_size; b++) {
+      msgs[b].msg_hdr.msg_iov = &iovecs[b];
+      msgs[b].msg_hdr.msg_iovlen = 1;
+    }
+#endif
 
     while (1) {
       waitd.tv_sec = 1;
       waitd.tv_usec = 0;
       FD_ZERO(&read_flags);
       FD_ZERO(&write_flags);
-      FD_SET(stats_udp_socket, &read_flags);
+      FD_SET(sock, &read_flags);
 
-      stat = select(stats_udp_socket+1, &read_flags, &write_flags, (fd_set*)0, &waitd);
+      stat = select(sock+1, &read_flags, &write_flags, (fd_set*)0, &waitd);
       /* If we can't do anything for some reason, wait a bit */
       if (stat < 0) {
         syslog(LOG_INFO, "Can't do anything, stat == %d", stat);
@@ -910,57 +937,143 @@ void p_thread_udp(void *ptr) {
         continue;
       }
 
-      char buf_in[BUFLEN];
-      if (FD_ISSET(stats_udp_socket, &read_flags)) {
-        FD_CLR(stats_udp_socket, &read_flags);
-        memset(&buf_in, 0, sizeof(buf_in));
-        if (read(stats_udp_socket, buf_in, sizeof(buf_in)) <= 0) {
-          close(stats_udp_socket);
-          break;
+      if (!FD_ISSET(sock, &read_flags)) {
+        continue;
+      }
+      FD_CLR(sock, &read_flags);
+
+      /* Drain the socket, a full batch at a time, until it would block */
+      int received, vlen;
+      do {
+        for (vlen = 0; vlen < udp_batch_size; vlen++) {
+          if (batch[vlen] == NULL && (batch[vlen] = pool_acquire(&listener->pool)) == NULL) break;
         }
-        /* make sure that the buf_in is NULL terminated */
-        buf_in[BUFLEN - 1] = 0;
 
-        syslog(LOG_DEBUG, "UDP: Received packet from %s:%d\nData: %s\n\n",
-            inet_ntoa(si_other.sin_addr), ntohs(si_other.sin_port), buf_in);
+        if (vlen == 0) {
+          /* Every buffer is still queued, keep the socket drained anyway */
+          if (read(sock, scratch, BUFLEN) < 0) break;
+          listener->pool_drops++;
+          received = 0;
+          continue;
+        }
 
-        char *packet = strdup(buf_in);
-        syslog(LOG_DEBUG, "UDP: Storing packet in queue");
-        queue_store( packet );
-        syslog(LOG_DEBUG, "UDP: Stored packet in queue");
-      }
+#ifdef HAVE_RECVMMSG
+        for (b = 0; b < vlen; b++) {
+          /* Leave room for the NULL terminator */
+          iovecs[b].iov_base = batch[b]->data;
+          iovecs[b].iov_len = listener->pool.buflen - 1;
+#ifdef SO_RXQ_OVFL
+          msgs[b].msg_hdr.msg_control = cmsgbufs + b * CMSG_SPACE(sizeof(uint32_t));
+          msgs[b].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+#endif
+        }
+        received = recvmmsg(sock, msgs, vlen, MSG_DONTWAIT, NULL);
+#else
+        received = 0;
+        while (received < vlen) {
+          ssize_t len = read(sock, batch[received]->data, listener->pool.buflen - 1);
+          if (len < 0) break;
+          batch[received]->len = len;
+          received++;
+        }
+        if (received == 0) received = -1;
+#endif
+        if (received < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+          syslog(LOG_ERR, "UDP: Receive failed: %s", strerror(errno));
+          goto udp_done;
+        }
+
+        listener->recv_calls++;
+        listener->packets += received;
+
+        for (b = 0; b < received; b++) {
+          statsd_packet_t *packet = batch[b];
+#ifdef HAVE_RECVMMSG
+          packet->len = msgs[b].msg_len;
+#ifdef SO_RXQ_OVFL
+          struct cmsghdr *cmsg;
+          for (cmsg = CMSG_FIRSTHDR(&msgs[b].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[b].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+              listener->kernel_drops = *(uint32_t *) CMSG_DATA(cmsg);
+            }
+          }
+#endif
+#endif
+          /* make sure that the buffer is NULL terminated */
+          packet->data[packet->len] = 0;
+
+          if (queue_store( listener->queue, packet )) {
+            batch[b] = NULL;
+          } else {
+            /* Keep the buffer in the batch, it gets received into again */
+            listener->queue_drops++;
+          }
+        }
+        queue_notify( listener->queue );
+      } while (received == vlen);
     }
 
-    if (stats_udp_socket) close(stats_udp_socket);
+udp_done:
+    close(sock);
+    listener->socket = 0;
+
+    for (b = 0; b < udp_batch_size; b++) {
+      if (batch[b] != NULL) pool_release(batch[b]);
+    }
+    free(batch);
+    free(scratch);
+#ifdef HAVE_RECVMMSG
+    free(msgs);
+    free(iovecs);
+#ifdef SO_RXQ_OVFL
+    free(cmsgbufs);
+#endif
+#endif
 
     /* end udp listener */
-  syslog(LOG_INFO, "Thread[Udp]: Ending thread %d\n", (int) *((int *) ptr));
+  syslog(LOG_INFO, "Thread[Udp]: Ending listener %d\n", listener->id);
   pthread_exit(0);
 }
 
 void p_thread_queue(void *ptr) {
-  syslog(LOG_INFO, "Thread[Queue]: Starting thread %d\n", (int) *((int *) ptr));
+  statsd_worker_t *worker = (statsd_worker_t *) ptr;
+  syslog(LOG_INFO, "Thread[Queue]: Starting worker %d\n", worker->id);
 
+  thread_idle_end();
+  pthread_cleanup_push(thread_stopped, NULL);
   while (1) {
-    char *packet = queue_pop_first();
-    while (packet != NULL) {
-      char buf_in[BUFLEN];
-      memset(&buf_in, 0, sizeof(buf_in));
-      strcpy(buf_in, packet);
-
-      if (buf_in[0] == '{' || buf_in[0] == '[') {
-        syslog(LOG_DEBUG, "Queue: Processing as JSON packet");
-        process_json_stats_packet(buf_in);
+    statsd_packet_t *packet = queue_pop_first( &worker->queue );
+    int n;
+
+    if (packet == NULL) {
+      /* Spin briefly, then sleep until a listener hands us packets */
+      thread_idle_begin();
+      queue_wait( &worker->queue );
+      thread_idle_end();
+      continue;
+    }
+
+    /*
+     * Hold our aggregation map for a batch of packets at a time; the
+     * lock is only ever contended while a merge is running.
+     */
+    pthread_mutex_lock( &worker->agg_lock );
+    for (n = 0; packet != NULL; ) {
+      /* Parsed in place, the buffer goes back to its listener afterwards */
+      if (packet->data[0] == '{' || packet->data[0] == '[') {
+        process_json_stats_packet(worker->active, packet->data);
       } else {
-        syslog(LOG_DEBUG, "Queue: Processing as standard packet");
-        process_stats_packet(buf_in);
+        process_stats_packet(worker->active, packet->data, packet->len);
       }
-      packet = queue_pop_first();
+      pool_release(packet);
+      packet = ++n < WORKER_BATCH ? queue_pop_first( &worker->queue ) : NULL;
     }
-    sleep(1);
+    pthread_mutex_unlock( &worker->agg_lock );
   }
+  pthread_cleanup_pop(1);
 
-  syslog(LOG_INFO, "Thread[Queue]: Ending thread %d\n", (int) *((int *) ptr));
+  syslog(LOG_INFO, "Thread[Queue]: Ending worker %d\n", worker->id);
   pthread_exit(0);
 }
 
@@ -979,6 +1092,7 @@ void p_thread_mgmt(void *ptr) {
   int yes = 1;
   int addrlen;
   int i;
+  int rc;
 
   FD_ZERO(&master);
   FD_ZERO(&read_fds);
@@ -1013,10 +1127,15 @@ void p_thread_mgmt(void *ptr) {
   FD_SET(stats_mgmt_socket, &master);
   fdmax = stats_mgmt_socket;
 
+  thread_idle_end();
+  pthread_cleanup_push(thread_stopped, NULL);
   for(;;) {
     read_fds = master;
 
-    if(select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1) {
+    thread_idle_begin();
+    rc = select(fdmax+1, &read_fds, NULL, NULL, NULL);
+    thread_idle_end();
+    if(rc == -1) {
       perror("select error");
       exit(1);
     }
@@ -1056,59 +1175,137 @@ void p_thread_mgmt(void *ptr) {
               if (friendly) { STREAM_SEND(i, MGMT_PROMPT) }
             } else if (strncasecmp(bufptr, (char *)"counters", 8) == 0) {
               /* send counters */
-
-              statsd_counter_t *s_counter, *tmp;
-              HASH_ITER(hh, counters, s_counter, tmp) {
-                STREAM_SEND(i, s_counter->key)
+              collect_aggregates();
+
+              statsd_counter_t *s_counter;
+              uint32_t id;
+              IDTABLE_ITER(&counters, id, s_counter) {
+                /* Look it up again under the lock, it may have expired */
+                statsd_key_t *key = key_by_id(id);
+                long double value = 0;
+                wait_for_counters_lock(key);
+                if ((s_counter = idtable_get(&counters, id)) != NULL) value = s_counter->value;
+                remove_counters_lock(key);
+                if (s_counter == NULL) continue;
+                STREAM_SEND(i, key->name)
                 STREAM_SEND(i, ": ")
-                STREAM_SEND_LONG_DOUBLE(i, s_counter->value)
+                STREAM_SEND_LONG_DOUBLE(i, value)
                 STREAM_SEND(i, "\n")
               }
-              if (s_counter) free(s_counter);
-              if (tmp) free(tmp);
 
               STREAM_SEND(i, MGMT_END)
               if (friendly) { STREAM_SEND(i, MGMT_PROMPT) }
             } else if (strncasecmp(bufptr, (char *)"timers", 6) == 0) {
               /* send timers */
-
-              statsd_timer_t *s_timer, *tmp;
-              HASH_ITER(hh, timers, s_timer, tmp) {
-                STREAM_SEND(i, s_timer->key)
+              collect_aggregates();
+
+              statsd_timer_t *s_timer;
+              uint32_t id;
+              IDTABLE_ITER(&timers, id, s_timer) {
+                /* Look it up again under the lock, it may have expired */
+                statsd_key_t *key = key_by_id(id);
+                wait_for_timers_lock(key);
+                if ((s_timer = idtable_get(&timers, id)) == NULL) {
+                  remove_timers_lock(key);
+                  continue;
+                }
+                STREAM_SEND(i, key->name)
                 STREAM_SEND(i, ": ")
                 STREAM_SEND_INT(i, s_timer->count)
-                if (s_timer->count > 0) {
-                  double *j = NULL; bool first = 1;
+                /* Sketched timers have no samples to list */
+                if (s_timer->count > 0 && s_timer->values) {
+                  int j; bool first = 1;
                   STREAM_SEND(i, " [")
-                  while( (j=(double *)utarray_next(s_timer->values, j)) ) {
+                  for (j = 0; j < s_timer->count; j++) {
                     if (first == 1) { first = 0; STREAM_SEND(i, ",") }
-                    STREAM_SEND_DOUBLE(i, *j)
+                    STREAM_SEND_DOUBLE(i, s_timer->values[j])
                   }
                   STREAM_SEND(i, "]")
                 }
                 STREAM_SEND(i, "\n")
+                remove_timers_lock(key);
+              }
+
+              STREAM_SEND(i, MGMT_END)
+              if (friendly) { STREAM_SEND(i, MGMT_PROMPT) }
+            } else if (strncasecmp(bufptr, (char *)"sets", 4) == 0) {
+              /* send the distinct values counted so far this interval */
+              collect_aggregates();
+
+              statsd_set_t *s_set;
+              uint32_t id;
+              IDTABLE_ITER(&sets, id, s_set) {
+                /* Look it up again under the lock, it may have expired */
+                statsd_key_t *key = key_by_id(id);
+                long count = 0;
+                wait_for_sets_lock(key);
+                if ((s_set = idtable_get(&sets, id)) != NULL && s_set->hll) count = llround(hll_count(s_set->hll));
+                remove_sets_lock(key);
+                if (s_set == NULL) continue;
+                STREAM_SEND(i, key->name)
+                STREAM_SEND(i, ": ")
+                STREAM_SEND_LONG(i, count)
+                STREAM_SEND(i, "\n")
+              }
+
+              STREAM_SEND(i, MGMT_END)
+              if (friendly) { STREAM_SEND(i, MGMT_PROMPT) }
+            } else if (strncasecmp(bufptr, (char *)"keys", 4) == 0) {
+              /* send key counts, limits and the prefixes hitting them */
+              statsd_key_rejects_t r;
+              statsd_key_prefix_t top[MGMT_TOP_PREFIXES];
+              int n, j;
+
+              keys_rejects(&r);
+              STREAM_SEND(i, "count: ")
+              STREAM_SEND_LONG(i, r.keys)
+              STREAM_SEND(i, "\nmax_keys: ")
+              STREAM_SEND_LONG(i, (long) max_keys)
+              STREAM_SEND(i, "\nmax_keys_per_prefix: ")
+              STREAM_SEND_LONG(i, (long) max_keys_per_prefix)
+              STREAM_SEND(i, "\nrejected_max_keys: ")
+              STREAM_SEND_LONG(i, r.rejected_max_keys)
+              STREAM_SEND(i, "\nrejected_prefix: ")
+              STREAM_SEND_LONG(i, r.rejected_prefix)
+              STREAM_SEND(i, "\nrejected_other: ")
+              STREAM_SEND_LONG(i, r.rejected_other)
+              STREAM_SEND(i, "\noverflowed: ")
+              STREAM_SEND_LONG(i, r.overflowed)
+              STREAM_SEND(i, "\nrejected_memory: ")
+              STREAM_SEND_LONG(i, r.rejected_memory)
+              STREAM_SEND(i, "\n")
+              n = keys_top_prefixes(top, MGMT_TOP_PREFIXES);
+              for (j = 0; j < n; j++) {
+                STREAM_SEND(i, "prefix ")
+                STREAM_SEND(i, top[j].name)
+                STREAM_SEND(i, ": ")
+                STREAM_SEND_LONG(i, top[j].keys)
+                STREAM_SEND(i, " keys, ")
+                STREAM_SEND_LONG(i, top[j].rejected)
+                STREAM_SEND(i, " rejected\n")
               }
-              if (s_timer) free(s_timer);
-              if (tmp) free(tmp);
 
               STREAM_SEND(i, MGMT_END)
               if (friendly) { STREAM_SEND(i, MGMT_PROMPT) }
             } else if (strncasecmp(bufptr, (char *)"stats", 5) == 0) {
               /* send stats */
+              update_internal_stats();
 
+              /* Format under the lock, send after it, so a slow client
+               * never holds up update_stat() */
               statsd_stat_t *s_stat, *tmp;
+              UT_string *reply;
+              utstring_new(reply);
+              wait_for_stats_lock();
               HASH_ITER(hh, stats, s_stat, tmp) {
-                if (strlen(s_stat->name.group_name) > 1) {
-                  STREAM_SEND(i, s_stat->name.group_name)
-                  STREAM_SEND(i, ".")
+                if (strlen(s_stat->group_name) > 1) {
+                  utstring_printf(reply, "%s.", s_stat->group_name);
                 }
-                STREAM_SEND(i, s_stat->name.key_name)
-                STREAM_SEND(i, ": ")
-                STREAM_SEND_LONG(i, s_stat->value)
-                STREAM_SEND(i, "\n")
+                utstring_printf(reply, "%s: %ld\n", s_stat->key_name, s_stat->value);
               }
-              if (s_stat) free(s_stat);
-              if (tmp) free(tmp);
+              remove_stats_lock();
+              STREAM_SEND(i, utstring_body(reply))
+              utstring_free(reply);
 
               STREAM_SEND(i, MGMT_END)
               if (friendly) { STREAM_SEND(i, MGMT_PROMPT) }
@@ -1125,6 +1322,7 @@ void p_thread_mgmt(void *ptr) {
       }
     }
   }
+  pthread_cleanup_pop(1);
 
   /* end mgmt listener */
 
@@ -1132,209 +1330,285 @@ void p_thread_mgmt(void *ptr) {
   pthread_exit(0);
 }
 
-void p_thread_flush(void *ptr) {
-  syslog(LOG_INFO, "Thread[Flush]: Starting thread %d\n", (int) *((int *) ptr));
-
-  while (1) {
-    THREAD_SLEEP(flush_interval);
+/*
+ * Formatting of a single snapshot entry: graphite lines are appended
+ * through lines, ganglia metrics are queued on gbatch.
+ */
 
-    gmetric_t gm;
+void flush_counter(statsd_counter_t *s_counter, statsd_lines_t *lines, statsd_ganglia_batch_t *gbatch) {
+  long double value = s_counter->value / flush_interval;
+  if (enable_graphite) {
+    lines_stem(lines, "stats.", s_counter->key, "");
+    lines_add(lines, "", (double) value);
+    lines_stem(lines, "stats_counts_", s_counter->key, "");
+    lines_add(lines, "", (double) s_counter->value);
+  }
+  if (enable_gmetric) {
+    {
+      char *k = NULL;
+      if (ganglia_metric_prefix != NULL) {
+        k = malloc(strlen(s_counter->key->name) + strlen(ganglia_metric_prefix) + 1);
+        sprintf(k, "%s%s", ganglia_metric_prefix, s_counter->key->name);
+      } else {
+        k = strdup(s_counter->key->name);
+      }
+      SEND_GMETRIC_DOUBLE(k, k, value, "count");
+      if (k) free(k);
+    }
+    {
+      SEND_GMETRIC_DOUBLE(s_counter->key->name, s_counter->key->name, s_counter->value, "count");
+    }
+  }
+}
 
-    dump_stats();
+void flush_timer(statsd_timer_t *s_timer, statsd_lines_t *lines, statsd_ganglia_batch_t *gbatch) {
+  if (s_timer->count > 0) {
+    statsd_timer_summary_t summary;
+    double upper[STATSD_MAX_PERCENTILES];
+    int p;
+
+    if (s_timer->sketch) {
+      summary.min = s_timer->sketch->min;
+      summary.max = s_timer->sketch->max;
+      summary.sum = s_timer->sketch->sum;
+      summary.mean = s_timer->sketch->mean;
+      summary.stddev = sqrt(s_timer->sketch->m2 / s_timer->sketch->count);
+      for (p = 0; p < num_percentiles; p++) {
+        upper[p] = sketch_quantile(s_timer->sketch, percentiles[p].value / 100);
+      }
+    } else {
+      double *values = s_timer->values;
+      int ranks[STATSD_MAX_PERCENTILES];
 
-    if (enable_gmetric) {
-      gmetric_create(&gm);
-      if (!gmetric_open(&gm, ganglia_host, ganglia_port)) {
-        syslog(LOG_ERR, "Unable to connect to ganglia host %s:%d", ganglia_host, ganglia_port);
-        enable_gmetric = 0;
+      timer_summarize(values, s_timer->count, &summary);
+      for (p = 0; p < num_percentiles; p++) {
+        ranks[p] = percentile_rank(percentiles[p].value, s_timer->count);
       }
+      select_ranks(values, s_timer->count, ranks, num_percentiles, upper);
     }
 
-    long ts = time(NULL);
-    char *ts_string = ltoa(ts);
-    int numStats = 0;
-    UT_string *statString;
+    if (enable_graphite) {
+      lines_stem(lines, "stats.timers.", s_timer->key, ".");
+      lines_add(lines, "mean", summary.mean);
+      lines_add(lines, "upper", summary.max);
+      lines_add(lines, "lower", summary.min);
+      lines_add(lines, "sum", summary.sum);
+      lines_add(lines, "std", summary.stddev);
+      lines_add_long(lines, "count", s_timer->count);
+      for (p = 0; p < num_percentiles; p++) {
+        lines_add(lines, percentiles[p].upper, upper[p]);
+      }
+    }
 
-    utstring_new(statString);
+    if (enable_gmetric) {
+      {
+        // Mean value. Convert to seconds
+        char k[strlen(s_timer->key->name) + 6];
+        sprintf(k, "%s_mean", s_timer->key->name);
+        SEND_GMETRIC_DOUBLE(s_timer->key->name, k, summary.mean/1000, "sec");
+      }
+      {
+        // Max value. Convert to seconds
+        char k[strlen(s_timer->key->name) + 7];
+        sprintf(k, "%s_upper", s_timer->key->name);
+        SEND_GMETRIC_DOUBLE(s_timer->key->name, k, summary.max/1000, "sec");
+      }
+      for (p = 0; p < num_percentiles; p++) {
+        // Percentile value. Convert to seconds
+        char k[strlen(s_timer->key->name) + strlen(percentiles[p].name) + 9];
+        sprintf(k, "%s_%sth_pct", s_timer->key->name, percentiles[p].name);
+        SEND_GMETRIC_DOUBLE(s_timer->key->name, k, upper[p]/1000, "sec");
+      }
+      {
+        char k[strlen(s_timer->key->name) + 7];
+        sprintf(k, "%s_lower", s_timer->key->name);
+        SEND_GMETRIC_DOUBLE(s_timer->key->name, k, summary.min/1000, "sec");
+      }
+      {
+        // Standard deviation. Convert to seconds
+        char k[strlen(s_timer->key->name) + 5];
+        sprintf(k, "%s_std", s_timer->key->name);
+        SEND_GMETRIC_DOUBLE(s_timer->key->name, k, summary.stddev/1000, "sec");
+      }
+      {
+        char k[strlen(s_timer->key->name) + 7];
+        sprintf(k, "%s_count", s_timer->key->name);
+        SEND_GMETRIC_INT(s_timer->key->name, k, s_timer->count, "count");
+      }
+    }
+  }
+}
 
-    /* ---------------------------------------------------------------------
-      Process counter metrics
-      -------------------------------------------------------------------- */
+void flush_gauge(statsd_gauge_t *s_gauge, statsd_lines_t *lines, statsd_ganglia_batch_t *gbatch) {
+  long double value = s_gauge->value;
+  if (enable_graphite) {
+    lines_stem(lines, "stats.", s_gauge->key, "");
+    lines_add(lines, "", (double) value);
+    lines_stem(lines, "stats_gauges_", s_gauge->key, "");
+    lines_add(lines, "", (double) s_gauge->value);
+  }
+  if (enable_gmetric) {
     {
-      statsd_counter_t *s_counter, *tmp;
-      HASH_ITER(hh, counters, s_counter, tmp) {
-        long double value = s_counter->value / flush_interval;
-        if (enable_graphite) {
-            utstring_printf(statString, "stats.%s %Lf %ld\nstats_counts_%s %Lf %ld\n", s_counter->key, value, ts, s_counter->key, s_counter->value, ts);
-        }
-        if (enable_gmetric) {
-          {
-            char *k = NULL;
-            if (ganglia_metric_prefix != NULL) {
-              k = malloc(strlen(s_counter->key) + strlen(ganglia_metric_prefix) + 1);
-              sprintf(k, "%s%s", ganglia_metric_prefix, s_counter->key);
-            } else {
-              k = strdup(s_counter->key);
-            }
-            SEND_GMETRIC_DOUBLE(k, k, value, "count");
-            if (k) free(k);
-          }
-          {
-            SEND_GMETRIC_DOUBLE(s_counter->key, s_counter->key, s_counter->value, "count");
-          }
-        }
+      char *k = NULL;
+      if (ganglia_metric_prefix != NULL) {
+        k = malloc(strlen(s_gauge->key->name) + strlen(ganglia_metric_prefix) + 1);
+        sprintf(k, "%s%s", ganglia_metric_prefix, s_gauge->key->name);
+      } else {
+        k = strdup(s_gauge->key->name);
+      }
+      SEND_GMETRIC_DOUBLE(k, k, value, "gauge");
+      if (k) free(k);
+    }
+    {
+      //char *k = malloc(strlen(s_counter->key->name) + 13);
+      // sprintf(k, "%s", s_counter->key->name);
+      SEND_GMETRIC_DOUBLE(s_gauge->key->name, s_gauge->key->name, s_gauge->value, "gauge");
+      //if (k) free(k);
+    }
+  }
+}
 
-        /* Clear counter after we're done with it */
-        wait_for_counters_lock();
-        s_counter->value = 0;
-        remove_counters_lock();
+void flush_set(statsd_set_t *s_set, statsd_lines_t *lines, statsd_ganglia_batch_t *gbatch) {
+  long count = s_set->hll ? llround(hll_count(s_set->hll)) : 0;
+  if (enable_graphite) {
+    lines_stem(lines, "stats.sets.", s_set->key, ".");
+    lines_add_long(lines, "count", count);
+  }
+  if (enable_gmetric) {
+    char k[strlen(s_set->key->name) + 7];
+    sprintf(k, "%s_count", s_set->key->name);
+    SEND_GMETRIC_INT(s_set->key->name, k, count, "count");
+  }
+}
 
-        numStats++;
+/**
+ * Claim chunks of the snapshot being flushed until there are none left,
+ * formatting them into the flusher's own buffer.
+ */
+void flush_part(statsd_flusher_t *f) {
+  int total = flush_snap.num_counters + flush_snap.num_timers + flush_snap.num_gauges + flush_snap.num_sets;
+  int start, i;
+  statsd_lines_t lines;
+
+  lines_init(&lines, f->out, flush_ts);
+  f->num_stats = 0;
+  while ((start = atomic_fetch_add(&flush_cursor, FLUSH_CHUNK)) < total) {
+    int end = start + FLUSH_CHUNK < total ? start + FLUSH_CHUNK : total;
+    for (i = start; i < end; i++) {
+      int j = i;
+      if (j < flush_snap.num_counters) {
+        flush_counter(&flush_snap.counters[j], &lines, &f->gbatch);
+        f->num_stats++;
+        continue;
+      }
+      j -= flush_snap.num_counters;
+      if (j < flush_snap.num_timers) {
+        flush_timer(&flush_snap.timers[j], &lines, &f->gbatch);
+        f->num_stats++;
+        continue;
       }
-      if (s_counter) free(s_counter);
-      if (tmp) free(tmp);
+      j -= flush_snap.num_timers;
+      if (j < flush_snap.num_gauges) {
+        flush_gauge(&flush_snap.gauges[j], &lines, &f->gbatch);
+        f->num_stats++;
+        continue;
+      }
+      j -= flush_snap.num_gauges;
+      flush_set(&flush_snap.sets[j], &lines, &f->gbatch);
+      f->num_stats++;
     }
+  }
 
-    /* ---------------------------------------------------------------------
-      Process timer metrics
-      -------------------------------------------------------------------- */
+  ganglia_batch_send(&ganglia, &f->gbatch);
 
-    {
-      statsd_timer_t *s_timer, *tmp;
-      HASH_ITER(hh, timers, s_timer, tmp) {
-        if (s_timer->count > 0) {
-          int pctThreshold = percentiles[0]; /* TODO FIXME: support multiple percentiles */
-
-          /* Sort all values in this timer list */
-          wait_for_timers_lock();
-          utarray_sort(s_timer->values, double_sort);
-
-          double min = 0;
-          double max = 0;
-          {
-            double *i = NULL; int count = 0;
-            while( (i=(double *) utarray_next( s_timer->values, i)) ) {
-              if (count == 0) {
-                min = *i;
-                max = *i;
-              } else {
-                if (*i < min) min = *i;
-                if (*i > max) max = *i;
-              }
-              count++;
-            }
-          }
+  /* Split between carbon destinations here, while still in parallel */
+  if (num_graphites > 1) {
+    graphite_route(&graphite_ring, utstring_body(f->out), utstring_len(f->out), f->routed);
+    utstring_clear(f->out);
+  }
+}
 
-          double mean = min;
-          double maxAtThreshold = max;
+void p_thread_flusher(void *ptr) {
+  statsd_flusher_t *f = (statsd_flusher_t *) ptr;
+  syslog(LOG_INFO, "Thread[Flusher]: Starting flusher %d\n", f->id);
 
-          if (s_timer->count > 1) {
-            // Find the index of the 90th percentile threshold
-            int thresholdIndex = ( pctThreshold / 100.0 ) * s_timer->count;
-            maxAtThreshold = * ( utarray_eltptr( s_timer->values, thresholdIndex - 1 ) );
-            printf("Count = %d Thresh = %d, MaxThreshold = %f\n", s_timer->count, thresholdIndex, maxAtThreshold);
+  thread_idle_end();
+  pthread_cleanup_push(thread_stopped, NULL);
+  while (1) {
+    thread_idle_begin();
+    sem_wait(&f->start);
+    thread_idle_end();
+    flush_part(f);
+    sem_post(&flush_done);
+  }
+  pthread_cleanup_pop(1);
+}
 
-            double sum = 0;
-            double *i = NULL; int count = 0;
-            while( (i=(double *) utarray_next( s_timer->values, i)) && count < s_timer->count - 1 ) {
-              sum += *i;
-              count++;
-            }
-            mean = sum / s_timer->count;
-          }
+void p_thread_flush(void *ptr) {
+  syslog(LOG_INFO, "Thread[Flush]: Starting thread %d\n", (int) *((int *) ptr));
+  memset(&flush_snap, 0, sizeof(statsd_snapshot_t));
 
-          /* Clear all values for this timer */
-          utarray_clear(s_timer->values);
-          s_timer->count = 0;
-          remove_timers_lock();
-
-
-          if (enable_graphite) {
-            utstring_printf(statString, "stats.timers.%s.mean %f %ld\n"
-              "stats.timers.%s.upper %f %ld\n"
-              "stats.timers.%s.upper_%d %f %ld\n"
-              "stats.timers.%s.lower %f %ld\n"
-              "stats.timers.%s.count %d %ld\n",
-              s_timer->key, mean, ts,
-              s_timer->key, max, ts,
-              s_timer->key, pctThreshold, maxAtThreshold, ts,
-              s_timer->key, min, ts,
-              s_timer->key, s_timer->count, ts
-            );
-          }
+  thread_idle_end();
+  pthread_cleanup_push(thread_stopped, NULL);
+  while (1) {
+    thread_idle_begin();
+    THREAD_SLEEP(flush_interval);
+    thread_idle_end();
 
-          if (enable_gmetric) {
-            {
-              // Mean value. Convert to seconds
-              char k[strlen(s_timer->key) + 6];
-              sprintf(k, "%s_mean", s_timer->key);
-              SEND_GMETRIC_DOUBLE(s_timer->key, k, mean/1000, "sec");
-            }
-            {
-              // Max value. Convert to seconds
-              char k[strlen(s_timer->key) + 7];
-              sprintf(k, "%s_upper", s_timer->key);
-              SEND_GMETRIC_DOUBLE(s_timer->key, k, max/1000, "sec");
-            }
-            {
-              // Percentile value. Convert to seconds
-              char k[strlen(s_timer->key) + 12];
-              sprintf(k, "%s_%dth_pct", s_timer->key, pctThreshold);
-              SEND_GMETRIC_DOUBLE(s_timer->key, k, maxAtThreshold/1000, "sec");
-            }
-            {
-              char k[strlen(s_timer->key) + 7];
-              sprintf(k, "%s_lower", s_timer->key);
-              SEND_GMETRIC_DOUBLE(s_timer->key, k, min/1000, "sec");
-            }
-            {
-              char k[strlen(s_timer->key) + 7];
-              sprintf(k, "%s_count", s_timer->key);
-              SEND_GMETRIC_INT(s_timer->key, k, s_timer->count, "count");
-            }
-          }
-        }
-        numStats++;
+    long flush_start, compute_start, swap_pause;
+    int f, d;
+
+    update_internal_stats();
+
+    /* Freeze this interval; ingest carries on into fresh maps */
+    flush_start = monotonic_usec();
+    swap_pause = collect_aggregates();
+    sem_wait(&merge_lock);
+    snapshot_take(&flush_snap);
+    sem_post(&merge_lock);
+    dump_stats();
+
+    /* The socket is opened once and kept */
+    if (enable_gmetric && ganglia.gm.s == -1) {
+      if (!ganglia_open(&ganglia, ganglia_host, ganglia_port)) {
+        syslog(LOG_ERR, "Unable to connect to ganglia host %s:%d", ganglia_host, ganglia_port);
+        enable_gmetric = 0;
       }
-      if (s_timer) free(s_timer);
-      if (tmp) free(tmp);
     }
+    if (enable_gmetric) {
+      ganglia_flush_start(&ganglia);
+    }
+
+    long ts = time(NULL);
+    int numStats = 0;
+    UT_string *statString;
+
+    utstring_new(statString);
 
     /* ---------------------------------------------------------------------
-      Process gauge metrics
+      Process counter, timer, gauge and set metrics across the flushers
       -------------------------------------------------------------------- */
 
-    {
-      statsd_gauge_t *s_gauge, *tmp;
-      HASH_ITER(hh, gauges, s_gauge, tmp) {
-        long double value = s_gauge->value;
-        if (enable_graphite) {
-            utstring_printf(statString, "stats.%s %Lf %ld\nstats_gauges_%s %Lf %ld\n", s_gauge->key, value, ts, s_gauge->key, s_gauge->value, ts);
-        }
-        if (enable_gmetric) {
-          {
-            char *k = NULL;
-            if (ganglia_metric_prefix != NULL) {
-              k = malloc(strlen(s_gauge->key) + strlen(ganglia_metric_prefix) + 1);
-              sprintf(k, "%s%s", ganglia_metric_prefix, s_gauge->key);
-            } else {
-              k = strdup(s_gauge->key);
-            }
-            SEND_GMETRIC_DOUBLE(k, k, value, "gauge");
-            if (k) free(k);
-          }
-          {
-            //char *k = malloc(strlen(s_counter->key) + 13);
-            // sprintf(k, "%s", s_counter->key);
-            SEND_GMETRIC_DOUBLE(s_gauge->key, s_gauge->key, s_gauge->value, "gauge");
-            //if (k) free(k);
-          }
-        }
-        numStats++;
+    compute_start = monotonic_usec();
+    format_long(ts, flush_ts);
+    atomic_store(&flush_cursor, 0);
+    for (f = 1; f < num_flushers; f++) {
+      sem_post(&flushers[f].start);
+    }
+    flush_part(&flushers[0]);
+    for (f = 1; f < num_flushers; f++) {
+      sem_wait(&flush_done);
+    }
+    for (f = 0; f < num_flushers; f++) {
+      utstring_concat(statString, flushers[f].out);
+      utstring_clear(flushers[f].out);
+      for (d = 0; num_graphites > 1 && d < num_graphites; d++) {
+        utstring_concat(graphite_payloads[d], flushers[f].routed[d]);
+        utstring_clear(flushers[f].routed[d]);
       }
-      if (s_gauge) free(s_gauge);
-      if (tmp) free(tmp);
+      numStats += flushers[f].num_stats;
     }
+    UPDATE_STAT_LONG( "flush", "compute_us", monotonic_usec() - compute_start );
 
     /* ---------------------------------------------------------------------
       Process totals
@@ -1342,72 +1616,91 @@ void p_thread_flush(void *ptr) {
 
     {
       if (enable_graphite) {
-        utstring_printf(statString, "statsd.numStats %d %ld\n", numStats, ts);
+        statsd_lines_t lines;
+        lines_init(&lines, statString, flush_ts);
+        lines_add_long(&lines, "statsd.numStats", numStats);
       }
       if (enable_gmetric) {
+        statsd_ganglia_batch_t *gbatch = &flushers[0].gbatch;
         SEND_GMETRIC_INT("statsd", "statsd_numstats_collected", numStats, "count");
+        ganglia_batch_send(&ganglia, gbatch);
       }
     }
 
-    /* TODO: Flush to graphite */
     if (enable_graphite) {
-      printf("Messages:\n%s", utstring_body(statString));
-      int nova = 0, sock = -1;
-      struct hostent* result = NULL;
-      struct sockaddr_in sa;
-      memset(&sa, 0, sizeof(struct sockaddr_in));
-      /* gethostbyname is absolete, we should use getaddrinfo(), but I don't know how (yet) - Marian */
-/*#ifdef __linux__
-      struct hostent he;
-      char tmpbuf[1024];
-      int local_errno = 0;
-      if (gethostbyname_r(graphite_host, &he, tmpbuf, sizeof(tmpbuf),
-                          &result, &local_errno)) {
-          nova = 1;
-      }
-#else
-      result = gethostbyname(graphite_host);
-#endif
-      if (result == NULL || result->h_addr_list[0] == NULL ||
-          result->h_length != 4) {
-          nova = 1;
-      }*/
-
-      /* h_addr_list[0] is raw memory */
-//      uint32_t* ip = (uint32_t*) result->h_addr_list[0];
-      if( inet_pton( AF_INET, graphite_host, & sa.sin_addr ) <= 0 ) {
-		  nova = 1;
-		  perror( "inet_pton() ERROR" );
-		  printf("graphite won't work!\n");
-	  }
-      if (!nova) {
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock < 0) {
-            nova = 1;
-            printf("graphite won't work!\n");
+      long bytes_sent = 0, reconnects = 0, dropped_lines = 0, spill_bytes = 0;
+
+      if (num_graphites == 1) {
+        if (debug) {
+          printf("Messages:\n%s", utstring_body(statString));
         }
+        graphite_send(&graphites[0], utstring_body(statString), utstring_len(statString));
+      } else {
+        /* Only the totals are left to route */
+        graphite_route(&graphite_ring, utstring_body(statString), utstring_len(statString), graphite_payloads);
+        for (d = 0; d < num_graphites; d++) {
+          if (debug) {
+            printf("Messages for %s:%s:\n%s", graphites[d].host, graphites[d].port, utstring_body(graphite_payloads[d]));
+          }
+          graphite_send(&graphites[d], utstring_body(graphite_payloads[d]), utstring_len(graphite_payloads[d]));
+          utstring_clear(graphite_payloads[d]);
+        }
+      }
+
+      for (d = 0; d < num_graphites; d++) {
+        bytes_sent += graphites[d].bytes_sent;
+        reconnects += graphites[d].reconnects;
+        dropped_lines += graphites[d].dropped_lines;
+        spill_bytes += graphites[d].pending_len;
       }
-      if (!nova) {
-        sa.sin_family = AF_INET;
-        sa.sin_port = htons(graphite_port);
-        connect(sock, (struct sockaddr *)&sa, sizeof(sa));
-        send(sock, utstring_body(statString), utstring_len(statString), 0);
-        close(sock);
+      if (spill_bytes == 0) {
         char flush_time[12]={};
-		sprintf(flush_time, "%ld", time(NULL));
-		update_stat( "graphite", "last_flush", flush_time );
+        sprintf(flush_time, "%ld", time(NULL));
+        update_stat( "graphite", "last_flush", flush_time );
       }
+      UPDATE_STAT_LONG( "graphite", "bytes_sent", bytes_sent );
+      UPDATE_STAT_LONG( "graphite", "reconnects", reconnects );
+      UPDATE_STAT_LONG( "graphite", "dropped_lines", dropped_lines );
+      UPDATE_STAT_LONG( "graphite", "spill_bytes", spill_bytes );
     }
 
     if (enable_gmetric) {
-      gmetric_close(&gm);
+      long sent = 0, failed = 0;
+      for (f = 0; f < num_flushers; f++) {
+        sent += flushers[f].gbatch.sent;
+        failed += flushers[f].gbatch.failed;
+        flushers[f].gbatch.sent = flushers[f].gbatch.failed = 0;
+      }
+      if (failed) {
+        syslog(LOG_ERR, "Failed to send %ld of %ld gmetric packets", failed, sent + failed);
+      }
+      ganglia.packets_sent += sent;
+      ganglia.send_errors += failed;
+      UPDATE_STAT_LONG( "ganglia", "packets_sent", ganglia.packets_sent );
+      UPDATE_STAT_LONG( "ganglia", "send_errors", ganglia.send_errors );
     }
 
-    if (ts_string) free(ts_string);
-    if (enable_graphite) {
-      utstring_free(statString);
-    }
+    utstring_free(statString);
+    /* Entries idle past their ttl have just been flushed for the last time */
+    expire_step(&ttl, &expiry);
+    UPDATE_STAT_LONG( "expiry", "live_counters", counters_slab.in_use );
+    UPDATE_STAT_LONG( "expiry", "live_gauges", gauges_slab.in_use );
+    UPDATE_STAT_LONG( "expiry", "live_timers", timers_slab.in_use );
+    UPDATE_STAT_LONG( "expiry", "live_sets", sets_slab.in_use );
+    UPDATE_STAT_LONG( "expiry", "interned_keys", keys_count() );
+    UPDATE_STAT_LONG( "expiry", "expired_counters", expiry.expired_counters );
+    UPDATE_STAT_LONG( "expiry", "expired_gauges", expiry.expired_gauges );
+    UPDATE_STAT_LONG( "expiry", "expired_timers", expiry.expired_timers );
+    UPDATE_STAT_LONG( "expiry", "expired_sets", expiry.expired_sets );
+    UPDATE_STAT_LONG( "expiry", "scanned", expiry.scanned );
+    UPDATE_STAT_LONG( "expiry", "scan_us", expiry.scan_us );
+
+    snapshot_release(&flush_snap);
+
+    UPDATE_STAT_LONG( "flush", "duration_us", monotonic_usec() - flush_start );
+    UPDATE_STAT_LONG( "flush", "swap_pause_us", swap_pause );
   }
+  pthread_cleanup_pop(1);
 
   syslog(LOG_INFO, "Thread[Flush]: Ending thread %d\n", (int) *((int *) ptr));
   pthread_exit(0);
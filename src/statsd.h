@@ -11,6 +11,9 @@
 
 #define BUFLEN 65536
 
+/* Datagrams pulled from the UDP socket per receive call */
+#define UDP_BATCH_SIZE 32
+
 /* Default statsd ports */
 #define PORT 8125
 #define MGMT_PORT 8126
@@ -19,6 +22,9 @@
 /* Define stat flush interval in sec */
 #define FLUSH_INTERVAL 10
 
+/* Set by -d, for logging that is too costly to leave on */
+extern int debug;
+
 #define THREAD_SLEEP(x) { pthread_mutex_t fakeMutex = PTHREAD_MUTEX_INITIALIZER; pthread_cond_t fakeCond = PTHREAD_COND_INITIALIZER; struct timespec timeToWait; struct timeval now; int rt; gettimeofday(&now,NULL); timeToWait.tv_sec = now.tv_sec + x; timeToWait.tv_nsec = now.tv_usec; pthread_mutex_lock(&fakeMutex); rt = pthread_cond_timedwait(&fakeCond, &fakeMutex, &timeToWait); if (rt != 0) { } pthread_mutex_unlock(&fakeMutex); }
 #define STREAM_SEND(x,y) if (send(x, y, strlen(y), 0) == -1) { perror("send error"); }
 #define STREAM_SEND_LONG(x,y) { \
@@ -41,88 +47,31 @@
 	sprintf(z, "%Lf", y); \
 	if (send(x, z, strlen(z), 0) == -1) { perror("send error"); } \
 	}
-#define UPDATE_LAST_MSG_SEEN() { \
-	char time_sec[32]; \
-	sprintf(time_sec, "%ld", time(NULL)); \
-	update_stat( "messages", "last_msg_seen", time_sec); \
+#define UPDATE_STAT_LONG(group, key, value) { \
+	char stat_value[32]; \
+	sprintf(stat_value, "%ld", (long) (value)); \
+	update_stat( group, key, stat_value); \
 	}
 
 #define MGMT_END "END\n\n"
 #define MGMT_BADCOMMAND "ERROR\n"
 #define MGMT_PROMPT "statsd> "
-#define MGMT_HELP "Commands: stats, counters, timers, quit\n\n"
+#define MGMT_HELP "Commands: stats, counters, timers, sets, keys, quit\n\n"
+
+/* Prefixes listed by the "keys" command, most rejected first */
+#define MGMT_TOP_PREFIXES 10
 
 /*
  * GMETRIC SENDING
  */
 
-#define SEND_GMETRIC_DOUBLE(mygroup, myname, myvalue, myunit) { \
-	char mystringvalue[30]; \
-	sprintf(mystringvalue, "%Lf", (long double) myvalue); \
-	gmetric_message_t msg = { \
-		.format = GMETRIC_FORMAT_31, \
-		.type = GMETRIC_VALUE_DOUBLE, \
-		.name = myname, \
-    .group = mygroup, \
-		.hostname = ganglia_spoof, \
-		.value.v_string = mystringvalue, \
-		.units = myunit, \
-		.slope = GMETRIC_SLOPE_BOTH, \
-		.tmax = flush_interval + 10, \
-		.dmax = flush_interval + 10, \
-		.spoof = 1 \
-	}; \
-	int len = gmetric_send(&gm, &msg); \
-	if (len != -1) { \
-		syslog(LOG_INFO, "Sent gmetric DOUBLE message %s length %d", myname, len); \
-	} else { \
-		syslog(LOG_ERR, "Failed to send gmetric %s", myname); \
-	} \
-	}
-#define SEND_GMETRIC_INT(mygroup, myname, myvalue, myunit) { \
-	char mystringvalue[30]; \
-	sprintf(mystringvalue, "%d", myvalue); \
-	gmetric_message_t msg = { \
-		.format = GMETRIC_FORMAT_31, \
-		.type = GMETRIC_VALUE_INT, \
-		.name = myname, \
-    .group = mygroup, \
-		.hostname = ganglia_spoof, \
-		.value.v_string = mystringvalue, \
-		.units = myunit, \
-		.slope = GMETRIC_SLOPE_BOTH, \
-		.tmax = flush_interval + 10, \
-		.dmax = flush_interval + 10, \
-		.spoof = 1 \
-	}; \
-	int len = gmetric_send(&gm, &msg); \
-	if (len != -1) { \
-		syslog(LOG_INFO, "Sent gmetric INT message %s length %d", myname, len); \
-	} else { \
-		syslog(LOG_ERR, "Failed to send gmetric %s", myname); \
-	} \
-	}
-#define SEND_GMETRIC_STRING(myname, myvalue, myunit) { \
-	gmetric_message_t msg = { \
-		.format = GMETRIC_FORMAT_31, \
-		.type = GMETRIC_VALUE_STRING, \
-		.name = myname, \
-    .group = mygroup, \
-		.hostname = ganglia_spoof, \
-		.value.v_string = myvalue, \
-		.units = myunit, \
-		.slope = GMETRIC_SLOPE_BOTH, \
-		.tmax = flush_interval + 10, \
-		.dmax = flush_interval + 10, \
-		.spoof = 1 \
-	}; \
-	int len = gmetric_send(&gm, &msg); \
-	if (len != -1) { \
-		syslog(LOG_INFO, "Sent gmetric STRING message %s length %d", myname, len); \
-	} else { \
-		syslog(LOG_ERR, "Failed to send gmetric %s", myname); \
-	} \
-	}
+/* Queue on the flusher's batch, in scope as gbatch */
+#define SEND_GMETRIC_DOUBLE(mygroup, myname, myvalue, myunit) \
+	ganglia_add_double(&ganglia, gbatch, mygroup, myname, myunit, (double) (myvalue))
+#define SEND_GMETRIC_INT(mygroup, myname, myvalue, myunit) \
+	ganglia_add_long(&ganglia, gbatch, mygroup, myname, myunit, (long) (myvalue))
+#define SEND_GMETRIC_STRING(mygroup, myname, myvalue, myunit) \
+	ganglia_add(&ganglia, gbatch, mygroup, myname, myunit, GMETRIC_VALUE_STRING, myvalue)
 
 #endif /* STATSD_H */
 
@@ -43,14 +43,15 @@ double get_time () {
 int main(int argc, char *argv[]) {
   struct sockaddr_in *sa;
 
-  char buf[1024];
+  char buf[1024], *batch_buf = NULL;
   char *host = "127.0.0.1", *counter = NULL, *timer = NULL;
   uint32_t net_ip;
   long value;
-  int port = 8125, sample_rate = 1, performance_test = 0, performance_test_iterations = 10000;
+  double sample_rate = 0;
+  int port = 8125, performance_test = 0, performance_test_iterations = 10000, batch_size = 1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "hH:p:c:v:t:s:Pi:")) != -1) {
+  while ((opt = getopt(argc, argv, "hH:p:c:v:t:s:Pi:b:")) != -1) {
     switch (opt) {
       case 'h':
         usage(argv);
@@ -68,7 +69,7 @@ int main(int argc, char *argv[]) {
         port = atoi(optarg);
         break;
       case 's':
-        sample_rate = atoi(optarg);
+        sample_rate = atof(optarg);
         break;
       case 'H':
         host = malloc((strlen(optarg) + 1) * sizeof(char));
@@ -83,6 +84,9 @@ int main(int argc, char *argv[]) {
       case 'i':
         performance_test_iterations = atoi(optarg);
         break;
+      case 'b':
+        batch_size = atoi(optarg);
+        break;
     }
   }
 
@@ -92,17 +96,41 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  /* Format message */
+  if (sample_rate < 0 || sample_rate > 1) {
+    usage(argv);
+    return 1;
+  }
+
+  if (batch_size < 1) {
+    batch_size = 1;
+  }
+
+  /* Format message; the rate only goes on the wire when one was given */
   if (timer != NULL) {
-    sprintf(buf, "%s:%ld||%d", timer, value, sample_rate);
+    snprintf(buf, sizeof(buf), "%s:%ld|ms", timer, value);
   } else if (counter != NULL) {
-    sprintf(buf, "%s:%ld|c", counter, value);
+    snprintf(buf, sizeof(buf), "%s:%ld|c", counter, value);
+  }
+  if (sample_rate > 0) {
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "|@%g", sample_rate);
+  }
+
+  /* Batched messages carry batch_size newline separated copies */
+  if (batch_size > 1) {
+    int i, len = strlen(buf);
+    char *p;
+    batch_buf = malloc((len + 1) * batch_size);
+    for (i = 0, p = batch_buf; i < batch_size; i++, p += len + 1) {
+      memcpy(p, buf, len);
+      p[len] = '\n';
+    }
+    *(p - 1) = '\0';
   }
 
   /* Send message */
   int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   net_ip = resolve_host(host);
-  sa = malloc(sizeof(struct sockaddr_in *));
+  sa = malloc(sizeof(struct sockaddr_in));
 /*  memset(&sa, 0, sizeof(struct sockaddr_in)); */
   sa->sin_family = AF_INET;
   sa->sin_port = htons(port);
@@ -110,18 +138,23 @@ int main(int argc, char *argv[]) {
   if (performance_test) {
     double starting_time, ending_time;
     int err = 0;
-    int iter;
+    int iter, packets = 0;
+    char *msg = batch_size > 1 ? batch_buf : buf;
+    size_t msg_len = strlen(msg);
     starting_time = get_time();
-    for (iter=0; iter<performance_test_iterations; iter++) {
-      if (!sendto(s, (char*) buf, strlen(buf), 0, (struct sockaddr*) sa, sizeof(struct sockaddr_in))) {
+    for (iter=0; iter<performance_test_iterations; iter += batch_size, packets++) {
+      if (sendto(s, msg, msg_len, 0, (struct sockaddr*) sa, sizeof(struct sockaddr_in)) < 0) {
         err++;
       }
     }
     ending_time = get_time();
-    printf("10k queries in %f seconds\n", ending_time - starting_time);
+    printf("%d metrics in %d packets (%d errors) in %f seconds, %.0f metrics/sec\n",
+      packets * batch_size, packets, err, ending_time - starting_time,
+      packets * batch_size / (ending_time - starting_time));
     return 0;
   } else {
-    if (!sendto(s, (char*) buf, strlen(buf), 0, (struct sockaddr*) sa, sizeof(struct sockaddr_in))) {
+    char *msg = batch_size > 1 ? batch_buf : buf;
+    if (sendto(s, msg, strlen(msg), 0, (struct sockaddr*) sa, sizeof(struct sockaddr_in)) < 0) {
       return 1;
     }
   }
@@ -153,15 +186,17 @@ uint32_t resolve_host(const char *addr) {
 }
 
 void usage(char *argv[]) {
-  fprintf(stderr, "Usage: %s [-hP] [-H host] [-p port] [-c counter] [-t timer] [-v value] [-i iterations]\n", argv[0]);
+  fprintf(stderr, "Usage: %s [-hP] [-H host] [-p port] [-c counter] [-t timer] [-v value] [-s rate] [-i iterations] [-b batch]\n", argv[0]);
   fprintf(stderr, "\t-h               This help screen\n");
   fprintf(stderr, "\t-H host          Destination statsd server name/ip (default 127.0.0.1)\n");
   fprintf(stderr, "\t-p port          Destination statsd server port (defaults to 8125)\n");
   fprintf(stderr, "\t-c counter       Counter name (required, or timer)\n");
   fprintf(stderr, "\t-t timer         Timer name (required, or counter)\n");
   fprintf(stderr, "\t-v value         Value (required)\n");
+  fprintf(stderr, "\t-s rate          Sample rate, between 0 and 1, sent as |@rate (default none)\n");
   fprintf(stderr, "\t-P               Performance testing mode (disabled by default)\n");
   fprintf(stderr, "\t-i iterations    Performance test iterations (defaults to 10000)\n");
+  fprintf(stderr, "\t-b batch         Metrics per packet, newline separated (defaults to 1)\n");
   fprintf(stderr, "\nBoth a counter and timer cannot exist at the same time.\n");
 }
 
@@ -10,58 +10,40 @@
 #include <stdlib.h>
 #include <string.h>
 
-void sanitize_key(char *k) {
-  char *dest = malloc(strlen(k) + 1);
+/*
+ * The sanitizer only ever drops or replaces characters, so it rewrites
+ * the string in place.
+ */
+
+/**
+ * Sanitize a key and return the length of its first depth dotted
+ * components once sanitized, or of all of it if it has fewer. Dots
+ * become underscores here, so this is the last point where the
+ * components can be told apart.
+ */
+int sanitize_key_prefix(char *k, int depth) {
   char *p = k;
-  int c = 0;
+  int c = 0, dots = 0, prefix = -1;
   while (*p != '\0') {
     if (*p == '.') {
-      *(dest + c) = '_';
+      if (++dots == depth) prefix = c;
+      *(k + c) = '_';
       c++;
     } else if (*p == '\\' || *p == '/') {
-      *(dest + c) = '-';
+      *(k + c) = '-';
       c++;
     } else if ( (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_' || *p == '-' ) {
-      *(dest + c) = *p;
-      c++;
-    }
-    p++;
-  }
-  *(dest + c) = '\0';
-  memcpy(k, dest, c + 1);
-  if (dest) free(dest);
-}
-
-void sanitize_value(char *k) {
-  char *dest = malloc(strlen(k) + 1);
-  char *p = k;
-  int c = 0;
-  while (*p != '\0') {
-    if ( *p == '.' || *p == '-' || (*p >= '0' && *p <= '9') ) {
-      *(dest + c) = *p;
+      *(k + c) = *p;
       c++;
     }
     p++;
   }
-  *(dest + c) = '\0';
-  memcpy(k, dest, c + 1);
-  if (dest) free(dest);
+  *(k + c) = '\0';
+  return prefix < 0 ? c : prefix;
 }
 
-void sanitize_gaugevalue(char *k) {
-  char *dest = malloc(strlen(k) + 1);
-  char *p = k;
-  int c = 0;
-  while (*p != '\0') {
-    if ( *p == '.' || *p == '-' || *p == '+' || (*p >= '0' && *p <= '9') ) {
-      *(dest + c) = *p;
-      c++;
-    }
-    p++;
-  }
-  *(dest + c) = '\0';
-  memcpy(k, dest, c + 1);
-  if (dest) free(dest);
+void sanitize_key(char *k) {
+  sanitize_key_prefix(k, 0);
 }
 
 char *ltoa(long l) {
@@ -10,8 +10,7 @@
 #define __STRINGS_H__ 1
 
 void sanitize_key(char *k);
-void sanitize_value(char *k);
-void sanitize_gaugevalue(char *k);
+int sanitize_key_prefix(char *k, int depth);
 void appendstring(char *orig, char *addition);
 char *ltoa(long l);
 char *ldtoa(long double ld);
@@ -6,27 +6,35 @@
  *
  */
 
-#include <semaphore.h>
-
-#include "uthash/uthash.h"
-#include "uthash/utarray.h"
+#include "keys.h"
+#include "shards.h"
+#include "sketch.h"
+#include "slab.h"
 
 #ifndef __TIMER_H__
 #define __TIMER_H__ 1
 
+/*
+ * Indexed by key id in timers. Samples are kept either verbatim in
+ * values, or, when sketch_alpha is set, summarized in sketch; the other
+ * one is NULL. values lives in the interval's timer arena and holds
+ * count samples out of room for max_values.
+ */
 typedef struct {
-  UT_hash_handle hh; /* makes this structure hashable */
-  char key[100];
+  statsd_key_t *key;
+  double *values;
+  statsd_sketch_t *sketch;
+  long seen;          /* flush_seq of the last merge */
   int count;
-  UT_array *values;
+  int max_values;
 } statsd_timer_t;
 
-extern statsd_timer_t *timers;
-extern sem_t timers_lock;
-extern UT_icd timers_icd;
+extern statsd_idtable_t timers;
+extern statsd_shard_t timers_shards[STATSD_SHARDS];
+extern statsd_slab_t timers_slab;
 
-#define wait_for_timers_lock() sem_wait(&timers_lock)
-#define remove_timers_lock() sem_post(&timers_lock)
+#define wait_for_timers_lock(key) pthread_mutex_lock(&timers_shards[KEY_SHARD(key)].lock)
+#define remove_timers_lock(key) pthread_mutex_unlock(&timers_shards[KEY_SHARD(key)].lock)
 
 #endif /* __TIMER_H__ */
 
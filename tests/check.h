@@ -0,0 +1,38 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#ifndef __CHECK_H__
+#define __CHECK_H__ 1
+
+/*
+ * Minimal assertions for the tests: a failed check is reported and
+ * counted, and the test carries on; main() returns CHECK_RESULT.
+ */
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		check_failures++; \
+	} \
+	} while (0)
+
+#define CHECK_NEAR(a, b, eps) do { \
+	double check_a = (a), check_b = (b); \
+	if (!( fabs(check_a - check_b) <= (eps) )) { \
+		fprintf(stderr, "%s:%d: check failed: %s == %s (%.17g != %.17g)\n", __FILE__, __LINE__, #a, #b, check_a, check_b); \
+		check_failures++; \
+	} \
+	} while (0)
+
+#define CHECK_RESULT ( check_failures ? 1 : 0 )
+
+#endif /* __CHECK_H__ */
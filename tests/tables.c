@@ -0,0 +1,51 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#include <semaphore.h>
+
+#include "../src/aggregate.h"
+#include "../src/counters.h"
+#include "../src/gauges.h"
+#include "../src/hll.h"
+#include "../src/keys.h"
+#include "../src/scan.h"
+#include "../src/sets.h"
+#include "../src/stats.h"
+#include "../src/timers.h"
+#include "tables.h"
+
+statsd_stat_t *stats = NULL;
+sem_t stats_lock;
+statsd_idtable_t counters;
+statsd_shard_t counters_shards[STATSD_SHARDS];
+statsd_idtable_t gauges;
+statsd_shard_t gauges_shards[STATSD_SHARDS];
+statsd_idtable_t timers;
+statsd_shard_t timers_shards[STATSD_SHARDS];
+statsd_idtable_t sets;
+statsd_shard_t sets_shards[STATSD_SHARDS];
+statsd_slab_t counters_slab, gauges_slab, timers_slab, sets_slab, stats_slab;
+int debug = 0;
+
+void tables_init() {
+  stats_init();
+  shards_init(timers_shards);
+  shards_init(counters_shards);
+  shards_init(gauges_shards);
+  shards_init(sets_shards);
+  slab_init(&counters_slab, "counters", sizeof(statsd_counter_t));
+  slab_init(&gauges_slab, "gauges", sizeof(statsd_gauge_t));
+  slab_init(&timers_slab, "timers", sizeof(statsd_timer_t));
+  slab_init(&sets_slab, "sets", sizeof(statsd_set_t));
+  slab_init(&stats_slab, "stats", sizeof(statsd_stat_t));
+  slab_init(&agg_entries_slab, "agg_entries", sizeof(statsd_agg_entry_t));
+  timer_arenas_init();
+  keys_init();
+  hll_init(HLL_PRECISION_DEFAULT);
+  scan_init();
+}
@@ -0,0 +1,19 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+#ifndef __TABLES_H__
+#define __TABLES_H__ 1
+
+/*
+ * The global tables main() owns in the daemon, for tests and benchmarks
+ * that link statsd_core. tables_init() sets them up the way main() does
+ * before it reads its options.
+ */
+void tables_init();
+
+#endif /* __TABLES_H__ */
@@ -0,0 +1,231 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * No heap allocations per packet in steady state. Datagrams take the
+ * worker's path: a pool buffer is filled (standing in for the receive),
+ * queued, popped, parsed in place into an aggregation map and released.
+ * Each interval ends as a flush does, swapping the worker's two maps,
+ * merging the retired one and taking and releasing a snapshot. After a
+ * few intervals to warm up, malloc() and friends must not be called at
+ * all while packets are processed; they are counted by defining them
+ * here over glibc's own, so that calls from inside libc count too.
+ * Then a new key whose arena block cannot be had: it must be dropped,
+ * counted, and leave the per prefix count as it was. And timer sketches
+ * whose bins cannot grow: samples go to the nearest bin or are dropped,
+ * and the count only has the ones kept.
+ *
+ * Usage: test_alloc [intervals]
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/aggregate.h"
+#include "../src/arena.h"
+#include "../src/ingest.h"
+#include "../src/keys.h"
+#include "../src/sketch.h"
+#include "../src/pool.h"
+#include "../src/queue.h"
+#include "../src/statsd.h"
+#include "check.h"
+#include "tables.h"
+
+#define DATAGRAMS 512
+#define DATAGRAM_MAX 1400
+#define WARMUP 4
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_long allocations;
+static int fail_blocks, fail_callocs;
+
+void *malloc(size_t size) {
+  atomic_fetch_add(&allocations, 1);
+  /* Arena blocks are the only allocations this size taken by malloc() */
+  if (fail_blocks && size >= ARENA_BLOCK_SIZE) return NULL;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  atomic_fetch_add(&allocations, 1);
+  if (fail_callocs) return NULL;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  atomic_fetch_add(&allocations, 1);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+static char corpus[DATAGRAMS][DATAGRAM_MAX + 1];
+static int lens[DATAGRAMS];
+
+/* The same keys every interval, as a steady stream of traffic has */
+static void fill() {
+  uint64_t rng = 9;
+  int d;
+
+  for (d = 0; d < DATAGRAMS; d++) {
+    char line[128];
+    int len = 0, n;
+    for (;;) {
+      uint64_t r;
+      rng ^= rng >> 12;
+      rng ^= rng << 25;
+      rng ^= rng >> 27;
+      r = rng * 2685821657736338717ull;
+      switch (r % 6) {
+        case 0: case 1:
+          n = sprintf(line, "api.svc%d.requests:1|c", (int) ( ( r >> 8 ) % 50 ));
+          break;
+        case 2: case 3:
+          n = sprintf(line, "api.svc%d.latency:%d|ms", (int) ( ( r >> 8 ) % 50 ), (int) ( ( r >> 16 ) % 1000 ));
+          break;
+        case 4:
+          n = sprintf(line, "host.web%d.load:%d|g", (int) ( ( r >> 8 ) % 20 ), (int) ( ( r >> 16 ) % 100 ));
+          break;
+        default:
+          n = sprintf(line, "api.svc%d.users:u%d|s", (int) ( ( r >> 8 ) % 10 ), (int) ( ( r >> 16 ) % 10000 ));
+          break;
+      }
+      if (len + 1 + n > DATAGRAM_MAX) break;
+      if (len > 0) corpus[d][len++] = '\n';
+      memcpy(corpus[d] + len, line, n);
+      len += n;
+    }
+    lens[d] = len;
+  }
+}
+
+static void test_key_oom() {
+  statsd_key_rejects_t r;
+  char name[64];
+  uint32_t before;
+  long accepted = 0;
+  int len;
+
+  keys_limit(0, 100000, 1, NULL);
+  fail_blocks = 1;
+  for (;;) {
+    len = sprintf(name, "oom_key_%ld", accepted);
+    before = keys_count();
+    if (key_intern(name, len, -1) == NULL) break;
+    accepted++;
+  }
+  fail_blocks = 0;
+  keys_rejects(&r);
+  CHECK(r.rejected_memory == 1);
+  CHECK(keys_count() == before);
+  CHECK(key_by_id(before) == NULL);
+
+  /* The same key goes in once memory is back, and the prefix fills up exactly */
+  while (key_intern(name, len, -1) != NULL) {
+    accepted++;
+    len = sprintf(name, "oom_key_%ld", accepted);
+  }
+  keys_rejects(&r);
+  CHECK(accepted == 100000);
+  CHECK(r.rejected_prefix == 1);
+}
+
+static void test_sketch_oom() {
+  statsd_sketch_t *a, *b, *c;
+
+  sketch_init(0.01);
+  a = sketch_new();
+  b = sketch_new();
+  c = sketch_new();
+  CHECK(sketch_add(a, 1) == 0);
+  CHECK(sketch_add(b, 1e6) == 0);
+  CHECK(sketch_add(b, 0) == 0);
+
+  fail_callocs = 1;
+  CHECK(sketch_new() == NULL);
+  /* Past a's only bins: counted in the top one, extremes still exact */
+  CHECK(sketch_add(a, 1000) == -1);
+  CHECK(a->count == 2 && a->pos.len > 0);
+  CHECK_NEAR(sketch_quantile(a, 1), 1000, 0);
+  /* c has no bins at all */
+  CHECK(sketch_add(c, 5) == -1);
+  CHECK(c->count == 0 && c->pos.bins == NULL);
+  CHECK(sketch_merge(c, b) == -1);
+  CHECK(c->count == 1 && c->zero_count == 1);
+  fail_callocs = 0;
+
+  CHECK(sketch_add(c, 5) == 0);
+  CHECK(c->count == 2);
+  sketch_free(a);
+  sketch_free(b);
+  sketch_free(c);
+}
+
+int main(int argc, char *argv[]) {
+  int intervals = argc > 1 ? atoi(argv[1]) : 20, i, d;
+  statsd_agg_t maps[2], *active = &maps[0];
+  static statsd_snapshot_t snap;
+  statsd_pool_t pool;
+  statsd_queue_t queue;
+  long steady = 0, packets = 0;
+
+  tables_init();
+  agg_init(&maps[0]);
+  agg_init(&maps[1]);
+  pool_init(&pool, 64, BUFLEN + 1);
+  queue_init(&queue, 64, 1, 0);
+  fill();
+
+  for (i = 0; i < WARMUP + intervals; i++) {
+    long before = atomic_load(&allocations);
+    statsd_agg_t *retired;
+
+    for (d = 0; d < DATAGRAMS; d++) {
+      statsd_packet_t *packet = pool_acquire(&pool);
+      memcpy(packet->data, corpus[d], lens[d]);
+      packet->len = lens[d];
+      packet->data[packet->len] = '\0';
+      queue_store(&queue, packet);
+
+      packet = queue_pop_first(&queue);
+      process_stats_packet(active, packet->data, packet->len);
+      pool_release(packet);
+    }
+    if (i >= WARMUP) {
+      steady += atomic_load(&allocations) - before;
+      packets += DATAGRAMS;
+    }
+
+    /* The flush: swap, merge, snapshot */
+    retired = active;
+    active = active == &maps[0] ? &maps[1] : &maps[0];
+    agg_merge(retired);
+    snapshot_take(&snap);
+    snapshot_release(&snap);
+  }
+
+  printf("%ld allocations over %ld packets after warmup\n", steady, packets);
+  /* Setting up allocated plenty, so the counting works */
+  CHECK(atomic_load(&allocations) > 0);
+  CHECK(packets > 0);
+  CHECK(steady == 0);
+  test_key_oom();
+  test_sketch_oom();
+  pool_destroy(&pool);
+  queue_destroy(&queue);
+  return CHECK_RESULT;
+}
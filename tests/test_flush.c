@@ -0,0 +1,341 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * End to end: the same workload through statsd with one listener, worker
+ * and flusher, and with several of each, must flush the same lines to
+ * graphite. This program stands in for carbon. For each configuration
+ * it starts statsd with a one second flush, waits for the first (empty)
+ * flush, sends the workload over UDP from several sockets, so that the
+ * listeners' SO_REUSEPORT hashing spreads it, and collects the next
+ * flush up to its statsd.numStats line. Lines are compared without
+ * their timestamps and in sorted order, values to within 1e-9 relative:
+ * timer means and deviations are summed in arrival order, which several
+ * workers don't keep. The workload avoids what legitimately depends on
+ * that order, such as a gauge set and adjusted in separate datagrams.
+ *
+ * Usage: test_flush path/to/statsd
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "check.h"
+
+#define SENDERS 8
+#define DATAGRAM_MAX 1400
+#define FLUSH_MAX ( 1 << 20 )
+#define LINES_MAX 8192
+#define TIMEOUT 15
+
+typedef struct {
+  char name[128];
+  double value;
+} flush_line_t;
+
+typedef struct {
+  flush_line_t lines[LINES_MAX];
+  int count;
+} flush_t;
+
+static const char *configs[][7] = {
+  { NULL },
+  { "-w", "4", "-W", "4", NULL },
+  { "-j", "4", NULL },
+  { "-w", "4", "-W", "4", "-j", "4", NULL }
+};
+#define CONFIGS ( sizeof(configs) / sizeof(configs[0]) )
+
+static const char *statsd_path;
+static flush_t flushes[CONFIGS];
+
+/* A port nothing is bound to right now, for statsd to take */
+static int free_port(int type) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int sock = socket(AF_INET, type, 0), port = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0
+      && getsockname(sock, (struct sockaddr *) &addr, &len) == 0) {
+    port = ntohs(addr.sin_port);
+  }
+  close(sock);
+  return port;
+}
+
+static pid_t start_statsd(const char **extra, int udp, int mgmt, int carbon) {
+  char udp_s[8], mgmt_s[8], carbon_s[8];
+  const char *argv[32];
+  int argc = 0, i;
+  pid_t pid;
+
+  sprintf(udp_s, "%d", udp);
+  sprintf(mgmt_s, "%d", mgmt);
+  sprintf(carbon_s, "%d", carbon);
+  argv[argc++] = statsd_path;
+  argv[argc++] = "-F";
+  argv[argc++] = "1";
+  argv[argc++] = "-p";
+  argv[argc++] = udp_s;
+  argv[argc++] = "-m";
+  argv[argc++] = mgmt_s;
+  argv[argc++] = "-R";
+  argv[argc++] = "127.0.0.1";
+  argv[argc++] = "-r";
+  argv[argc++] = carbon_s;
+  for (i = 0; extra[i] != NULL; i++) argv[argc++] = extra[i];
+  argv[argc] = NULL;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    execv(statsd_path, (char **) argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+static void stop_statsd(pid_t pid) {
+  int i;
+  kill(pid, SIGINT);
+  for (i = 0; i < 50; i++) {
+    if (waitpid(pid, NULL, WNOHANG) == pid) return;
+    usleep(100000);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+/*
+ * Read from the carbon connection until a whole flush, ending in its
+ * statsd.numStats line, is in buf. Returns the flush's length, leaving
+ * whatever follows it at buf + that, or -1 on timeout or close.
+ */
+static int read_flush(int conn, char *buf, int *have, time_t deadline) {
+  for (;;) {
+    char *end = strstr(buf, "statsd.numStats ");
+    struct pollfd pfd = { conn, POLLIN, 0 };
+    int n;
+
+    if (end != NULL && ( end = strchr(end, '\n') ) != NULL) return end + 1 - buf;
+    if (time(NULL) > deadline || poll(&pfd, 1, 500) < 0) return -1;
+    if (!( pfd.revents & ( POLLIN | POLLHUP ) )) continue;
+    n = recv(conn, buf + *have, FLUSH_MAX - 1 - *have, 0);
+    if (n <= 0) return -1;
+    *have += n;
+    buf[*have] = '\0';
+  }
+}
+
+static int compare_lines(const void *a, const void *b) {
+  return strcmp(( (const flush_line_t *) a )->name, ( (const flush_line_t *) b )->name);
+}
+
+/* "name value timestamp" lines, kept as name and value, sorted */
+static void parse_flush(char *buf, int len, flush_t *out) {
+  char *line = buf, *end = buf + len;
+
+  out->count = 0;
+  while (line < end && out->count < LINES_MAX) {
+    char *nl = memchr(line, '\n', end - line), *space = memchr(line, ' ', nl - line);
+    flush_line_t *l = &out->lines[out->count];
+
+    if (space != NULL && space - line < (int) sizeof(l->name)) {
+      memcpy(l->name, line, space - line);
+      l->name[space - line] = '\0';
+      l->value = strtod(space + 1, NULL);
+      out->count++;
+    }
+    line = nl + 1;
+  }
+  qsort(out->lines, out->count, sizeof(flush_line_t), compare_lines);
+}
+
+static int next_line(char *line, uint64_t *rng) {
+  uint64_t r;
+
+  *rng ^= *rng >> 12;
+  *rng ^= *rng << 25;
+  *rng ^= *rng >> 27;
+  r = *rng * 2685821657736338717ull;
+
+  switch (r % 8) {
+    case 0: case 1:
+      return sprintf(line, "eq.counter.%d:%d|c", (int) ( ( r >> 8 ) % 200 ), (int) ( ( r >> 16 ) % 10 ));
+    case 2:
+      return sprintf(line, "eq.sampled.%d:%d|c|@0.25", (int) ( ( r >> 8 ) % 50 ), (int) ( ( r >> 16 ) % 10 ));
+    case 3: case 4:
+      return sprintf(line, "eq.timer.%d:%d|ms", (int) ( ( r >> 8 ) % 100 ), (int) ( ( r >> 16 ) % 1000 ));
+    case 5:
+      return sprintf(line, "eq.delta.%d:%c%d|g", (int) ( ( r >> 8 ) % 50 ), r & ( 1 << 20 ) ? '+' : '-', (int) ( ( r >> 24 ) % 100 ));
+    default:
+      return sprintf(line, "eq.set.%d:member%d|s", (int) ( ( r >> 8 ) % 20 ), (int) ( ( r >> 16 ) % 5000 ));
+  }
+}
+
+/* Sends the workload, the same every time; returns 0 if all of it went */
+static int send_workload(int udp) {
+  struct sockaddr_in addr;
+  char buf[DATAGRAM_MAX + 128], line[128];
+  uint64_t rng = 5;
+  int senders[SENDERS], len = 0, datagrams = 0, i, ok = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(udp);
+  for (i = 0; i < SENDERS; i++) senders[i] = socket(AF_INET, SOCK_DGRAM, 0);
+
+  /* Absolute gauges are set once each, in the first datagram */
+  for (i = 0; i < 20; i++) {
+    len += sprintf(buf + len, "%seq.gauge.%d:%d|g", i ? "\n" : "", i, i * 7);
+  }
+  for (i = 0; i <= 20000; i++) {
+    int n = i < 20000 ? next_line(line, &rng) : 0;
+    if (i == 20000 || len + 1 + n > DATAGRAM_MAX) {
+      if (sendto(senders[datagrams % SENDERS], buf, len, 0, (struct sockaddr *) &addr, sizeof(addr)) != len) ok = 0;
+      /* Paced, so the receive buffers don't overflow */
+      if (++datagrams % 16 == 0) usleep(1000);
+      len = 0;
+    }
+    if (len > 0) buf[len++] = '\n';
+    memcpy(buf + len, line, n);
+    len += n;
+  }
+  for (i = 0; i < SENDERS; i++) close(senders[i]);
+  return ok ? 0 : -1;
+}
+
+static int run(const char **extra, flush_t *out) {
+  static char buf[FLUSH_MAX];
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int carbon = socket(AF_INET, SOCK_STREAM, 0), conn = -1, have = 0, len, rc = -1;
+  int udp = free_port(SOCK_DGRAM), mgmt = free_port(SOCK_STREAM);
+  time_t deadline = time(NULL) + TIMEOUT;
+  struct pollfd pfd;
+  pid_t pid;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(carbon, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(carbon, 1) < 0
+      || getsockname(carbon, (struct sockaddr *) &addr, &addrlen) < 0) {
+    perror("carbon");
+    close(carbon);
+    return -1;
+  }
+
+  pid = start_statsd(extra, udp, mgmt, ntohs(addr.sin_port));
+  pfd.fd = carbon;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, TIMEOUT * 1000) == 1) conn = accept(carbon, NULL, NULL);
+  if (conn < 0) {
+    fprintf(stderr, "statsd never connected\n");
+    goto done;
+  }
+
+  /* The first flush is empty; send straight after it, so the workload is in the next one */
+  buf[0] = '\0';
+  if (( len = read_flush(conn, buf, &have, deadline) ) < 0) {
+    fprintf(stderr, "no first flush\n");
+    goto done;
+  }
+  memmove(buf, buf + len, have - len + 1);
+  have -= len;
+  if (send_workload(udp) < 0) {
+    fprintf(stderr, "sending the workload failed: %s\n", strerror(errno));
+    goto done;
+  }
+  if (( len = read_flush(conn, buf, &have, deadline) ) < 0) {
+    fprintf(stderr, "no second flush\n");
+    goto done;
+  }
+  parse_flush(buf, len, out);
+  rc = 0;
+
+done:
+  stop_statsd(pid);
+  if (conn >= 0) close(conn);
+  close(carbon);
+  return rc;
+}
+
+static void describe(const char **extra, char *s) {
+  int i;
+  strcpy(s, extra[0] ? "" : "defaults");
+  for (i = 0; extra[i] != NULL; i++) {
+    strcat(s, i ? " " : "");
+    strcat(s, extra[i]);
+  }
+}
+
+static void compare(unsigned c) {
+  const flush_t *a = &flushes[0], *b = &flushes[c];
+  char name[64];
+  int i;
+
+  describe(configs[c], name);
+  if (a->count != b->count) {
+    fprintf(stderr, "%s: %d lines, against %d with defaults\n", name, b->count, a->count);
+    check_failures++;
+    return;
+  }
+  for (i = 0; i < a->count; i++) {
+    const flush_line_t *x = &a->lines[i], *y = &b->lines[i];
+    if (strcmp(x->name, y->name) != 0) {
+      fprintf(stderr, "%s: %s where defaults have %s\n", name, y->name, x->name);
+      check_failures++;
+      return;
+    }
+    if (!( fabs(x->value - y->value) <= 1e-9 * fabs(x->value) )) {
+      fprintf(stderr, "%s: %s is %.17g, %.17g with defaults\n", name, x->name, y->value, x->value);
+      check_failures++;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  unsigned c;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s path/to/statsd\n", argv[0]);
+    return 2;
+  }
+  statsd_path = argv[1];
+  signal(SIGPIPE, SIG_IGN);
+
+  for (c = 0; c < CONFIGS; c++) {
+    char name[64];
+    describe(configs[c], name);
+    if (run(configs[c], &flushes[c]) < 0) {
+      fprintf(stderr, "%s: no flush to compare\n", name);
+      return 1;
+    }
+    printf("%s: %d lines\n", name, flushes[c].count);
+  }
+  /* Every key of the workload should be there, not just agree */
+  CHECK(flushes[0].count > 400);
+  for (c = 1; c < CONFIGS; c++) compare(c);
+  return CHECK_RESULT;
+}
@@ -0,0 +1,180 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * The graphite line formatter: format_double() on fixed cases, then on
+ * random doubles of every magnitude, where its text must read back as
+ * the same double, bit for bit, in at most 17 digits, and only rarely
+ * be longer than the shortest "%.Ng" that does; never for short
+ * decimals. Grisu2 misses the shortest text when it lies exactly on the
+ * rounding boundary, which strtod() only takes by rounding half to even.
+ * Then format_long() at its limits, and whole lines from the lines_*()
+ * builder.
+ *
+ * Usage: test_format [iterations] [seed]
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/format.h"
+#include "check.h"
+
+static uint64_t rng;
+
+static uint64_t next() {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ull;
+}
+
+static void check_double(double value, const char *expect) {
+  char buf[FORMAT_NUMBER_MAX];
+  int len = format_double(value, buf);
+  if (strcmp(buf, expect) != 0 || len != (int) strlen(expect)) {
+    fprintf(stderr, "format_double(%.17g) gave '%s', not '%s'\n", value, buf, expect);
+    check_failures++;
+  }
+}
+
+static void test_cases() {
+  char buf[FORMAT_NUMBER_MAX];
+
+  check_double(0, "0");
+  check_double(-0.0, "0");
+  check_double(1, "1");
+  check_double(-42, "-42");
+  check_double(0.5, "0.5");
+  check_double(0.1, "0.1");
+  check_double(1.0 / 3, "0.3333333333333333");
+  check_double(123.456, "123.456");
+  check_double(-2.5e-3, "-0.0025");
+  check_double(1e-6, "0.000001");
+  check_double(1e-7, "1e-7");
+  check_double(1.5e-7, "1.5e-7");
+  check_double(9007199254740991.0, "9007199254740991");
+  check_double(1e20, "100000000000000000000");
+  check_double(1e21, "1e+21");
+  check_double(1.5e300, "1.5e+300");
+  check_double(5e-324, "5e-324");
+  check_double(1.7976931348623157e308, "1.7976931348623157e+308");
+  check_double(NAN, "nan");
+  check_double(INFINITY, "inf");
+  check_double(-INFINITY, "-inf");
+
+  CHECK(format_long(0, buf) == 1 && strcmp(buf, "0") == 0);
+  CHECK(format_long(-7, buf) == 2 && strcmp(buf, "-7") == 0);
+  format_long(LONG_MAX, buf);
+  CHECK(strtol(buf, NULL, 10) == LONG_MAX);
+  format_long(LONG_MIN, buf);
+  CHECK(strtol(buf, NULL, 10) == LONG_MIN && buf[0] == '-');
+}
+
+/* Random bits, random decimals like timers give, and whole numbers */
+static double random_double(long i) {
+  uint64_t bits;
+  double value;
+
+  switch (i % 3) {
+    case 0:
+      do {
+        bits = next();
+        memcpy(&value, &bits, sizeof(double));
+      } while (isnan(value) || isinf(value));
+      return value;
+    case 1:
+      return (double) ( next() % 10000000 ) / 1000;
+    default:
+      return (double) (int64_t) ( next() >> ( next() % 64 ) ) * ( next() & 1 ? 1 : -1 );
+  }
+}
+
+/* Digits less sign, point, exponent, and leading or whole-number trailing zeros */
+static int significant_digits(const char *buf, int len) {
+  const char *p;
+  int n = 0;
+
+  for (p = buf; p < buf + len && *p != 'e'; p++) {
+    if (*p >= '0' && *p <= '9' && !( n == 0 && *p == '0' )) n++;
+  }
+  if (strchr(buf, '.') == NULL && strchr(buf, 'e') == NULL) {
+    for (p = buf + len - 1; p > buf && *p == '0'; p--) n--;
+  }
+  return n;
+}
+
+static long test_random(long iterations) {
+  long i, longer = 0;
+
+  for (i = 0; i < iterations && check_failures < 20; i++) {
+    double value = random_double(i), back;
+    char buf[FORMAT_NUMBER_MAX], shortest[40];
+    int len = format_double(value, buf), n, digits;
+
+    back = strtod(buf, NULL);
+    if (memcmp(&back, &value, sizeof(double)) != 0 && !( value == 0 && back == 0 )) {
+      fprintf(stderr, "'%s' reads back as %.17g, not %.17g\n", buf, back, value);
+      check_failures++;
+      continue;
+    }
+    for (digits = 1; digits <= 17; digits++) {
+      n = snprintf(shortest, sizeof(shortest), "%.*g", digits, value);
+      if (strtod(shortest, NULL) == value) break;
+    }
+    n = significant_digits(buf, len);
+    if (n > 17) {
+      fprintf(stderr, "'%s' has %d digits\n", buf, n);
+      check_failures++;
+    } else if (n > digits && i % 3 == 1) {
+      /* Short decimals, as timers send, always come out as sent */
+      fprintf(stderr, "'%s' is longer than %.*g\n", buf, digits, value);
+      check_failures++;
+    } else if (n > digits) {
+      longer++;
+    }
+  }
+  return longer;
+}
+
+static void test_lines() {
+  const char *expect =
+    "stats.timers.api_latency.mean 12.5 1700000000\n"
+    "stats.timers.api_latency.count 4 1700000000\n"
+    "stats_counts_api_latency -3 1700000000\n";
+  statsd_key_t *key = key_intern("api_latency", 11, -1);
+  statsd_lines_t lines;
+  UT_string *out;
+
+  utstring_new(out);
+  lines_init(&lines, out, "1700000000");
+  lines_stem(&lines, "stats.timers.", key, ".");
+  lines_add(&lines, "mean", 12.5);
+  lines_add_long(&lines, "count", 4);
+  lines_stem(&lines, "stats_counts_", key, "");
+  lines_add(&lines, "", -3);
+  CHECK(strcmp(utstring_body(out), expect) == 0);
+  CHECK(utstring_len(out) == strlen(expect));
+  utstring_free(out);
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 200000, longer;
+
+  rng = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  keys_init();
+  test_cases();
+  test_lines();
+  longer = test_random(iterations);
+  printf("%ld of %ld longer than the shortest\n", longer, iterations);
+  /* About 0.1% of random doubles, more of the whole numbers past 2^53 */
+  CHECK(longer <= iterations / 100);
+  return CHECK_RESULT;
+}
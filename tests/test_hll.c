@@ -0,0 +1,139 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * HyperLogLog sets: at several precisions and cardinalities from 1 to
+ * 100000, the error of hll_count() over independent trials must be in
+ * line with the standard error 1.04 / sqrt(2^p), and small sets must
+ * be off by at most one. Duplicates must not count. Every merge kernel
+ * the CPU supports must give the registers the scalar one does, and a
+ * merged set the registers of one built from the union.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/hll.h"
+#include "check.h"
+
+#define TRIALS 16
+
+static void add_values(statsd_hll_t *h, long from, long n) {
+  char value[32];
+  long i;
+  for (i = from; i < from + n; i++) {
+    int len = sprintf(value, "user%ld", i);
+    hll_add(h, hll_hash(value, len));
+  }
+}
+
+static void test_error(int precision) {
+  static const long cardinalities[] = { 1, 2, 5, 10, 100, 1000, 10000, 100000 };
+  double sigma = 1.04 / sqrt((double) ( 1 << precision ));
+  unsigned c;
+  int t;
+
+  hll_init(precision);
+  for (c = 0; c < sizeof(cardinalities) / sizeof(cardinalities[0]); c++) {
+    long n = cardinalities[c];
+    double squares = 0, worst = 0;
+
+    for (t = 0; t < TRIALS; t++) {
+      statsd_hll_t *h = hll_new();
+      double err;
+      add_values(h, ( t + 1 ) * 10000000L, n);
+      err = ( hll_count(h) - n ) / n;
+      squares += err * err;
+      if (fabs(err) > worst) worst = fabs(err);
+      hll_free(h);
+    }
+    if (n <= 10) {
+      /* Linear counting: off by a value only where two share a register */
+      CHECK(worst * n < 1.5);
+    } else {
+      double rms = sqrt(squares / TRIALS);
+      if (rms > 2 * sigma || worst > 5 * sigma) {
+        fprintf(stderr, "p %d, %ld values: rms error %.4f, worst %.4f, standard error %.4f\n",
+          precision, n, rms, worst, sigma);
+        check_failures++;
+      }
+    }
+  }
+}
+
+static void test_duplicates() {
+  statsd_hll_t *a, *b;
+
+  hll_init(HLL_PRECISION_DEFAULT);
+  a = hll_new();
+  b = hll_new();
+  CHECK_NEAR(hll_count(a), 0, 0);
+  add_values(a, 0, 5000);
+  add_values(b, 0, 5000);
+  add_values(b, 0, 5000);
+  add_values(b, 2500, 2500);
+  CHECK(memcmp(a->registers, b->registers, (size_t) 1 << hll_precision) == 0);
+  CHECK_NEAR(hll_count(a), hll_count(b), 0);
+  CHECK(b->added == 12500);
+  hll_free(a);
+  hll_free(b);
+}
+
+static void test_merge(const char *kernel, int precision) {
+  statsd_hll_t *a, *b, *expect, *both;
+
+  hll_init(precision);
+  a = hll_new();
+  b = hll_new();
+  expect = hll_new();
+  both = hll_new();
+
+  /* Overlapping halves, merged by the scalar kernel and by kernel */
+  add_values(a, 0, 30000);
+  add_values(b, 20000, 30000);
+  hll_select("scalar");
+  hll_merge(expect, a);
+  hll_merge(expect, b);
+  add_values(both, 0, 50000);
+  CHECK(memcmp(expect->registers, both->registers, (size_t) 1 << hll_precision) == 0);
+
+  if (hll_select(kernel)) {
+    statsd_hll_t *got = hll_new();
+    hll_merge(got, a);
+    hll_merge(got, b);
+    if (memcmp(got->registers, expect->registers, (size_t) 1 << hll_precision) != 0) {
+      fprintf(stderr, "%s merge differs from scalar at precision %d\n", kernel, precision);
+      check_failures++;
+    }
+    CHECK(got->added == a->added + b->added);
+    hll_free(got);
+  }
+  hll_free(a);
+  hll_free(b);
+  hll_free(expect);
+  hll_free(both);
+}
+
+int main() {
+  static const char *kernels[] = { "scalar", "sse2", "avx2" };
+  unsigned k;
+  int p;
+
+  test_error(8);
+  test_error(12);
+  test_error(14);
+  test_duplicates();
+  for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    for (p = HLL_PRECISION_MIN; p <= HLL_PRECISION_MAX; p++) {
+      test_merge(kernels[k], p);
+    }
+  }
+  CHECK(!hll_select("nonesuch"));
+  return CHECK_RESULT;
+}
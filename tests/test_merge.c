@@ -0,0 +1,231 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Sharded aggregation under concurrency: the same datagrams, parsed by
+ * eight worker threads into their own maps while a collector swaps and
+ * merges those maps as collect_aggregates() does, must leave the global
+ * tables as parsing them all on one thread and merging once does. The
+ * two runs use the same keys under different prefixes, "one." and
+ * "many.", and every key of one is compared with its twin in the other.
+ * Counts and sums are exact; gauges are only adjusted, so the order
+ * they arrive in does not matter.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/aggregate.h"
+#include "../src/ingest.h"
+#include "../src/statsd.h"
+#include "check.h"
+#include "tables.h"
+
+#define DATAGRAMS 4000
+#define DATAGRAM_MAX 1400
+#define WORKERS 8
+#define COUNTERS 300
+#define TIMERS 100
+#define GAUGES 50
+#define SETS 20
+
+typedef struct {
+  int id;
+  pthread_t thread;
+  pthread_mutex_t agg_lock;
+  statsd_agg_t agg[2];
+  statsd_agg_t *active;
+} worker_t;
+
+static char corpus[DATAGRAMS][DATAGRAM_MAX + 1];
+static int lens[DATAGRAMS];
+static worker_t workers[WORKERS];
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int running;
+static int collections;
+
+static void fill() {
+  uint64_t rng = 17;
+  int d;
+
+  for (d = 0; d < DATAGRAMS; d++) {
+    char line[128];
+    int len = 0, lines = 0, n;
+    for (;;) {
+      uint64_t r;
+      rng ^= rng >> 12;
+      rng ^= rng << 25;
+      rng ^= rng >> 27;
+      r = rng * 2685821657736338717ull;
+      switch (r % 4) {
+        case 0:
+          n = sprintf(line, "c%d:%d|c", (int) ( ( r >> 8 ) % COUNTERS ), (int) ( ( r >> 24 ) % 10 ));
+          break;
+        case 1:
+          n = sprintf(line, "t%d:%d|ms", (int) ( ( r >> 8 ) % TIMERS ), (int) ( ( r >> 24 ) % 1000 ));
+          break;
+        case 2:
+          n = sprintf(line, "g%d:%c%d|g", (int) ( ( r >> 8 ) % GAUGES ), r & ( 1 << 20 ) ? '+' : '-', (int) ( ( r >> 24 ) % 100 ));
+          break;
+        default:
+          n = sprintf(line, "s%d:m%d|s", (int) ( ( r >> 8 ) % SETS ), (int) ( ( r >> 24 ) % 3000 ));
+          break;
+      }
+      /* Leave room for the prefix added to every line when it is sent */
+      if (len + 1 + n + 5 * ( lines + 1 ) > DATAGRAM_MAX) break;
+      if (len > 0) corpus[d][len++] = '\n';
+      memcpy(corpus[d] + len, line, n);
+      len += n;
+      lines++;
+    }
+    lens[d] = len;
+  }
+}
+
+/* Datagram d with prefix before each of its lines, parsed into agg */
+static void send_datagram(statsd_agg_t *agg, int d, const char *prefix) {
+  char buf[BUFLEN + 1];
+  const char *p = corpus[d], *end = corpus[d] + lens[d];
+  int len = 0, plen = strlen(prefix);
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    int n = ( nl ? nl : end ) - p;
+    if (len > 0) buf[len++] = '\n';
+    memcpy(buf + len, prefix, plen);
+    memcpy(buf + len + plen, p, n);
+    len += plen + n;
+    p += n + 1;
+  }
+  buf[len] = '\0';
+  process_stats_packet(agg, buf, len);
+}
+
+static void *worker_run(void *ptr) {
+  worker_t *w = (worker_t *) ptr;
+  int d;
+
+  for (d = w->id; d < DATAGRAMS; d += WORKERS) {
+    pthread_mutex_lock(&w->agg_lock);
+    send_datagram(w->active, d, "many.");
+    pthread_mutex_unlock(&w->agg_lock);
+  }
+  return NULL;
+}
+
+/* Swap each worker's map under its lock, then merge the retired one */
+static void collect() {
+  int i;
+  pthread_mutex_lock(&merge_lock);
+  for (i = 0; i < WORKERS; i++) {
+    statsd_agg_t *retired;
+    pthread_mutex_lock(&workers[i].agg_lock);
+    retired = workers[i].active;
+    workers[i].active = retired == &workers[i].agg[0] ? &workers[i].agg[1] : &workers[i].agg[0];
+    pthread_mutex_unlock(&workers[i].agg_lock);
+    agg_merge(retired);
+  }
+  collections++;
+  pthread_mutex_unlock(&merge_lock);
+}
+
+static void *collector_run(void *ptr) {
+  (void) ptr;
+  while (atomic_load(&running)) {
+    collect();
+    usleep(200);
+  }
+  return NULL;
+}
+
+static statsd_key_t *key(const char *prefix, const char *kind, int i) {
+  char name[64];
+  int len = sprintf(name, "%s_%s%d", prefix, kind, i);
+  return key_intern(name, len, -1);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void compare_tables() {
+  int i;
+
+  for (i = 0; i < COUNTERS; i++) {
+    statsd_counter_t *a = idtable_get(&counters, key("one", "c", i)->id);
+    statsd_counter_t *b = idtable_get(&counters, key("many", "c", i)->id);
+    CHECK(( a == NULL ) == ( b == NULL ));
+    if (a && b) CHECK_NEAR((double) a->value, (double) b->value, 0);
+  }
+  for (i = 0; i < TIMERS; i++) {
+    statsd_timer_t *a = idtable_get(&timers, key("one", "t", i)->id);
+    statsd_timer_t *b = idtable_get(&timers, key("many", "t", i)->id);
+    CHECK(( a == NULL ) == ( b == NULL ));
+    if (a && b) {
+      CHECK(a->count == b->count);
+      if (a->count == b->count) {
+        qsort(a->values, a->count, sizeof(double), compare_double);
+        qsort(b->values, b->count, sizeof(double), compare_double);
+        CHECK(memcmp(a->values, b->values, a->count * sizeof(double)) == 0);
+      }
+    }
+  }
+  for (i = 0; i < GAUGES; i++) {
+    statsd_gauge_t *a = idtable_get(&gauges, key("one", "g", i)->id);
+    statsd_gauge_t *b = idtable_get(&gauges, key("many", "g", i)->id);
+    CHECK(( a == NULL ) == ( b == NULL ));
+    if (a && b) CHECK_NEAR((double) a->value, (double) b->value, 0);
+  }
+  for (i = 0; i < SETS; i++) {
+    statsd_set_t *a = idtable_get(&sets, key("one", "s", i)->id);
+    statsd_set_t *b = idtable_get(&sets, key("many", "s", i)->id);
+    CHECK(a && b && a->hll && b->hll);
+    if (a && b && a->hll && b->hll) {
+      CHECK(memcmp(a->hll->registers, b->hll->registers, (size_t) 1 << hll_precision) == 0);
+    }
+  }
+}
+
+int main() {
+  pthread_t collector;
+  statsd_agg_t agg;
+  int d, i;
+
+  tables_init();
+  fill();
+
+  /* One thread, one merge */
+  agg_init(&agg);
+  for (d = 0; d < DATAGRAMS; d++) send_datagram(&agg, d, "one.");
+  agg_merge(&agg);
+
+  /* Many threads, merged while they run and once more after */
+  atomic_store(&running, 1);
+  for (i = 0; i < WORKERS; i++) {
+    workers[i].id = i;
+    pthread_mutex_init(&workers[i].agg_lock, NULL);
+    agg_init(&workers[i].agg[0]);
+    agg_init(&workers[i].agg[1]);
+    workers[i].active = &workers[i].agg[0];
+  }
+  pthread_create(&collector, NULL, collector_run, NULL);
+  for (i = 0; i < WORKERS; i++) pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+  for (i = 0; i < WORKERS; i++) pthread_join(workers[i].thread, NULL);
+  atomic_store(&running, 0);
+  pthread_join(collector, NULL);
+  collect();
+  printf("%d collections while %d workers ran\n", collections, WORKERS);
+
+  compare_tables();
+  return CHECK_RESULT;
+}
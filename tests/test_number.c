@@ -0,0 +1,135 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Differential fuzz of statsd_parse_number() against strtod(). Both see
+ * the same strings: well formed numbers of every length and shape, and
+ * random runs of digits, signs, dots, exponents and spaces. Whenever
+ * statsd_parse_number() accepts a string, strtod() must take all of it
+ * and give the same double, bit for bit. It must reject exactly what
+ * strtod() can't take whole, and what strtod() only takes as an
+ * extension of plain decimals: leading spaces, hex, inf and nan.
+ *
+ * Usage: test_number [iterations] [seed]
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/parser.h"
+#include "check.h"
+
+#define FUZZ_MAX 100
+
+static uint64_t rng;
+
+static uint64_t next() {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ull;
+}
+
+static int digits(char *p, int n) {
+  int i;
+  for (i = 0; i < n; i++) p[i] = '0' + next() % 10;
+  return n;
+}
+
+/* [+-]digits[.digits][e[+-]digits], each part of random length, some empty */
+static int well_formed(char *p) {
+  int len = 0, r = next() % 8;
+
+  if (r == 0) p[len++] = '-';
+  if (r == 1) p[len++] = '+';
+  len += digits(p + len, next() % 20);
+  if (next() % 2) {
+    p[len++] = '.';
+    len += digits(p + len, next() % 25);
+  }
+  if (next() % 6 == 0) {
+    p[len++] = next() % 2 ? 'e' : 'E';
+    r = next() % 3;
+    if (r == 0) p[len++] = '-';
+    if (r == 1) p[len++] = '+';
+    len += digits(p + len, next() % 4);
+  }
+  return len;
+}
+
+static int garbage(char *p) {
+  static const char alphabet[] = "0123456789.+-eE ";
+  int len = next() % 12, i;
+  for (i = 0; i < len; i++) p[i] = alphabet[next() % ( sizeof(alphabet) - 1 )];
+  return len;
+}
+
+/* Mostly the short numbers clients send, now and then a long one */
+static int typical(char *p) {
+  long v = next() % 100000;
+  switch (next() % 4) {
+    case 0: return sprintf(p, "%ld", v);
+    case 1: return sprintf(p, "%ld.%ld", v / 100, v % 100);
+    case 2: return sprintf(p, "-%ld.%03ld", v / 1000, v % 1000);
+    default: return sprintf(p, "0.%06ld", v);
+  }
+}
+
+static void compare(const char *s, int len) {
+  char buf[FUZZ_MAX + 1], *end;
+  double ours = 0, theirs;
+  int accepted, whole;
+
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  accepted = statsd_parse_number(s, len, &ours) == 0;
+  theirs = strtod(buf, &end);
+  whole = len > 0 && end == buf + len && strspn(buf, "0123456789.+-eE") == (size_t) len;
+
+  if (accepted != whole) {
+    fprintf(stderr, "'%s': statsd_parse_number %s it, strtod %s\n", buf,
+      accepted ? "accepts" : "rejects", whole ? "takes it whole" : "does not");
+    check_failures++;
+  } else if (accepted && memcmp(&ours, &theirs, sizeof(double)) != 0) {
+    fprintf(stderr, "'%s': %.17g != strtod's %.17g\n", buf, ours, theirs);
+    check_failures++;
+  }
+}
+
+static void test_cases() {
+  static const char *cases[] = {
+    "0", "-0", "+0", "1", "-1", "1.", ".5", "-.5", "007", "0.1", "0.3",
+    "123.456", "99999999999999.9", "999999999999999", "9999999999999999",
+    "9007199254740993", "0.000000000000000000001", "1e308", "1e309",
+    "4.9e-324", "2.2250738585072011e-308", "1.7976931348623157e308",
+    "123456789012345678901234567890", "0.1234567890123456789", "1e", "1e+",
+    "e5", ".", "-", "+", "", " 1", "1 ", "1.2.3", "--1", "1e5.5", "0x10",
+    "inf", "nan", "1,5"
+  };
+  unsigned i;
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    compare(cases[i], strlen(cases[i]));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000, i;
+  char s[FUZZ_MAX];
+
+  rng = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  test_cases();
+  for (i = 0; i < iterations && check_failures < 20; i++) {
+    switch (i % 3) {
+      case 0: compare(s, well_formed(s)); break;
+      case 1: compare(s, garbage(s)); break;
+      default: compare(s, typical(s)); break;
+    }
+  }
+  return CHECK_RESULT;
+}
@@ -0,0 +1,209 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Datagrams through process_stats_packet() into the global tables: one
+ * metric per packet, several per packet split on newlines, and the two
+ * giving the same result.
+ */
+
+#include <string.h>
+
+#include "../src/aggregate.h"
+#include "../src/ingest.h"
+#include "../src/statsd.h"
+#include "check.h"
+#include "tables.h"
+
+static statsd_agg_t agg;
+
+/* Copy first, the packet is parsed in place */
+static void packet_n(const char *data, int len) {
+  static char buf[BUFLEN + 1];
+  memcpy(buf, data, len);
+  buf[len] = '\0';
+  process_stats_packet(&agg, buf, len);
+}
+
+static void packet(const char *data) {
+  packet_n(data, strlen(data));
+}
+
+static statsd_key_t *key(const char *name) {
+  return key_intern(name, strlen(name), -1);
+}
+
+static double counter(const char *name) {
+  statsd_counter_t *c;
+  agg_merge(&agg);
+  c = idtable_get(&counters, key(name)->id);
+  return c ? (double) c->value : NAN;
+}
+
+static double gauge(const char *name) {
+  statsd_gauge_t *g;
+  agg_merge(&agg);
+  g = idtable_get(&gauges, key(name)->id);
+  return g ? (double) g->value : NAN;
+}
+
+static statsd_timer_t *timer(const char *name) {
+  agg_merge(&agg);
+  return idtable_get(&timers, key(name)->id);
+}
+
+static double timer_sum(const char *name) {
+  statsd_timer_t *t = timer(name);
+  double sum = 0;
+  int i;
+  for (i = 0; t && i < t->count; i++) sum += t->values[i];
+  return sum;
+}
+
+static double set_count(const char *name) {
+  statsd_set_t *s;
+  agg_merge(&agg);
+  s = idtable_get(&sets, key(name)->id);
+  return s && s->hll ? hll_count(s->hll) : NAN;
+}
+
+static void test_single() {
+  packet("single_c:3|c");
+  packet("single_ms:12.5|ms");
+  packet("single_g:7|g");
+  packet("single_s:alice|s");
+  packet("single_bare");
+
+  CHECK_NEAR(counter("single_c"), 3, 0);
+  CHECK(timer("single_ms") && timer("single_ms")->count == 1);
+  CHECK_NEAR(timer_sum("single_ms"), 12.5, 0);
+  CHECK_NEAR(gauge("single_g"), 7, 0);
+  CHECK_NEAR(set_count("single_s"), 1, 0.01);
+  CHECK_NEAR(counter("single_bare"), 1, 0);
+}
+
+static void test_batched() {
+  packet("batch_a:1|c\nbatch_b:2|c\nbatch_t:3|ms\nbatch_t:4|ms\nbatch_g:10|g\nbatch_g:-4|g\nbatch_g:+1|g");
+
+  CHECK_NEAR(counter("batch_a"), 1, 0);
+  CHECK_NEAR(counter("batch_b"), 2, 0);
+  CHECK(timer("batch_t") && timer("batch_t")->count == 2);
+  CHECK_NEAR(timer_sum("batch_t"), 7, 0);
+  CHECK_NEAR(gauge("batch_g"), 7, 0);
+}
+
+static void test_line_endings() {
+  /* CRLF, blank lines, a trailing newline and one-byte fragments */
+  packet("crlf_a:1|c\r\ncrlf_b:2|c\r\n");
+  packet("\n\nblank_a:5|c\n\n\nblank_b:6|c\n");
+  packet("x\nfrag:1|c\ny");
+
+  CHECK_NEAR(counter("crlf_a"), 1, 0);
+  CHECK_NEAR(counter("crlf_b"), 2, 0);
+  CHECK_NEAR(counter("blank_a"), 5, 0);
+  CHECK_NEAR(counter("blank_b"), 6, 0);
+  CHECK_NEAR(counter("frag"), 1, 0);
+}
+
+static void test_values() {
+  packet("multi:1|c:2|c:3|c");
+  packet("rate:1|c|@0.5\nrate:1|c|@0.25");
+  packet("mixed:5|c:20|ms");
+  packet("set_m:a|s\nset_m:b|s\nset_m:a|s\nset_m:c|s");
+
+  CHECK_NEAR(counter("multi"), 6, 0);
+  CHECK_NEAR(counter("rate"), 6, 0);
+  CHECK_NEAR(counter("mixed"), 5, 0);
+  CHECK_NEAR(timer_sum("mixed"), 20, 0);
+  CHECK_NEAR(set_count("set_m"), 3, 0.05);
+}
+
+static void test_keys() {
+  /* Sanitized as the old parser did: dots to underscores, slashes to dashes */
+  packet("api.v1/users:1|c\nspaces and !bangs:1|c");
+
+  CHECK_NEAR(counter("api_v1-users"), 1, 0);
+  CHECK_NEAR(counter("spacesandbangs"), 1, 0);
+}
+
+static void test_bad_lines() {
+  long bad = atomic_load(&bad_lines_seen);
+
+  /* A bad line costs only itself, not the rest of the packet */
+  packet("good_a:1|c\nbad_value:abc|c\ngood_b:1|c\n:1|c\nbad_type:1|q\ngood_c:1|c");
+
+  CHECK_NEAR(counter("good_a"), 1, 0);
+  CHECK_NEAR(counter("good_b"), 1, 0);
+  CHECK_NEAR(counter("good_c"), 1, 0);
+  CHECK(atomic_load(&bad_lines_seen) - bad == 3);
+}
+
+static void test_length() {
+  uint32_t keys = keys_count();
+
+  /* Only len bytes are the datagram, whatever follows in the buffer */
+  packet_n("len_a:1|c\nlen_b:1|c", 9);
+  CHECK_NEAR(counter("len_a"), 1, 0);
+  CHECK(keys_count() == keys + 1);
+}
+
+static void test_json() {
+  char buf[] = "[{\"counter\":\"json.c\",\"value\":4},{\"timer\":\"json.t\",\"value\":9}]";
+
+  process_json_stats_packet(&agg, buf);
+  CHECK_NEAR(counter("json_c"), 4, 0);
+  CHECK_NEAR(timer_sum("json_t"), 9, 0);
+}
+
+/* The same metrics one per packet and all in one packet end up equal */
+static void test_equivalent() {
+  static const char *lines[] = {
+    "eq_c:1|c", "eq_c:2|c|@0.5", "eq_t:10|ms", "eq_t:30|ms", "eq_t:20|ms",
+    "eq_g:3|g", "eq_g:+2|g", "eq_s:x|s", "eq_s:y|s"
+  };
+  char batch[1024] = "";
+  double c, t, g, s;
+  unsigned i;
+
+  for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    packet(lines[i]);
+  }
+  c = counter("eq_c");
+  t = timer_sum("eq_t");
+  g = gauge("eq_g");
+  s = set_count("eq_s");
+
+  /* Fresh keys for the batched run */
+  for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    strcat(batch, "b");
+    strcat(batch, lines[i]);
+    strcat(batch, "\n");
+  }
+  packet(batch);
+  CHECK_NEAR(counter("beq_c"), c, 0);
+  CHECK_NEAR(timer_sum("beq_t"), t, 0);
+  CHECK(timer("beq_t")->count == 3);
+  CHECK_NEAR(gauge("beq_g"), g, 0);
+  CHECK_NEAR(set_count("beq_s"), s, 0);
+}
+
+int main() {
+  tables_init();
+  agg_init(&agg);
+
+  test_single();
+  test_batched();
+  test_line_endings();
+  test_values();
+  test_keys();
+  test_bad_lines();
+  test_length();
+  test_json();
+  test_equivalent();
+  return CHECK_RESULT;
+}
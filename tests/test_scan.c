@@ -0,0 +1,86 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Every scan kernel the CPU supports against a byte-at-a-time reference:
+ * random buffers thick with delimiters and near misses, of every length
+ * up to a few blocks and at every alignment, must give the same bitmap,
+ * with the bits past len clear whatever the bitmap held before.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/scan.h"
+#include "check.h"
+
+#define SCAN_MAX 300
+
+static uint64_t rng = 1;
+
+static uint64_t next() {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ull;
+}
+
+static void reference(const char *buf, int len, uint64_t *bitmap) {
+  int i;
+  memset(bitmap, 0, SCAN_WORDS(len) * sizeof(uint64_t));
+  for (i = 0; i < len; i++) {
+    char c = buf[i];
+    if (c == '\n' || c == ':' || c == '|' || c == '@') {
+      bitmap[i >> 6] |= (uint64_t) 1 << (i & 63);
+    }
+  }
+}
+
+static void test_kernel(const char *name) {
+  /* Delimiters, their neighbours in ASCII, and bytes with the top bit set */
+  static const char alphabet[] = "\n:|@\t\x0b;{?Aa.0_ \x80\xff\xba\xbc\xc0";
+  char storage[SCAN_MAX + 64];
+  uint64_t expect[SCAN_WORDS(SCAN_MAX)], got[SCAN_WORDS(SCAN_MAX)];
+  int len, offset, round, failures = check_failures;
+
+  if (!scan_select(name)) {
+    printf("%s: not supported here, skipped\n", name);
+    return;
+  }
+  for (round = 0; round < 20; round++) {
+    for (len = 0; len <= SCAN_MAX; len++) {
+      for (offset = 0; offset < 64; offset += 7) {
+        char *buf = storage + offset;
+        int i;
+
+        for (i = 0; i < len; i++) {
+          buf[i] = alphabet[next() % ( sizeof(alphabet) - 1 )];
+        }
+        /* Delimiters right after the end must not show up */
+        memset(buf + len, '|', sizeof(storage) - offset - len);
+        reference(buf, len, expect);
+        memset(got, 0xff, sizeof(got));
+        statsd_scan(buf, len, got);
+        if (memcmp(expect, got, SCAN_WORDS(len) * sizeof(uint64_t)) != 0) {
+          fprintf(stderr, "%s: wrong bitmap for %d bytes at offset %d\n", name, len, offset);
+          check_failures++;
+        }
+        if (check_failures - failures > 10) return;
+      }
+    }
+  }
+  printf("%s: ok\n", name);
+}
+
+int main() {
+  test_kernel("scalar");
+  test_kernel("sse2");
+  test_kernel("avx2");
+  CHECK(!scan_select("nonesuch"));
+  return CHECK_RESULT;
+}
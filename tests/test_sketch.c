@@ -0,0 +1,164 @@
+/*
+ *          STATSD-C
+ *          C port of Etsy's node.js-based statsd server
+ *
+ *          http://github.com/jbuchbinder/statsd-c
+ *
+ */
+
+/*
+ * Timer sketches: every quantile within alpha of the exact one, over
+ * narrow, wide and signed distributions; merged sketches answering as
+ * one sketch of all the samples; mean and standard deviation agreeing
+ * with timer_summarize()'s for exact timers, also for large, tightly
+ * clustered values; stores staying within the bins the alpha needs; and
+ * alphas that need too many bins being refused.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/percentiles.h"
+#include "../src/sketch.h"
+#include "check.h"
+
+#define SAMPLES 200000
+
+static uint64_t rng = 1;
+static double values[SAMPLES], sorted[SAMPLES];
+
+static double uniform() {
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return ( ( rng * 2685821657736338717ull ) >> 11 ) / 9007199254740992.0;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void check_quantiles(const statsd_sketch_t *s, int n, double alpha) {
+  static const double quantiles[] = { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999 };
+  unsigned i;
+
+  memcpy(sorted, values, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compare_double);
+  CHECK_NEAR(sketch_quantile(s, 0), sorted[0], 0);
+  CHECK_NEAR(sketch_quantile(s, 1), sorted[n - 1], 0);
+  for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    long rank = (long) ( quantiles[i] * n + 0.5 );
+    double exact = sorted[rank < 1 ? 0 : rank - 1];
+    CHECK_NEAR(sketch_quantile(s, quantiles[i]), exact, alpha * fabs(exact) + SKETCH_MIN_VALUE);
+  }
+}
+
+static void test_accuracy(double alpha) {
+  int kind, i;
+
+  CHECK(sketch_init(alpha) == 0);
+  for (kind = 0; kind < 3; kind++) {
+    statsd_sketch_t *s = sketch_new();
+    for (i = 0; i < SAMPLES; i++) {
+      double u = uniform();
+      switch (kind) {
+        case 0: values[i] = 1000 * u; break;
+        case 1: values[i] = pow(10, -8 + 19 * u); break;
+        default: values[i] = ( u < 0.3 ? -1 : 1 ) * pow(10, 6 * uniform()); break;
+      }
+      sketch_add(s, values[i]);
+    }
+    check_quantiles(s, SAMPLES, alpha);
+    sketch_free(s);
+  }
+}
+
+static void test_merge() {
+  statsd_sketch_t *a = sketch_new(), *b = sketch_new();
+  int i;
+
+  CHECK(sketch_init(0.01) == 0);
+  /* Disjoint ranges, so the merge has to grow the store both ways */
+  for (i = 0; i < SAMPLES; i++) {
+    values[i] = i < SAMPLES / 2 ? 1e4 + 1e5 * uniform() : 0.001 + 0.01 * uniform();
+    sketch_add(i < SAMPLES / 2 ? a : b, values[i]);
+  }
+  sketch_merge(a, b);
+  CHECK(a->count == SAMPLES);
+  check_quantiles(a, SAMPLES, 0.01);
+  sketch_free(a);
+  sketch_free(b);
+}
+
+/* Sketched in one piece and merged from uneven parts, as timer_summarize() sees them */
+static void check_moments(int n, int parts) {
+  statsd_sketch_t *whole = sketch_new(), *merged = sketch_new();
+  statsd_timer_summary_t exact;
+  int part, i;
+
+  for (i = 0; i < n; i++) sketch_add(whole, values[i]);
+  for (part = 0, i = 0; part < parts; part++) {
+    statsd_sketch_t *s = sketch_new();
+    int end = part == parts - 1 ? n : i + ( n - i ) / 3;
+    for (; i < end; i++) sketch_add(s, values[i]);
+    sketch_merge(merged, s);
+    sketch_free(s);
+  }
+  timer_summarize(values, n, &exact);
+  CHECK(exact.stddev > 0);
+  CHECK_NEAR(whole->mean, exact.mean, 1e-12 * fabs(exact.mean));
+  CHECK_NEAR(merged->mean, exact.mean, 1e-12 * fabs(exact.mean));
+  CHECK_NEAR(sqrt(whole->m2 / whole->count), exact.stddev, 1e-6 * exact.stddev);
+  CHECK_NEAR(sqrt(merged->m2 / merged->count), exact.stddev, 1e-6 * exact.stddev);
+  sketch_free(whole);
+  sketch_free(merged);
+}
+
+static void test_moments() {
+  int i;
+
+  CHECK(sketch_init(0.01) == 0);
+  /* Spread out, then nanosecond latencies a few counts apart around 1e9 */
+  for (i = 0; i < SAMPLES; i++) values[i] = 1000 * uniform() - 100;
+  check_moments(SAMPLES, 5);
+  for (i = 0; i < SAMPLES; i++) values[i] = 1e9 + (int) ( 8 * uniform() );
+  check_moments(SAMPLES, 5);
+}
+
+static void test_range() {
+  statsd_sketch_t *s = sketch_new();
+  double bins;
+  int i;
+
+  CHECK(sketch_init(0.001) == 0);
+  bins = ceil(log(SKETCH_MAX_VALUE / SKETCH_MIN_VALUE) / log(1.001 / 0.999)) + 1;
+
+  /* Ever smaller values, then past both ends; the smallest count as zero */
+  for (i = 0; i < 1500; i++) sketch_add(s, 1e6 * pow(0.98, i));
+  sketch_add(s, 1e-12);
+  sketch_add(s, 1e-300);
+  sketch_add(s, 1e15);
+  sketch_add(s, 1e300);
+  CHECK(s->pos.len <= bins);
+  CHECK(s->count == 1504 && s->zero_count == 2);
+  CHECK_NEAR(sketch_quantile(s, 1), 1e300, 0);
+  CHECK_NEAR(sketch_quantile(s, 0), 1e-300, 0);
+  sketch_free(s);
+
+  /* Too fine to cover the range, or not an accuracy at all */
+  CHECK(sketch_init(0.0001) < 0);
+  CHECK(sketch_init(0) < 0);
+  CHECK(sketch_init(1) < 0);
+  CHECK(sketch_alpha == 0.001);
+}
+
+int main() {
+  test_accuracy(0.01);
+  test_accuracy(0.001);
+  test_merge();
+  test_moments();
+  test_range();
+  return CHECK_RESULT;
+}